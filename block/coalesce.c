@@ -0,0 +1,628 @@
+/*
+ * Block filter that coalesces sequential writes and reads ahead
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guests on emulated controllers often issue a stream of tiny sequential
+ * requests, one at a time.  This filter sits on top of an image and
+ *
+ * - buffers small writes and extends the buffer while following writes are
+ *   contiguous.  The buffer is written back as one request when it is full,
+ *   when a non-contiguous write or an overlapping request arrives, when the
+ *   guest flushes, or at the latest write-delay-ns after the first write
+ *   went into it.  Buffered writes complete immediately, so the buffer
+ *   behaves like a volatile disk write cache: a failed write back is
+ *   reported by the next flush.  With cache.writeback=off every write is
+ *   followed by a flush and nothing is held back.
+ *
+ * - detects sequential reads and reads ahead of them into a buffer.  The
+ *   read-ahead window starts small and doubles with every further
+ *   sequential read up to the configured maximum; a random read resets it.
+ *   Writes, discards and zero writes invalidate the read-ahead buffer.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/cutils.h"
+#include "qemu/range.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+#define COALESCE_OPT_WRITE_WINDOW       "write-window"
+#define COALESCE_OPT_WRITE_DELAY_NS     "write-delay-ns"
+#define COALESCE_OPT_READAHEAD          "readahead"
+
+#define COALESCE_DEFAULT_WRITE_WINDOW   (64 * 1024)
+#define COALESCE_DEFAULT_WRITE_DELAY_NS (1 * SCALE_MS)
+#define COALESCE_DEFAULT_READAHEAD      (256 * 1024)
+
+/* Upper limit for both buffers */
+#define COALESCE_MAX_BUFFER_SIZE        (16 * 1024 * 1024)
+
+/* Initial read-ahead window, in sectors */
+#define COALESCE_READAHEAD_MIN          (16 * 1024 / BDRV_SECTOR_SIZE)
+
+typedef struct BDRVCoalesceState {
+    /* Protects the write buffer */
+    CoMutex lock;
+
+    /* Write coalescing; sizes are in sectors */
+    int write_window;
+    int64_t write_delay_ns;
+    QEMUTimer *write_timer;
+    uint8_t *wbuf;
+    int64_t wbuf_sector;
+    int wbuf_sectors;
+    int write_error;
+
+    /* Read-ahead; sizes are in sectors */
+    int readahead_max;
+    int readahead;
+    int64_t next_read_sector;
+    uint8_t *rbuf;
+    int64_t rbuf_sector;
+    int rbuf_sectors;
+    unsigned rbuf_gen;
+
+    /* Statistics for query-blockstats */
+    uint64_t write_merged;
+    uint64_t write_backs;
+    uint64_t read_hits;
+    uint64_t read_misses;
+    uint64_t readahead_bytes;
+} BDRVCoalesceState;
+
+/* Valid filenames look like coalesce:path/to/image */
+static void coalesce_parse_filename(const char *filename, QDict *options,
+                                    Error **errp)
+{
+    /* There is nothing to parse besides the prefix, which is optional */
+    strstart(filename, "coalesce:", &filename);
+
+    qdict_put(options, "x-image", qstring_from_str(filename));
+}
+
+static QemuOptsList runtime_opts = {
+    .name = "coalesce",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "x-image",
+            .type = QEMU_OPT_STRING,
+            .help = "[internal use only, will be removed]",
+        },
+        {
+            .name = COALESCE_OPT_WRITE_WINDOW,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of a coalesced write (0 disables write "
+                    "coalescing)",
+        },
+        {
+            .name = COALESCE_OPT_WRITE_DELAY_NS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum time in nanoseconds that a write is buffered",
+        },
+        {
+            .name = COALESCE_OPT_READAHEAD,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum read-ahead size (0 disables read-ahead)",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*
+ * Drop the read-ahead buffer if it overlaps the given range.
+ *
+ * The generation count is bumped for every modification, so that a
+ * read-ahead that is in flight while the image changes is not installed.
+ * Direct requests call this both before and after the I/O.
+ */
+static void coalesce_invalidate_readahead(BDRVCoalesceState *s,
+                                          int64_t sector_num, int nb_sectors)
+{
+    s->rbuf_gen++;
+    if (s->rbuf_sectors &&
+        ranges_overlap(s->rbuf_sector, s->rbuf_sectors,
+                       sector_num, nb_sectors)) {
+        s->rbuf_sectors = 0;
+    }
+}
+
+/* Called with s->lock held */
+static int coroutine_fn coalesce_write_back(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    if (!s->wbuf_sectors) {
+        return 0;
+    }
+
+    timer_del(s->write_timer);
+
+    iov = (struct iovec) {
+        .iov_base   = s->wbuf,
+        .iov_len    = s->wbuf_sectors * BDRV_SECTOR_SIZE,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    trace_coalesce_write_back(bs, s->wbuf_sector, s->wbuf_sectors);
+    ret = bdrv_co_writev(bs->file->bs, s->wbuf_sector, s->wbuf_sectors, &qiov);
+    s->wbuf_sectors = 0;
+    s->write_backs++;
+
+    /* The guest has already seen these writes complete */
+    if (ret < 0 && !s->write_error) {
+        s->write_error = ret;
+    }
+    return ret;
+}
+
+/* Write back the buffer if it overlaps the given range */
+static int coroutine_fn coalesce_write_back_range(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  int nb_sectors)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret = 0;
+
+    if (!s->wbuf_sectors ||
+        !ranges_overlap(s->wbuf_sector, s->wbuf_sectors,
+                        sector_num, nb_sectors)) {
+        return 0;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (s->wbuf_sectors &&
+        ranges_overlap(s->wbuf_sector, s->wbuf_sectors,
+                       sector_num, nb_sectors)) {
+        ret = coalesce_write_back(bs);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static void coroutine_fn coalesce_write_back_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVCoalesceState *s = bs->opaque;
+
+    qemu_co_mutex_lock(&s->lock);
+    coalesce_write_back(bs);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static void coalesce_write_timer_cb(void *opaque)
+{
+    Coroutine *co = qemu_coroutine_create(coalesce_write_back_entry);
+
+    qemu_coroutine_enter(co, opaque);
+}
+
+static void coalesce_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    timer_del(s->write_timer);
+    timer_free(s->write_timer);
+    s->write_timer = NULL;
+}
+
+static void coalesce_attach_aio_context(BlockDriverState *bs,
+                                        AioContext *new_context)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    s->write_timer = aio_timer_new(new_context, QEMU_CLOCK_REALTIME, SCALE_NS,
+                                   coalesce_write_timer_cb, bs);
+}
+
+static int coalesce_open(BlockDriverState *bs, QDict *options, int flags,
+                         Error **errp)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    uint64_t write_window, readahead;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    write_window = qemu_opt_get_size(opts, COALESCE_OPT_WRITE_WINDOW,
+                                     COALESCE_DEFAULT_WRITE_WINDOW);
+    readahead = qemu_opt_get_size(opts, COALESCE_OPT_READAHEAD,
+                                  COALESCE_DEFAULT_READAHEAD);
+    s->write_delay_ns = qemu_opt_get_number(opts, COALESCE_OPT_WRITE_DELAY_NS,
+                                            COALESCE_DEFAULT_WRITE_DELAY_NS);
+
+    if (write_window % BDRV_SECTOR_SIZE ||
+        write_window > COALESCE_MAX_BUFFER_SIZE) {
+        error_setg(errp, COALESCE_OPT_WRITE_WINDOW " must be a multiple of 512 "
+                   "and at most %d", COALESCE_MAX_BUFFER_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (readahead % BDRV_SECTOR_SIZE || readahead > COALESCE_MAX_BUFFER_SIZE) {
+        error_setg(errp, COALESCE_OPT_READAHEAD " must be a multiple of 512 "
+                   "and at most %d", COALESCE_MAX_BUFFER_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+    if (s->write_delay_ns < 0) {
+        error_setg(errp, COALESCE_OPT_WRITE_DELAY_NS " is out of range");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Open the image file */
+    bs->file = bdrv_open_child(qemu_opt_get(opts, "x-image"), options, "image",
+                               bs, &child_format, false, &local_err);
+    if (local_err) {
+        ret = -EINVAL;
+        error_propagate(errp, local_err);
+        goto out;
+    }
+
+    s->write_window = write_window / BDRV_SECTOR_SIZE;
+    if (s->write_window) {
+        s->wbuf = qemu_try_blockalign(bs->file->bs, write_window);
+        if (s->wbuf == NULL) {
+            error_setg(errp, "Could not allocate write buffer");
+            ret = -ENOMEM;
+            goto fail_unref;
+        }
+    }
+
+    s->readahead_max = readahead / BDRV_SECTOR_SIZE;
+    s->next_read_sector = -1;
+
+    qemu_co_mutex_init(&s->lock);
+    coalesce_attach_aio_context(bs, bdrv_get_aio_context(bs));
+
+    ret = 0;
+    goto out;
+
+fail_unref:
+    bdrv_unref_child(bs, bs->file);
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void coalesce_close(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    /* bdrv_close() has flushed, so the write buffer is empty */
+    assert(!s->wbuf_sectors);
+
+    coalesce_detach_aio_context(bs);
+    qemu_vfree(s->wbuf);
+    qemu_vfree(s->rbuf);
+}
+
+static int coalesce_reopen_prepare(BDRVReopenState *reopen_state,
+                                   BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void coalesce_drain(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+
+    /* Write back now rather than when the timer expires */
+    if (timer_pending(s->write_timer)) {
+        timer_del(s->write_timer);
+        coalesce_write_timer_cb(bs);
+    }
+}
+
+static int coroutine_fn coalesce_co_readv(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    QEMUIOVector local_qiov;
+    struct iovec iov;
+    int64_t len;
+    unsigned gen;
+    uint8_t *buf;
+    bool sequential;
+    int ret;
+
+    /* Buffered writes must reach the image before they can be read back */
+    ret = coalesce_write_back_range(bs, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!s->readahead_max) {
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+
+    sequential = sector_num == s->next_read_sector;
+    s->next_read_sector = sector_num + nb_sectors;
+
+    if (s->rbuf_sectors && sector_num >= s->rbuf_sector &&
+        sector_num + nb_sectors <= s->rbuf_sector + s->rbuf_sectors) {
+        s->read_hits++;
+        qemu_iovec_from_buf(qiov, 0,
+                            s->rbuf + (sector_num - s->rbuf_sector) *
+                                      BDRV_SECTOR_SIZE,
+                            nb_sectors * BDRV_SECTOR_SIZE);
+        return 0;
+    }
+
+    s->read_misses++;
+    if (!sequential) {
+        s->readahead = 0;
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+
+    if (s->readahead) {
+        s->readahead = MIN(s->readahead * 2, s->readahead_max);
+    } else {
+        s->readahead = MIN(COALESCE_READAHEAD_MIN, s->readahead_max);
+    }
+
+    /* Stay within the image and in front of any buffered writes */
+    len = bdrv_nb_sectors(bs->file->bs);
+    if (len < 0) {
+        return len;
+    }
+    len = MIN(len - sector_num, nb_sectors + s->readahead);
+    if (s->wbuf_sectors && s->wbuf_sector > sector_num) {
+        len = MIN(len, s->wbuf_sector - sector_num);
+    }
+
+    buf = len > nb_sectors ?
+          qemu_try_blockalign(bs->file->bs, len * BDRV_SECTOR_SIZE) : NULL;
+    if (buf == NULL) {
+        return bdrv_co_readv(bs->file->bs, sector_num, nb_sectors, qiov);
+    }
+
+    trace_coalesce_readahead(bs, sector_num, nb_sectors, len - nb_sectors);
+
+    iov = (struct iovec) {
+        .iov_base   = buf,
+        .iov_len    = len * BDRV_SECTOR_SIZE,
+    };
+    qemu_iovec_init_external(&local_qiov, &iov, 1);
+
+    gen = s->rbuf_gen;
+    ret = bdrv_co_readv(bs->file->bs, sector_num, len, &local_qiov);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, 0, buf, nb_sectors * BDRV_SECTOR_SIZE);
+    s->readahead_bytes += (len - nb_sectors) * BDRV_SECTOR_SIZE;
+
+    if (gen == s->rbuf_gen) {
+        qemu_vfree(s->rbuf);
+        s->rbuf = buf;
+        s->rbuf_sector = sector_num;
+        s->rbuf_sectors = len;
+    } else {
+        qemu_vfree(buf);
+    }
+    return 0;
+}
+
+static int coroutine_fn coalesce_co_writev(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+
+    /* Large requests gain nothing from buffering */
+    if (nb_sectors > s->write_window) {
+        ret = coalesce_write_back_range(bs, sector_num, nb_sectors);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = bdrv_co_writev(bs->file->bs, sector_num, nb_sectors, qiov);
+        coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    if (s->wbuf_sectors &&
+        sector_num == s->wbuf_sector + s->wbuf_sectors &&
+        s->wbuf_sectors + nb_sectors <= s->write_window) {
+        s->write_merged++;
+    } else {
+        /* Errors are latched for the next flush, carry on regardless */
+        coalesce_write_back(bs);
+        s->wbuf_sector = sector_num;
+    }
+
+    qemu_iovec_to_buf(qiov, 0, s->wbuf + s->wbuf_sectors * BDRV_SECTOR_SIZE,
+                      nb_sectors * BDRV_SECTOR_SIZE);
+    s->wbuf_sectors += nb_sectors;
+    trace_coalesce_write_buffered(bs, sector_num, nb_sectors,
+                                  s->wbuf_sectors);
+
+    if (s->wbuf_sectors == s->write_window) {
+        coalesce_write_back(bs);
+    } else if (!timer_pending(s->write_timer)) {
+        timer_mod(s->write_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                                  s->write_delay_ns);
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int coroutine_fn coalesce_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+    ret = coalesce_write_back_range(bs, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_write_zeroes(bs->file->bs, sector_num, nb_sectors, flags);
+    coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+    return ret;
+}
+
+static int coroutine_fn coalesce_co_discard(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+    ret = coalesce_write_back_range(bs, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
+    coalesce_invalidate_readahead(s, sector_num, nb_sectors);
+    return ret;
+}
+
+static int coroutine_fn coalesce_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    coalesce_write_back(bs);
+    ret = s->write_error;
+    s->write_error = 0;
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int64_t coroutine_fn coalesce_co_get_block_status(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, int *pnum, BlockDriverState **file)
+{
+    int ret;
+
+    /* Buffered writes are not in the image yet */
+    ret = coalesce_write_back_range(bs, sector_num, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    *pnum = nb_sectors;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID |
+           (sector_num << BDRV_SECTOR_BITS);
+}
+
+static int64_t coalesce_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coalesce_truncate(BlockDriverState *bs, int64_t offset)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    int ret;
+
+    /* Buffered writes may lie beyond the new end of the image */
+    ret = bdrv_flush(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->rbuf_gen++;
+    s->rbuf_sectors = 0;
+    return bdrv_truncate(bs->file->bs, offset);
+}
+
+static void coalesce_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl = bs->file->bs->bl;
+}
+
+static bool coalesce_recurse_is_first_non_filter(BlockDriverState *bs,
+                                                 BlockDriverState *candidate)
+{
+    return bdrv_recurse_is_first_non_filter(bs->file->bs, candidate);
+}
+
+static BlockStatsSpecific *coalesce_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVCoalesceState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .type  = BLOCK_STATS_SPECIFIC_KIND_COALESCE,
+        .u.coalesce.data = g_new(BlockStatsSpecificCoalesce, 1),
+    };
+    *stats->u.coalesce.data = (BlockStatsSpecificCoalesce){
+        .write_merged       = s->write_merged,
+        .write_backs        = s->write_backs,
+        .read_hits          = s->read_hits,
+        .read_misses        = s->read_misses,
+        .readahead_bytes    = s->readahead_bytes,
+    };
+
+    return stats;
+}
+
+static BlockDriver bdrv_coalesce = {
+    .format_name            = "coalesce",
+    .protocol_name          = "coalesce",
+    .instance_size          = sizeof(BDRVCoalesceState),
+
+    .bdrv_parse_filename    = coalesce_parse_filename,
+    .bdrv_file_open         = coalesce_open,
+    .bdrv_close             = coalesce_close,
+    .bdrv_reopen_prepare    = coalesce_reopen_prepare,
+    .bdrv_getlength         = coalesce_getlength,
+    .bdrv_truncate          = coalesce_truncate,
+    .bdrv_refresh_limits    = coalesce_refresh_limits,
+
+    .bdrv_co_readv          = coalesce_co_readv,
+    .bdrv_co_writev         = coalesce_co_writev,
+    .bdrv_co_write_zeroes   = coalesce_co_write_zeroes,
+    .bdrv_co_discard        = coalesce_co_discard,
+    .bdrv_co_flush_to_os    = coalesce_co_flush_to_os,
+    .bdrv_co_get_block_status = coalesce_co_get_block_status,
+
+    .bdrv_drain             = coalesce_drain,
+    .bdrv_detach_aio_context = coalesce_detach_aio_context,
+    .bdrv_attach_aio_context = coalesce_attach_aio_context,
+    .bdrv_get_specific_stats = coalesce_get_specific_stats,
+
+    .is_filter              = true,
+    .bdrv_recurse_is_first_non_filter = coalesce_recurse_is_first_non_filter,
+};
+
+static void bdrv_coalesce_init(void)
+{
+    bdrv_register(&bdrv_coalesce);
+}
+
+block_init(bdrv_coalesce_init);
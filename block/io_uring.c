@@ -0,0 +1,630 @@
+/*
+ * Linux io_uring support.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/notify.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "exec/cpu-common.h"
+#include "trace.h"
+
+#include <linux/falloc.h>
+#include <liburing.h>
+
+/*
+ * Ring size (per-device).  Requests beyond this are queued in userspace
+ * until completions make room, so unlike linux-aio this never fails a
+ * request with EAGAIN.
+ */
+#define MAX_ENTRIES 128
+
+/* The kernel refuses to register buffers larger than this */
+#define MAX_FIXED_BUFFER_SIZE (1ULL << 30)
+
+typedef struct LuringAIOCB {
+    BlockAIOCB common;
+    LuringState *s;
+    int fd;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+
+    /* Index of the registered buffer the request lies in, or -1 */
+    int buf_index;
+
+    /* Remainder of a short transfer, see luring_resubmit_short() */
+    QEMUIOVector resubmit_qiov;
+    size_t done;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef QSIMPLEQ_HEAD(LuringAIOCBList, LuringAIOCB) LuringAIOCBList;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing */
+    QEMUBH *completion_bh;
+    bool poll;
+
+    bool has_fallocate;
+
+    /*
+     * Guest RAM registered with the ring for READ_FIXED/WRITE_FIXED, as
+     * it was when ram_version was current.
+     */
+    bool fixed_buffers;
+    bool ram_registered;
+    uint32_t ram_version;
+    Notifier machine_init_done;
+    struct iovec *bufs;
+    int nb_bufs;
+};
+
+static bool luring_check_guest_ram(LuringState *s);
+
+static void ioq_submit(LuringState *s);
+
+static int luring_find_fixed_buffer(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    int i;
+
+    if (qiov->niov != 1) {
+        return -1;
+    }
+
+    start = (uintptr_t) qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+    for (i = 0; i < s->nb_bufs; i++) {
+        uintptr_t base = (uintptr_t) s->bufs[i].iov_base;
+
+        if (start >= base && end <= base + s->bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void luring_prep_sqe(struct io_uring_sqe *sqe, LuringAIOCB *luringcb)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+    off_t offset = luringcb->offset;
+
+    /* Resubmitted requests only transfer what is left */
+    if (luringcb->done) {
+        qiov = &luringcb->resubmit_qiov;
+        offset += luringcb->done;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        if (luringcb->buf_index >= 0 && !luringcb->done) {
+            io_uring_prep_write_fixed(sqe, luringcb->fd,
+                                      qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset,
+                                      luringcb->buf_index);
+        } else {
+            io_uring_prep_writev(sqe, luringcb->fd, qiov->iov, qiov->niov,
+                                 offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        if (luringcb->buf_index >= 0 && !luringcb->done) {
+            io_uring_prep_read_fixed(sqe, luringcb->fd,
+                                     qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset,
+                                     luringcb->buf_index);
+        } else {
+            io_uring_prep_readv(sqe, luringcb->fd, qiov->iov, qiov->niov,
+                                offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, luringcb->fd, IORING_FSYNC_DATASYNC);
+        break;
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqe, luringcb->fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                offset, luringcb->nbytes);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *luringcb)
+{
+    int ret = luringcb->ret;
+
+    if (luringcb->type == QEMU_AIO_READ || luringcb->type == QEMU_AIO_WRITE) {
+        if (ret >= 0) {
+            ret = 0;
+        }
+        if (luringcb->done) {
+            qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        }
+    } else if (ret == -EOPNOTSUPP) {
+        ret = -ENOTSUP;
+    }
+
+    trace_luring_process_completion(s, luringcb, ret);
+    luringcb->common.cb(luringcb->common.opaque, ret);
+
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * Buffered I/O may transfer less than requested.  Queue the rest again
+ * (ahead of everything else, so that it is not reordered behind later
+ * requests); a read that hits EOF is padded with zeroes instead.
+ *
+ * Returns true if the request was requeued.
+ */
+static bool luring_resubmit_short(LuringState *s, LuringAIOCB *luringcb,
+                                  int res)
+{
+    size_t remaining;
+
+    luringcb->done += res;
+    remaining = luringcb->nbytes - luringcb->done;
+
+    if (luringcb->type == QEMU_AIO_READ && res == 0) {
+        qemu_iovec_memset(luringcb->qiov, luringcb->done, 0, remaining);
+        luringcb->ret = luringcb->nbytes;
+        return false;
+    }
+    if (luringcb->type == QEMU_AIO_WRITE && res == 0) {
+        luringcb->ret = -EIO;
+        return false;
+    }
+
+    trace_luring_resubmit_short(s, luringcb, luringcb->done, remaining);
+
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_reset(&luringcb->resubmit_qiov);
+    } else {
+        qemu_iovec_init(&luringcb->resubmit_qiov, luringcb->qiov->niov);
+    }
+    qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                      luringcb->done, remaining);
+
+    QSIMPLEQ_INSERT_HEAD(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    return true;
+}
+
+static void luring_reap_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+        s->io_q.in_flight--;
+
+        if (res == -EINTR || res == -EAGAIN) {
+            QSIMPLEQ_INSERT_HEAD(&s->io_q.submit_queue, luringcb, next);
+            s->io_q.in_queue++;
+            continue;
+        }
+
+        if ((luringcb->type == QEMU_AIO_READ ||
+             luringcb->type == QEMU_AIO_WRITE) &&
+            res >= 0 && luringcb->done + res < luringcb->nbytes) {
+            if (luring_resubmit_short(s, luringcb, res)) {
+                continue;
+            }
+        } else {
+            luringcb->ret = res;
+        }
+
+        luring_process_completion(s, luringcb);
+    }
+}
+
+/* The completion BH fetches completed I/O requests and invokes their
+ * callbacks.
+ *
+ * Like the linux-aio one, it reschedules itself before running callbacks
+ * so that nested event loops see the remaining completions.  In polling
+ * mode it also stays scheduled while requests are in flight, so that
+ * completions are picked up from the ring without waiting for the eventfd.
+ */
+static void luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    luring_reap_completions(s);
+
+    if (!s->io_q.plugged && (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) ||
+                             io_uring_sq_ready(&s->ring))) {
+        ioq_submit(s);
+    }
+
+    if ((!s->poll || !s->io_q.in_flight) && !io_uring_sq_ready(&s->ring)) {
+        qemu_bh_cancel(s->completion_bh);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+}
+
+/* Busy polling: check the CQ ring without entering the kernel */
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_completion_bh(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+};
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+/*
+ * io_uring_submit() has already published the SQEs in the SQ ring, but
+ * on error the kernel has consumed none of them.  Take them all back, so
+ * that the ring is usable again, and return their requests in @failed.
+ */
+static void luring_take_back_sqes(LuringState *s, LuringAIOCBList *failed)
+{
+    struct io_uring_sq *sq = &s->ring.sq;
+    unsigned head = atomic_read(sq->khead);
+    unsigned tail = *sq->ktail;
+    unsigned i;
+
+    for (i = head; i != tail; i++) {
+        struct io_uring_sqe *sqe = &sq->sqes[sq->array[i & *sq->kring_mask]];
+        LuringAIOCB *luringcb = (LuringAIOCB *)(uintptr_t)sqe->user_data;
+
+        QSIMPLEQ_INSERT_TAIL(failed, luringcb, next);
+        s->io_q.in_flight--;
+    }
+    atomic_mb_set(sq->ktail, head);
+    sq->sqe_head = sq->sqe_tail = head;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    LuringAIOCBList failed = QSIMPLEQ_HEAD_INITIALIZER(failed);
+    int ret = 0, queued = 0;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) &&
+           s->io_q.in_flight + queued < MAX_ENTRIES) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+
+        if (!sqe) {
+            break;
+        }
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        s->io_q.in_queue--;
+
+        luring_prep_sqe(sqe, luringcb);
+        queued++;
+    }
+
+    s->io_q.in_flight += queued;
+
+    /* This also picks up SQEs left in the ring by an earlier attempt */
+    if (io_uring_sq_ready(&s->ring)) {
+        do {
+            ret = io_uring_submit(&s->ring);
+        } while (ret == -EINTR);
+        trace_luring_io_uring_submit(s, queued, ret);
+        if (ret < 0 && ret != -EAGAIN && ret != -EBUSY) {
+            luring_take_back_sqes(s, &failed);
+        }
+    }
+
+    /*
+     * On -EAGAIN and -EBUSY the SQEs stay in the ring, as if it was full:
+     * hold back new requests and retry from the completion BH, which
+     * reaps the completions the kernel is waiting for.
+     */
+    s->io_q.blocked = (s->io_q.in_queue > 0) || io_uring_sq_ready(&s->ring);
+
+    if ((s->poll && s->io_q.in_flight) || io_uring_sq_ready(&s->ring)) {
+        qemu_bh_schedule(s->completion_bh);
+    }
+
+    while ((luringcb = QSIMPLEQ_FIRST(&failed))) {
+        QSIMPLEQ_REMOVE_HEAD(&failed, next);
+        luringcb->ret = ret;
+        luring_process_completion(s, luringcb);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s, bool unplug)
+{
+    assert(s->io_q.plugged > 0 || !unplug);
+
+    if (unplug && --s->io_q.plugged > 0) {
+        return;
+    }
+
+    if (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue) ||
+        io_uring_sq_ready(&s->ring)) {
+        ioq_submit(s);
+    }
+}
+
+bool luring_supports(LuringState *s, int type)
+{
+    switch (type & QEMU_AIO_TYPE_MASK) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_FLUSH:
+        return true;
+    case QEMU_AIO_DISCARD:
+        /* Block devices need BLKDISCARD, which io_uring can't do */
+        return s->has_fallocate && !(type & QEMU_AIO_BLKDEV);
+    default:
+        return false;
+    }
+}
+
+BlockAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *luringcb;
+
+    assert(luring_supports(s, type));
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->s = s;
+    luringcb->fd = fd;
+    luringcb->type = type & QEMU_AIO_TYPE_MASK;
+    luringcb->offset = sector_num * BDRV_SECTOR_SIZE;
+    luringcb->nbytes = (size_t) nb_sectors * BDRV_SECTOR_SIZE;
+    luringcb->qiov = qiov;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->buf_index = -1;
+    luringcb->done = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    if (qiov && luring_check_guest_ram(s)) {
+        luringcb->buf_index = luring_find_fixed_buffer(s, qiov);
+    }
+
+    trace_luring_submit(s, luringcb, luringcb->type, sector_num, nb_sectors,
+                        luringcb->buf_index);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged || s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, false, NULL);
+    qemu_bh_delete(s->completion_bh);
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->completion_bh = aio_bh_new(new_context, luring_completion_bh, s);
+    aio_set_event_notifier_poll(new_context, &s->e, false,
+                                luring_completion_cb, luring_poll_cb);
+}
+
+static int luring_add_ram_block(const char *block_name, void *host_addr,
+                                ram_addr_t offset, ram_addr_t length,
+                                void *opaque)
+{
+    LuringState *s = opaque;
+    uint8_t *host = host_addr;
+
+    while (length > 0) {
+        size_t len = MIN(length, MAX_FIXED_BUFFER_SIZE);
+
+        s->bufs = g_renew(struct iovec, s->bufs, s->nb_bufs + 1);
+        s->bufs[s->nb_bufs].iov_base = host;
+        s->bufs[s->nb_bufs].iov_len = len;
+        s->nb_bufs++;
+
+        host += len;
+        length -= len;
+    }
+    return 0;
+}
+
+static void luring_register_guest_ram(LuringState *s)
+{
+    int ret;
+
+    s->ram_registered = true;
+    s->ram_version = qemu_ram_list_version();
+    qemu_ram_foreach_block(luring_add_ram_block, s);
+    if (!s->nb_bufs) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->bufs, s->nb_bufs);
+    trace_luring_register_buffers(s, s->nb_bufs, ret);
+    if (ret < 0) {
+        /* Typically RLIMIT_MEMLOCK; plain readv/writev still work */
+        error_report("io_uring: could not register guest RAM: %s",
+                     strerror(-ret));
+        g_free(s->bufs);
+        s->bufs = NULL;
+        s->nb_bufs = 0;
+    }
+}
+
+static void luring_unregister_guest_ram(LuringState *s)
+{
+    trace_luring_unregister_buffers(s, s->nb_bufs);
+    if (s->nb_bufs) {
+        io_uring_unregister_buffers(&s->ring);
+    }
+    g_free(s->bufs);
+    s->bufs = NULL;
+    s->nb_bufs = 0;
+}
+
+/*
+ * Whether new requests may use the registered buffers.  Memory hotplug
+ * and unplug leave the registration stale, redo it as soon as no request
+ * in the ring can still refer to the old table; until then new requests
+ * use plain readv/writev.
+ */
+static bool luring_check_guest_ram(LuringState *s)
+{
+    if (!s->ram_registered) {
+        return false;
+    }
+    if (s->ram_version != qemu_ram_list_version()) {
+        if (s->io_q.in_flight || s->io_q.in_queue) {
+            return false;
+        }
+        luring_unregister_guest_ram(s);
+        luring_register_guest_ram(s);
+    }
+    return s->nb_bufs > 0;
+}
+
+/*
+ * Guest RAM only exists once the machine is set up, which is after the
+ * drives have been opened; register it from a machine init done notifier.
+ * This pins the memory, so it is only done when explicitly requested.
+ */
+static void luring_machine_init_done(Notifier *n, void *unused)
+{
+    LuringState *s = container_of(n, LuringState, machine_init_done);
+
+    luring_register_guest_ram(s);
+}
+
+LuringState *luring_init(bool poll, bool fixed_buffers, Error **errp)
+{
+    LuringState *s;
+    struct io_uring_probe *probe;
+    int ret;
+
+    s = g_new0(LuringState, 1);
+    s->poll = poll;
+    s->fixed_buffers = fixed_buffers;
+
+    ret = event_notifier_init(&s->e, false);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to initialize event notifier");
+        goto out_free_state;
+    }
+
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to set up io_uring");
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register io_uring eventfd");
+        goto out_exit_ring;
+    }
+
+    /* Kernels without opcode probing predate IORING_OP_FALLOCATE as well */
+    probe = io_uring_get_probe_ring(&s->ring);
+    if (probe) {
+        s->has_fallocate = io_uring_opcode_supported(probe,
+                                                     IORING_OP_FALLOCATE);
+        io_uring_free_probe(probe);
+    }
+
+    ioq_init(&s->io_q);
+
+    if (fixed_buffers) {
+        s->machine_init_done.notify = luring_machine_init_done;
+        qemu_add_machine_init_done_notifier(&s->machine_init_done);
+    }
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    /* The notifier list is never set up in the tools */
+    if (s->machine_init_done.node.le_prev) {
+        notifier_remove(&s->machine_init_done);
+    }
+
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s->bufs);
+    g_free(s);
+}
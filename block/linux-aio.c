@@ -153,6 +153,40 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* The completion ring that io_setup() maps into our address space; the
+ * io_context_t handle is its address.  This layout is kernel ABI.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Busy polling: peek at the completion ring without entering the kernel */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (s->event_idx == s->event_max &&
+        (ring->magic != AIO_RING_MAGIC ||
+         atomic_read(&ring->head) == atomic_read(&ring->tail))) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -297,8 +331,9 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     struct qemu_laio_state *s = s_;
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
-    aio_set_event_notifier(new_context, &s->e, false,
-                           qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, false,
+                                qemu_laio_completion_cb,
+                                qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -0,0 +1,1065 @@
+/*
+ * Bitmaps for the QCOW version 2 format
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Persistent dirty bitmaps live in the bitmaps header extension, see
+ * docs/specs/qcow2.txt.  They are loaded when the image is opened (or, for
+ * an incoming migration, when it is activated) and written back as a whole
+ * when the image is closed or inactivated.
+ *
+ * While an image is open read-write, all bitmaps it holds are flagged
+ * in_use on disk.  A bitmap that still has the flag when the image is
+ * opened was not saved, e.g. because QEMU crashed; such a bitmap is not
+ * loaded and is dropped from the image the next time bitmaps are stored.
+ * Incremental backups based on it then fail instead of silently missing
+ * writes.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/dirty-bitmap.h"
+#include "block/qcow2.h"
+
+/* BME is short for Bitmaps Extension; the prefix is local to this file */
+
+/* Bitmap directory entry constraints */
+#define BME_MAX_TABLE_SIZE 0x8000000
+#define BME_MAX_GRANULARITY_BITS 31
+#define BME_MIN_GRANULARITY_BITS 9
+#define BME_MAX_NAME_SIZE 1023
+
+/* Bitmap directory entry flags */
+#define BME_RESERVED_FLAGS 0xfffffff8U
+#define BME_FLAG_IN_USE (1U << 0)
+#define BME_FLAG_AUTO   (1U << 1)
+#define BME_FLAG_EXTRA_DATA_COMPATIBLE (1U << 2)
+
+/* Bitmap table entries; bits 1-8 and 56-63 are reserved */
+#define BME_TABLE_ENTRY_RESERVED_MASK 0xff000000000001feULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+#define BME_TABLE_ENTRY_FLAG_ALL_ONES (1ULL << 0)
+
+typedef struct Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data follows */
+    /* name follows */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+typedef enum BitmapType {
+    BT_DIRTY_TRACKING_BITMAP = 1
+} BitmapType;
+
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    char *name;
+
+    QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
+} Qcow2Bitmap;
+typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
+
+static inline uint32_t calc_dir_entry_size(size_t name_size,
+                                           size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + name_size + extra_data_size,
+                    8);
+}
+
+static inline uint32_t dir_entry_size(Qcow2BitmapDirEntry *entry)
+{
+    return calc_dir_entry_size(entry->name_size, entry->extra_data_size);
+}
+
+static inline const char *dir_entry_name_field(Qcow2BitmapDirEntry *entry)
+{
+    return (const char *)(entry + 1) + entry->extra_data_size;
+}
+
+static inline Qcow2BitmapDirEntry *next_dir_entry(Qcow2BitmapDirEntry *entry)
+{
+    return (Qcow2BitmapDirEntry *)((uint8_t *)entry + dir_entry_size(entry));
+}
+
+static inline void bitmap_dir_entry_to_cpu(Qcow2BitmapDirEntry *entry)
+{
+    be64_to_cpus(&entry->bitmap_table_offset);
+    be32_to_cpus(&entry->bitmap_table_size);
+    be32_to_cpus(&entry->flags);
+    be16_to_cpus(&entry->name_size);
+    be32_to_cpus(&entry->extra_data_size);
+}
+
+static inline void bitmap_dir_entry_to_be(Qcow2BitmapDirEntry *entry)
+{
+    cpu_to_be64s(&entry->bitmap_table_offset);
+    cpu_to_be32s(&entry->bitmap_table_size);
+    cpu_to_be32s(&entry->flags);
+    cpu_to_be16s(&entry->name_size);
+    cpu_to_be32s(&entry->extra_data_size);
+}
+
+/* Number of sectors of the virtual disk described by one cluster of data */
+static uint64_t sectors_covered_by_bitmap_cluster(BDRVQcow2State *s,
+                                                  uint8_t granularity_bits)
+{
+    return ((uint64_t)s->cluster_size * 8) <<
+           (granularity_bits - BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BDRVQcow2State *s, uint64_t nb_sectors,
+                                  uint8_t granularity_bits)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        sectors_covered_by_bitmap_cluster(s,
+                                                          granularity_bits));
+}
+
+static int check_table_entry(uint64_t entry, int cluster_size)
+{
+    uint64_t offset;
+
+    if (entry & BME_TABLE_ENTRY_RESERVED_MASK) {
+        return -EINVAL;
+    }
+
+    offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    if (offset != 0) {
+        /* if offset specified, bit 0 is reserved */
+        if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+            return -EINVAL;
+        }
+
+        if (offset % cluster_size != 0) {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static int check_dir_entry(BDRVQcow2State *s, Qcow2BitmapDirEntry *entry)
+{
+    if (entry->type != BT_DIRTY_TRACKING_BITMAP ||
+        (entry->flags & BME_RESERVED_FLAGS) ||
+        entry->granularity_bits > BME_MAX_GRANULARITY_BITS ||
+        entry->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        entry->name_size == 0 || entry->name_size > BME_MAX_NAME_SIZE ||
+        entry->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        offset_into_cluster(s, entry->bitmap_table_offset) ||
+        (entry->bitmap_table_size && entry->bitmap_table_offset == 0)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static Qcow2BitmapList *bitmap_list_new(void)
+{
+    Qcow2BitmapList *bm_list = g_new(Qcow2BitmapList, 1);
+    QSIMPLEQ_INIT(bm_list);
+
+    return bm_list;
+}
+
+static void bitmap_list_free(Qcow2BitmapList *bm_list)
+{
+    Qcow2Bitmap *bm;
+
+    if (bm_list == NULL) {
+        return;
+    }
+
+    while ((bm = QSIMPLEQ_FIRST(bm_list)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(bm_list, entry);
+        g_free(bm->name);
+        g_free(bm);
+    }
+
+    g_free(bm_list);
+}
+
+/* Reads and checks the bitmap directory of the image */
+static Qcow2BitmapList *bitmap_list_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t size = s->bitmap_directory_size;
+    uint8_t *dir, *dir_end;
+    Qcow2BitmapDirEntry *e;
+    uint32_t nb_dir_entries = 0;
+    Qcow2BitmapList *bm_list;
+    int ret;
+
+    dir = g_try_malloc(size);
+    if (dir == NULL) {
+        error_setg(errp, "Failed to allocate space for bitmap directory");
+        return NULL;
+    }
+    dir_end = dir + size;
+    bm_list = bitmap_list_new();
+
+    ret = bdrv_pread(bs->file->bs, s->bitmap_directory_offset, dir, size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read bitmap directory");
+        goto fail;
+    }
+
+    for (e = (Qcow2BitmapDirEntry *)dir;
+         e < (Qcow2BitmapDirEntry *)dir_end;
+         e = next_dir_entry(e))
+    {
+        Qcow2Bitmap *bm;
+
+        if ((uint8_t *)(e + 1) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (++nb_dir_entries > s->nb_bitmaps) {
+            error_setg(errp, "More bitmaps found than specified in header"
+                       " extension");
+            goto fail;
+        }
+        bitmap_dir_entry_to_cpu(e);
+
+        if ((uint8_t *)next_dir_entry(e) > dir_end) {
+            goto broken_dir;
+        }
+
+        if (e->extra_data_size != 0) {
+            error_setg(errp, "Bitmap extra data is not supported");
+            goto fail;
+        }
+
+        ret = check_dir_entry(s, e);
+        if (ret < 0) {
+            error_setg(errp, "Bitmap '%.*s' doesn't satisfy the constraints",
+                       e->name_size, dir_entry_name_field(e));
+            goto fail;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->table_offset = e->bitmap_table_offset;
+        bm->table_size = e->bitmap_table_size;
+        bm->flags = e->flags;
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = g_strndup(dir_entry_name_field(e), e->name_size);
+        QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
+    }
+
+    if (nb_dir_entries != s->nb_bitmaps) {
+        error_setg(errp, "Less bitmaps found than specified in header"
+                         " extension");
+        goto fail;
+    }
+
+    if ((uint8_t *)e != dir_end) {
+        goto broken_dir;
+    }
+
+    g_free(dir);
+    return bm_list;
+
+broken_dir:
+    error_setg(errp, "Broken bitmap directory");
+
+fail:
+    g_free(dir);
+    bitmap_list_free(bm_list);
+
+    return NULL;
+}
+
+/* Serializes @bm_list into a newly allocated bitmap directory */
+static uint8_t *bitmap_list_to_dir(Qcow2BitmapList *bm_list,
+                                   uint64_t *dir_size)
+{
+    Qcow2Bitmap *bm;
+    Qcow2BitmapDirEntry *e;
+    uint8_t *dir;
+    uint64_t size = 0;
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        size += calc_dir_entry_size(strlen(bm->name), 0);
+    }
+
+    dir = g_malloc0(size);
+    e = (Qcow2BitmapDirEntry *)dir;
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        Qcow2BitmapDirEntry *next;
+
+        e->bitmap_table_offset = bm->table_offset;
+        e->bitmap_table_size = bm->table_size;
+        e->flags = bm->flags;
+        e->type = BT_DIRTY_TRACKING_BITMAP;
+        e->granularity_bits = bm->granularity_bits;
+        e->name_size = strlen(bm->name);
+        e->extra_data_size = 0;
+        memcpy(e + 1, bm->name, e->name_size);
+
+        next = next_dir_entry(e);
+        bitmap_dir_entry_to_be(e);
+        e = next;
+    }
+
+    *dir_size = size;
+    return dir;
+}
+
+/* Allocates clusters for a new bitmap directory and writes @bm_list there */
+static int bitmap_list_store(BlockDriverState *bs, Qcow2BitmapList *bm_list,
+                             uint64_t *offset, uint64_t *size, Error **errp)
+{
+    uint8_t *dir;
+    uint64_t dir_size;
+    int64_t dir_offset;
+    int ret;
+
+    dir = bitmap_list_to_dir(bm_list, &dir_size);
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Bitmap directory is too large");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        error_setg_errno(errp, -ret, "Failed to allocate bitmap directory");
+        goto out;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Bitmap directory overlaps metadata");
+        goto free_dir;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap directory");
+        goto free_dir;
+    }
+
+    *offset = dir_offset;
+    *size = dir_size;
+    ret = 0;
+    goto out;
+
+free_dir:
+    qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+out:
+    g_free(dir);
+    return ret;
+}
+
+/*
+ * Rewrites the directory at its current location; only used to change
+ * flags, which does not change the size of the directory.
+ */
+static int bitmap_list_update_in_place(BlockDriverState *bs,
+                                       Qcow2BitmapList *bm_list,
+                                       Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint8_t *dir;
+    uint64_t dir_size;
+    int ret;
+
+    dir = bitmap_list_to_dir(bm_list, &dir_size);
+    assert(dir_size == s->bitmap_directory_size);
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, s->bitmap_directory_offset,
+                                        dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Bitmap directory overlaps metadata");
+        goto out;
+    }
+
+    ret = bdrv_pwrite(bs->file->bs, s->bitmap_directory_offset, dir,
+                      dir_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap directory");
+        goto out;
+    }
+
+    ret = bdrv_flush(bs->file->bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to flush bitmap directory");
+    }
+
+out:
+    g_free(dir);
+    return ret;
+}
+
+/* Reads the bitmap table of @bm and converts it to CPU byte order */
+static int bitmap_table_load(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             uint64_t **bitmap_table)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    assert(bm->table_size != 0);
+    table = g_try_new(uint64_t, bm->table_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file->bs, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < bm->table_size; ++i) {
+        be64_to_cpus(&table[i]);
+        ret = check_table_entry(table[i], s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    *bitmap_table = table;
+    return 0;
+
+fail:
+    g_free(table);
+    return ret;
+}
+
+static void free_bitmap_table_clusters(BlockDriverState *bs,
+                                       const uint64_t *bitmap_table,
+                                       uint32_t bitmap_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < bitmap_table_size; ++i) {
+        uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset != 0) {
+            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                QCOW2_DISCARD_ALWAYS);
+        }
+    }
+}
+
+/* Frees the data clusters and the bitmap table of a stored bitmap */
+static void free_bitmap_clusters(BlockDriverState *bs, Qcow2Bitmap *bm)
+{
+    uint64_t *bitmap_table;
+    int ret;
+
+    if (bm->table_size == 0) {
+        return;
+    }
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        /* Leave the data clusters leaked rather than risk freeing others */
+        error_report("Failed to read bitmap table of bitmap '%s': %s",
+                     bm->name, strerror(-ret));
+        return;
+    }
+
+    free_bitmap_table_clusters(bs, bitmap_table, bm->table_size);
+    g_free(bitmap_table);
+
+    qcow2_free_clusters(bs, bm->table_offset,
+                        bm->table_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_ALWAYS);
+}
+
+static int load_bitmap_data(BlockDriverState *bs,
+                            const uint64_t *bitmap_table,
+                            uint32_t bitmap_table_size,
+                            uint8_t granularity_bits,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, granularity_bits);
+    uint64_t sector;
+    uint32_t i;
+    uint8_t *buf;
+    int ret = 0;
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < bitmap_table_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        uint64_t entry = bitmap_table[i];
+        uint64_t offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+
+        if (offset == 0) {
+            if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
+                memset(buf, 0xff, s->cluster_size);
+                bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                                   false);
+            } else {
+                bdrv_dirty_bitmap_deserialize_zeroes(bitmap, sector, count,
+                                                     false);
+            }
+        } else {
+            ret = bdrv_pread(bs->file->bs, offset, buf, s->cluster_size);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count,
+                                               false);
+        }
+    }
+    ret = 0;
+
+out:
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    g_free(buf);
+
+    return ret;
+}
+
+static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                    Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t *bitmap_table = NULL;
+    int ret;
+
+    if (bm->table_size !=
+        bitmap_table_size(s, bs->total_sectors, bm->granularity_bits)) {
+        error_setg(errp, "Bitmap '%s' does not match the image size",
+                   bm->name);
+        return NULL;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, 1U << bm->granularity_bits,
+                                      bm->name, errp);
+    if (bitmap == NULL) {
+        return NULL;
+    }
+
+    if (bm->table_size == 0) {
+        return bitmap;
+    }
+
+    ret = bitmap_table_load(bs, bm, &bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap table of bitmap "
+                         "'%s'", bm->name);
+        goto fail;
+    }
+
+    ret = load_bitmap_data(bs, bitmap_table, bm->table_size,
+                           bm->granularity_bits, bitmap);
+    g_free(bitmap_table);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+                         bm->name);
+        goto fail;
+    }
+
+    return bitmap;
+
+fail:
+    bdrv_release_dirty_bitmap(bs, bitmap);
+    return NULL;
+}
+
+/*
+ * Writes the data and the bitmap table of @bitmap to newly allocated
+ * clusters and fills in the location in @bm.  Clusters that would only hold
+ * zeroes are not allocated.
+ */
+static int store_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, bm->granularity_bits);
+    uint64_t tb_size = bitmap_table_size(s, bm_size, bm->granularity_bits);
+    uint64_t *tb;
+    uint64_t sector;
+    int64_t tb_offset;
+    uint32_t i;
+    uint8_t *buf;
+    int ret;
+
+    if (tb_size > BME_MAX_TABLE_SIZE) {
+        error_setg(errp, "Bitmap '%s' is too large", bm->name);
+        return -EINVAL;
+    }
+
+    bm->table_offset = 0;
+    bm->table_size = tb_size;
+    if (tb_size == 0) {
+        return 0;
+    }
+
+    tb = g_try_new0(uint64_t, tb_size);
+    if (tb == NULL) {
+        error_setg(errp, "No memory");
+        return -ENOMEM;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < tb_size; ++i, sector += sbc) {
+        uint64_t count = MIN(bm_size - sector, sbc);
+        int64_t off;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        off = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (off < 0) {
+            ret = off;
+            error_setg_errno(errp, -ret, "Failed to allocate clusters for "
+                             "bitmap '%s'", bm->name);
+            goto fail;
+        }
+        tb[i] = off;
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, off, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto fail;
+        }
+
+        ret = bdrv_pwrite(bs->file->bs, off, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to "
+                             "file", bm->name);
+            goto fail;
+        }
+    }
+
+    tb_offset = qcow2_alloc_clusters(bs, tb_size * sizeof(uint64_t));
+    if (tb_offset < 0) {
+        ret = tb_offset;
+        error_setg_errno(errp, -ret, "Failed to allocate bitmap table of "
+                         "bitmap '%s'", bm->name);
+        goto fail;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, tb_offset,
+                                        tb_size * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+        goto free_table;
+    }
+
+    for (i = 0; i < tb_size; ++i) {
+        cpu_to_be64s(&tb[i]);
+    }
+    ret = bdrv_pwrite(bs->file->bs, tb_offset, tb,
+                      tb_size * sizeof(uint64_t));
+    for (i = 0; i < tb_size; ++i) {
+        be64_to_cpus(&tb[i]);
+    }
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write bitmap table of "
+                         "bitmap '%s'", bm->name);
+        goto free_table;
+    }
+
+    bm->table_offset = tb_offset;
+    g_free(buf);
+    g_free(tb);
+    return 0;
+
+free_table:
+    qcow2_free_clusters(bs, tb_offset, tb_size * sizeof(uint64_t),
+                        QCOW2_DISCARD_OTHER);
+fail:
+    free_bitmap_table_clusters(bs, tb, tb_size);
+    g_free(buf);
+    g_free(tb);
+    return ret;
+}
+
+/*
+ * Loads all bitmaps of the image as persistent dirty bitmaps of @bs.  When
+ * the image is writable, they are then marked in_use on disk until they are
+ * stored again by qcow2_store_persistent_dirty_bitmaps().
+ */
+int qcow2_load_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    GSList *created = NULL, *l;
+    bool mark_in_use = false;
+    int ret;
+
+    /* From now on, the bitmaps of the image are owned by @bs */
+    s->dirty_bitmaps_loaded = true;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    bm_list = bitmap_list_load(bs, errp);
+    if (bm_list == NULL) {
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        BdrvDirtyBitmap *bitmap;
+
+        if (bm->flags & BME_FLAG_IN_USE) {
+            error_report("Warning: bitmap '%s' was not saved properly and "
+                         "is ignored; it will be removed from the image",
+                         bm->name);
+            continue;
+        }
+
+        /* Bitmaps that survived an inactivate/invalidate cycle in memory are
+         * newer than the stored copy */
+        bitmap = bdrv_find_dirty_bitmap(bs, bm->name);
+        if (bitmap == NULL) {
+            bitmap = load_bitmap(bs, bm, errp);
+            if (bitmap == NULL) {
+                ret = -EINVAL;
+                goto fail;
+            }
+            created = g_slist_prepend(created, bitmap);
+
+            bdrv_dirty_bitmap_set_persistence(bitmap, true);
+            if (!(bm->flags & BME_FLAG_AUTO)) {
+                bdrv_disable_dirty_bitmap(bitmap);
+            }
+        }
+
+        bm->flags |= BME_FLAG_IN_USE;
+        mark_in_use = true;
+    }
+
+    if (mark_in_use && !bs->read_only) {
+        ret = bitmap_list_update_in_place(bs, bm_list, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    return 0;
+
+fail:
+    for (l = created; l; l = l->next) {
+        bdrv_release_dirty_bitmap(bs, l->data);
+    }
+    g_slist_free(created);
+    bitmap_list_free(bm_list);
+    s->dirty_bitmaps_loaded = false;
+
+    return ret;
+}
+
+static bool has_persistent_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Writes all persistent dirty bitmaps of @bs to the image, replacing the
+ * bitmaps stored in it.  The new bitmaps are written to new clusters and the
+ * header is switched over to them before the old clusters are freed, so the
+ * image holds a consistent set of bitmaps at any point.
+ */
+int qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapList *old_list = NULL, *new_list;
+    Qcow2Bitmap *bm;
+    uint64_t old_dir_offset = s->bitmap_directory_offset;
+    uint64_t old_dir_size = s->bitmap_directory_size;
+    uint32_t old_nb_bitmaps = s->nb_bitmaps;
+    uint64_t old_autoclear_features = s->autoclear_features;
+    uint64_t dir_offset = 0, dir_size = 0;
+    uint32_t nb_bitmaps = 0;
+    int ret;
+
+    if (!s->dirty_bitmaps_loaded) {
+        /* Never took over the bitmaps of the image, leave them alone */
+        return 0;
+    }
+
+    if (old_nb_bitmaps == 0 && !has_persistent_bitmaps(bs)) {
+        /* Nothing to store or drop, don't touch images without bitmaps */
+        return 0;
+    }
+
+    if (old_nb_bitmaps != 0) {
+        old_list = bitmap_list_load(bs, errp);
+        if (old_list == NULL) {
+            return -EINVAL;
+        }
+    }
+
+    new_list = bitmap_list_new();
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+
+        if (!bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            continue;
+        }
+
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            /* Writes since the freeze are only in the successor */
+            error_report("Warning: bitmap '%s' is in use by an operation "
+                         "and is not stored", name);
+            continue;
+        }
+
+        bm = g_new0(Qcow2Bitmap, 1);
+        bm->name = g_strdup(name);
+        bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
+        bm->flags = bdrv_dirty_bitmap_enabled(bitmap) ? BME_FLAG_AUTO : 0;
+        QSIMPLEQ_INSERT_TAIL(new_list, bm, entry);
+
+        ret = store_bitmap(bs, bitmap, bm, errp);
+        if (ret < 0) {
+            /* Nothing is left allocated for a bitmap that failed */
+            bm->table_size = 0;
+            goto fail;
+        }
+        nb_bitmaps++;
+    }
+
+    if (nb_bitmaps != 0) {
+        ret = bitmap_list_store(bs, new_list, &dir_offset, &dir_size, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    /* The header must not point to clusters whose refcount isn't on disk */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to flush the refcount block "
+                         "cache");
+        goto fail_dir;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    if (nb_bitmaps != 0) {
+        s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    } else {
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    }
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update the qcow2 header");
+        s->nb_bitmaps = old_nb_bitmaps;
+        s->bitmap_directory_offset = old_dir_offset;
+        s->bitmap_directory_size = old_dir_size;
+        s->autoclear_features = old_autoclear_features;
+        goto fail_dir;
+    }
+
+    /* The old bitmaps are unreferenced now */
+    if (old_list != NULL) {
+        QSIMPLEQ_FOREACH(bm, old_list, entry) {
+            free_bitmap_clusters(bs, bm);
+        }
+        qcow2_free_clusters(bs, old_dir_offset, old_dir_size,
+                            QCOW2_DISCARD_ALWAYS);
+    }
+
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+    return 0;
+
+fail_dir:
+    if (dir_size != 0) {
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+fail:
+    QSIMPLEQ_FOREACH(bm, new_list, entry) {
+        free_bitmap_clusters(bs, bm);
+    }
+    bitmap_list_free(old_list);
+    bitmap_list_free(new_list);
+
+    return ret;
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                  uint32_t granularity, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    uint64_t dir_size = calc_dir_entry_size(strlen(name), 0);
+    uint32_t nb_bitmaps = 1;
+    const char *reason;
+
+    if (s->qcow_version < 3) {
+        /* Without autoclear_features, any program that does not know about
+         * bitmaps could have modified the image since they were stored */
+        reason = "it needs qcow2 version 3 (compat=1.1)";
+        goto fail;
+    }
+
+    if (bs->read_only) {
+        reason = "the image is read-only";
+        goto fail;
+    }
+
+    if (!s->dirty_bitmaps_loaded) {
+        reason = "the image is inactive";
+        goto fail;
+    }
+
+    if (strlen(name) > BME_MAX_NAME_SIZE) {
+        reason = "the name is too long";
+        goto fail;
+    }
+
+    if (ctz32(granularity) > BME_MAX_GRANULARITY_BITS) {
+        reason = "the granularity is too large";
+        goto fail;
+    }
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap != NULL;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap))
+    {
+        if (bdrv_dirty_bitmap_get_persistence(bitmap)) {
+            nb_bitmaps++;
+            dir_size +=
+                calc_dir_entry_size(strlen(bdrv_dirty_bitmap_name(bitmap)), 0);
+        }
+    }
+
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS) {
+        reason = "there are too many persistent bitmaps";
+        goto fail;
+    }
+
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        reason = "the bitmap directory would be too large";
+        goto fail;
+    }
+
+    return true;
+
+fail:
+    error_setg(errp, "Can't make bitmap '%s' persistent in '%s': %s",
+               name, bdrv_get_device_or_node_name(bs), reason);
+    return false;
+}
+
+/*
+ * Accounts for the clusters used by the bitmaps extension when qemu-img
+ * check rebuilds the refcounts.
+ */
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  void **refcount_table,
+                                  int64_t *refcount_table_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2BitmapList *bm_list;
+    Qcow2Bitmap *bm;
+    int ret;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                   refcount_table_size,
+                                   s->bitmap_directory_offset,
+                                   s->bitmap_directory_size);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bm_list = bitmap_list_load(bs, NULL);
+    if (bm_list == NULL) {
+        res->corruptions++;
+        return -EINVAL;
+    }
+
+    QSIMPLEQ_FOREACH(bm, bm_list, entry) {
+        uint64_t *bitmap_table = NULL;
+        uint32_t i;
+
+        if (bm->table_size == 0) {
+            continue;
+        }
+
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                       refcount_table_size, bm->table_offset,
+                                       bm->table_size * sizeof(uint64_t));
+        if (ret < 0) {
+            goto out;
+        }
+
+        ret = bitmap_table_load(bs, bm, &bitmap_table);
+        if (ret < 0) {
+            fprintf(stderr, "ERROR bitmap table of bitmap '%s' is "
+                    "invalid\n", bm->name);
+            res->corruptions++;
+            continue;
+        }
+
+        for (i = 0; i < bm->table_size; ++i) {
+            uint64_t offset = bitmap_table[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (offset == 0) {
+                continue;
+            }
+
+            ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
+                                           refcount_table_size, offset,
+                                           s->cluster_size);
+            if (ret < 0) {
+                g_free(bitmap_table);
+                goto out;
+            }
+        }
+
+        g_free(bitmap_table);
+    }
+    ret = 0;
+
+out:
+    bitmap_list_free(bm_list);
+    return ret;
+}
@@ -0,0 +1,271 @@
+/*
+ * qcow2 compressed cluster codecs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Compressing a cluster takes far longer than writing it, so the codecs run
+ * in the thread pool of the image's AioContext.  The calling coroutine waits
+ * for its own job only, which lets callers that issue several compressed
+ * writes at once (like qemu-img convert -W) use more than one core.
+ * Allocating the compressed clusters is left to the caller and stays
+ * serialized under s->lock.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#include <zstd_errors.h>
+#endif
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+
+/* Maximum number of codec jobs that one image has in the thread pool */
+#define QCOW2_MAX_COMPRESS_THREADS 4
+
+/* zstd level; the fast end of the scale, zlib is the choice for ratio */
+#define QCOW2_ZSTD_LEVEL 1
+
+/* Compresses or decompresses @src_size bytes from @src into @dest */
+typedef ssize_t Qcow2CodecFunc(void *dest, size_t dest_size,
+                               const void *src, size_t src_size);
+
+typedef struct Qcow2CodecJob {
+    Qcow2CodecFunc *func;
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CodecJob;
+
+/*
+ * Returns the compressed size, -ENOMEM if the result does not fit into
+ * @dest_size bytes (i.e. the data should be stored uncompressed) or -EIO on
+ * other errors.
+ */
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK || ret == Z_BUF_ERROR) ? -ENOMEM : -EIO;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+/*
+ * Decompress into exactly @dest_size bytes.  The compressed size is only
+ * known to sector granularity, so @src may contain trailing garbage.
+ *
+ * Returns 0 on success and -EIO on error.
+ */
+static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *) src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret == Z_STREAM_END || ret == Z_BUF_ERROR) && strm.avail_out == 0) {
+        ret = 0;
+    } else {
+        ret = -EIO;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    ret = ZSTD_compress(dest, dest_size, src, src_size, QCOW2_ZSTD_LEVEL);
+    if (ZSTD_isError(ret)) {
+        return ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall ?
+               -ENOMEM : -EIO;
+    }
+
+    return ret;
+}
+
+static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                     const void *src, size_t src_size)
+{
+    ZSTD_DCtx *dctx;
+    ZSTD_inBuffer input = { src, src_size, 0 };
+    ZSTD_outBuffer output = { dest, dest_size, 0 };
+    ssize_t ret = 0;
+
+    dctx = ZSTD_createDCtx();
+    if (!dctx) {
+        return -EIO;
+    }
+
+    /* Streaming decompression stops at the end of the frame, so that any
+     * trailing bytes of the last sector are ignored */
+    while (output.pos < output.size) {
+        size_t last_in_pos = input.pos;
+        size_t last_out_pos = output.pos;
+        size_t zstd_ret;
+
+        zstd_ret = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(zstd_ret) || zstd_ret == 0 ||
+            (input.pos == last_in_pos && output.pos == last_out_pos)) {
+            break;
+        }
+    }
+    if (output.pos != output.size) {
+        ret = -EIO;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    return ret;
+}
+#endif
+
+bool qcow2_compression_type_supported(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return true;
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#ifdef CONFIG_ZSTD
+        return true;
+#else
+        return false;
+#endif
+    default:
+        return false;
+    }
+}
+
+static int qcow2_codec_worker(void *opaque)
+{
+    Qcow2CodecJob *job = opaque;
+
+    job->ret = job->func(job->dest, job->dest_size, job->src, job->src_size);
+    return 0;
+}
+
+static ssize_t coroutine_fn qcow2_co_run_codec(BlockDriverState *bs,
+                                               Qcow2CodecFunc *func,
+                                               void *dest, size_t dest_size,
+                                               const void *src,
+                                               size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CodecJob job = {
+        .func       = func,
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    /* Leave some workers for the rest of the image's I/O */
+    while (s->nb_compress_threads >= QCOW2_MAX_COMPRESS_THREADS) {
+        qemu_co_queue_wait(&s->compress_thread_queue);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_codec_worker, &job);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_thread_queue);
+    return job.ret;
+}
+
+/*
+ * Compress one cluster with the image's compression type.  See
+ * qcow2_zlib_compress() for the return value.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CodecFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        /* Unsupported types are rejected when the image is opened */
+        abort();
+    }
+
+    return qcow2_co_run_codec(bs, func, dest, dest_size, src, src_size);
+}
+
+/*
+ * Decompress one cluster into exactly @dest_size bytes.  Returns 0 on
+ * success and -EIO on error.
+ */
+ssize_t coroutine_fn qcow2_co_decompress(BlockDriverState *bs,
+                                         void *dest, size_t dest_size,
+                                         const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CodecFunc *func;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        func = qcow2_zlib_decompress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        func = qcow2_zstd_decompress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    return qcow2_co_run_codec(bs, func, dest, dest_size, src, src_size);
+}
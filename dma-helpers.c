@@ -61,6 +61,13 @@ void qemu_sglist_add(QEMUSGList *qsg, dma_addr_t base, dma_addr_t len)
     ++qsg->nsg;
 }
 
+/* Drop all entries but keep the allocation, so the list can be reused */
+void qemu_sglist_reset(QEMUSGList *qsg)
+{
+    qsg->nsg = 0;
+    qsg->size = 0;
+}
+
 void qemu_sglist_destroy(QEMUSGList *qsg)
 {
     object_unref(OBJECT(qsg->dev));
@@ -3764,4 +3764,10 @@ int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
     rcu_read_unlock();
     return ret;
 }
+
+/* Changes whenever a RAM block is added or removed */
+uint32_t qemu_ram_list_version(void)
+{
+    return atomic_read(&ram_list.version);
+}
 #endif
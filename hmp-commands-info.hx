@@ -572,6 +572,20 @@ STEXI
 @item info migrate_cache_size
 @findex migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the guest dirty page rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex dirty_rate
+Show the result of the last @code{calc_dirty_rate} measurement.
 ETEXI
 
     {
@@ -711,7 +725,7 @@ ETEXI
 STEXI
 @item info iothreads
 @findex iothreads
-Show iothread's identifiers.
+Show iothread's identifiers and busy-polling statistics.
 ETEXI
 
     {
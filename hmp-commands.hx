@@ -1008,7 +1008,7 @@ ETEXI
 
     {
         .name       = "migrate_set_parameter",
-        .args_type  = "parameter:s,value:i",
+        .args_type  = "parameter:s,value:s",
         .params     = "parameter value",
         .help       = "Set the parameter for migration",
         .mhandler.cmd = hmp_migrate_set_parameter,
@@ -1036,6 +1036,22 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:i",
+        .params     = "second",
+        .help       = "start measuring the guest dirty page rate for "
+                      "'second' seconds",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Start measuring how fast the guest dirties its RAM, over @var{second}
+seconds.  Use @code{info dirty_rate} to see the result.
 ETEXI
 
     {
@@ -233,6 +233,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        if (info->xbzrle_cache->has_blocks) {
+            XBZRLEBlockStatsList *bs;
+
+            for (bs = info->xbzrle_cache->blocks; bs; bs = bs->next) {
+                monitor_printf(mon, "xbzrle %s: pages %" PRIu64
+                               ", cache miss %" PRIu64
+                               " (%0.2f), overflow %" PRIu64 "\n",
+                               bs->value->id, bs->value->pages,
+                               bs->value->cache_miss,
+                               bs->value->cache_miss_rate,
+                               bs->value->overflow);
+            }
+        }
     }
 
     if (info->has_x_cpu_throttle_percentage) {
@@ -286,6 +299,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
         monitor_printf(mon, "\n");
     }
 
@@ -298,6 +317,31 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockList *block;
+
+    monitor_printf(mon, "status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->status != DIRTY_RATE_STATUS_UNSTARTED) {
+        monitor_printf(mon, "start time: %" PRId64 " s\n", info->start_time);
+        monitor_printf(mon, "calc time: %" PRId64 " s\n", info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty rate: %" PRId64 " MB/s\n",
+                       info->dirty_rate);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "%s: %" PRId64 " MB/s (%" PRId64 " of %" PRId64
+                       " sampled pages dirty)\n",
+                       block->value->id, block->value->dirty_rate,
+                       block->value->dirty_pages, block->value->sample_pages);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1235,13 +1279,17 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    long value = 0;
+    int compress_method = 0;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
+    bool has_compress_method = false;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER__MAX; i++) {
@@ -1262,12 +1310,32 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                break;
+            }
+            if (has_compress_method) {
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD__MAX, -1, &err);
+                if (err) {
+                    break;
+                }
+            } else if (qemu_strtol(valuestr, NULL, 10, &value) < 0) {
+                error_setg(&err, QERR_INVALID_PARAMETER_VALUE, param,
+                           "an integer");
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
+                                       has_compress_method, compress_method,
                                        &err);
             break;
         }
@@ -1306,6 +1374,14 @@ void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(qdict_get_int(qdict, "second"), &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -2008,8 +2084,18 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        monitor_printf(mon, "%s:\n", info->value->id);
+        monitor_printf(mon, "  thread_id=%" PRId64 "\n",
+                       info->value->thread_id);
+        monitor_printf(mon, "  poll-max-ns=%" PRId64 "\n",
+                       info->value->poll_max_ns);
+        monitor_printf(mon, "  poll-grow=%" PRId64 "\n",
+                       info->value->poll_grow);
+        monitor_printf(mon, "  poll-shrink=%" PRId64 "\n",
+                       info->value->poll_shrink);
+        monitor_printf(mon, "  poll-hits=%" PRIu64 " poll-misses=%" PRIu64
+                       "\n", info->value->poll_hits,
+                       info->value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -18,6 +18,18 @@
  * Usage: add options:
  *      -drive file=<file>,if=none,id=<drive_id>
  *      -device nvme,drive=<drive_id>,serial=<serial>,id=<id[optional]>
+ *
+ * Setting timer-free=on makes doorbell writes kick queue processing through
+ * bottom halves in the drive's AioContext instead of a 500ns virtual timer.
+ *
+ * With iothread=<iothread_id>, I/O submission and completion queues are
+ * processed in that IOThread's AioContext (this implies timer-free=on):
+ *      -object iothread,id=<iothread_id>
+ *      -device nvme,drive=<drive_id>,serial=<serial>,iothread=<iothread_id>
+ *
+ * The Doorbell Buffer Config admin command is supported.  Once the guest has
+ * set up shadow doorbells, ioeventfd=on additionally binds the I/O queue
+ * doorbell registers to eventfds when KVM supports it.
  */
 
 #include "qemu/osdep.h"
@@ -29,10 +41,14 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
+#include "sysemu/kvm.h"
 
 #include "nvme.h"
 
 static void nvme_process_sq(void *opaque);
+static void nvme_kick_sq(NvmeSQueue *sq);
+static void nvme_kick_cq(NvmeCQueue *cq);
 
 static int nvme_check_sqid(NvmeCtrl *n, uint16_t sqid)
 {
@@ -68,6 +84,117 @@ static uint8_t nvme_sq_empty(NvmeSQueue *sq)
     return sq->head == sq->tail;
 }
 
+static void nvme_update_sq_tail(NvmeSQueue *sq)
+{
+    uint32_t v;
+
+    pci_dma_read(&sq->ctrl->parent_obj, sq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < sq->size) {
+        sq->tail = v;
+    }
+}
+
+static void nvme_update_sq_eventidx(NvmeSQueue *sq)
+{
+    uint32_t v = cpu_to_le32(sq->tail);
+
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_update_cq_head(NvmeCQueue *cq)
+{
+    uint32_t v;
+
+    pci_dma_read(&cq->ctrl->parent_obj, cq->db_addr, &v, sizeof(v));
+    v = le32_to_cpu(v);
+    if (v < cq->size) {
+        cq->head = v;
+    }
+}
+
+static void nvme_update_cq_eventidx(NvmeCQueue *cq)
+{
+    uint32_t v = cpu_to_le32(cq->head);
+
+    pci_dma_write(&cq->ctrl->parent_obj, cq->ei_addr, &v, sizeof(v));
+}
+
+static void nvme_sq_notifier(EventNotifier *e)
+{
+    NvmeSQueue *sq = container_of(e, NvmeSQueue, notifier);
+
+    if (event_notifier_test_and_clear(e)) {
+        nvme_process_sq(sq);
+    }
+}
+
+static void nvme_cq_notifier(EventNotifier *e)
+{
+    NvmeCQueue *cq = container_of(e, NvmeCQueue, notifier);
+    NvmeSQueue *sq;
+    int start_sqs;
+
+    if (!event_notifier_test_and_clear(e)) {
+        return;
+    }
+
+    start_sqs = nvme_cq_full(cq) ? 1 : 0;
+    nvme_update_cq_head(cq);
+    if (start_sqs) {
+        QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
+            nvme_kick_sq(sq);
+        }
+        nvme_kick_cq(cq);
+    }
+}
+
+/* Doorbell registers use a stride of 4 bytes (CAP.DSTRD is 0) */
+static void nvme_init_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr db,
+    EventNotifierHandler *handler)
+{
+    if (event_notifier_init(e, 0) < 0) {
+        return;
+    }
+    aio_set_event_notifier(n->ctx, e, true, handler);
+    memory_region_add_eventfd(&n->iomem, db, 4, false, 0, e);
+}
+
+static void nvme_cleanup_ioeventfd(NvmeCtrl *n, EventNotifier *e, hwaddr db)
+{
+    memory_region_del_eventfd(&n->iomem, db, 4, false, 0, e);
+    aio_set_event_notifier(n->ctx, e, true, NULL);
+    event_notifier_cleanup(e);
+}
+
+static void nvme_init_sq_dbbuf(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    hwaddr db = 0x1000 + (sq->sqid << 3);
+
+    sq->db_addr = n->dbbuf_dbs + (sq->sqid << 3);
+    sq->ei_addr = n->dbbuf_eis + (sq->sqid << 3);
+    nvme_update_sq_eventidx(sq);
+
+    if (n->ioeventfd && kvm_eventfds_enabled() && !sq->ioeventfd_enabled) {
+        nvme_init_ioeventfd(n, &sq->notifier, db, nvme_sq_notifier);
+        sq->ioeventfd_enabled = true;
+    }
+}
+
+static void nvme_init_cq_dbbuf(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    hwaddr db = 0x1000 + (cq->cqid << 3) + (1 << 2);
+
+    cq->db_addr = n->dbbuf_dbs + (cq->cqid << 3) + (1 << 2);
+    cq->ei_addr = n->dbbuf_eis + (cq->cqid << 3) + (1 << 2);
+    nvme_update_cq_eventidx(cq);
+
+    if (n->ioeventfd && kvm_eventfds_enabled() && !cq->ioeventfd_enabled) {
+        nvme_init_ioeventfd(n, &cq->notifier, db, nvme_cq_notifier);
+        cq->ioeventfd_enabled = true;
+    }
+}
+
 static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
 {
     if (cq->irq_enabled) {
@@ -79,19 +206,110 @@ static void nvme_isr_notify(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/* Context: QEMU global mutex held */
+static void nvme_irq_bh(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    nvme_isr_notify(cq->ctrl, cq);
+}
+
+static void nvme_cq_raise_irq(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    if (cq->irq_bh) {
+        qemu_bh_schedule(cq->irq_bh);
+    } else {
+        nvme_isr_notify(n, cq);
+    }
+}
+
+static void nvme_kick_sq(NvmeSQueue *sq)
+{
+    if (sq->bh) {
+        qemu_bh_schedule(sq->bh);
+    } else {
+        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+}
+
+static void nvme_kick_cq(NvmeCQueue *cq)
+{
+    if (cq->bh) {
+        qemu_bh_schedule(cq->bh);
+    } else {
+        timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    }
+}
+
+static bool nvme_cq_coalescing(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    /* The admin completion queue is never coalesced */
+    return cq->cqid && NVME_INTC_THR(intc) && NVME_INTC_TIME(intc) &&
+        !NVME_INTVC_CD(n->features.int_vector_config[cq->vector]);
+}
+
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (!nvme_cq_coalescing(n, cq)) {
+        nvme_cq_raise_irq(n, cq);
+        return;
+    }
+
+    /* The aggregation threshold is a 0's based number of entries */
+    cq->pending_cqes += posted;
+    if (cq->pending_cqes > NVME_INTC_THR(intc)) {
+        timer_del(cq->intc_timer);
+        cq->pending_cqes = 0;
+        nvme_cq_raise_irq(n, cq);
+    } else if (cq->pending_cqes && !timer_pending(cq->intc_timer)) {
+        timer_mod(cq->intc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+            NVME_INTC_TIME(intc) * 100 * SCALE_US);
+    }
+}
+
+static void nvme_intc_expired(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+
+    if (cq->pending_cqes) {
+        cq->pending_cqes = 0;
+        nvme_cq_raise_irq(cq->ctrl, cq);
+    }
+}
+
+/* Add a guest memory range, merging it with the previous one if contiguous */
+static void nvme_sg_add(QEMUSGList *qsg, dma_addr_t addr, dma_addr_t len)
+{
+    ScatterGatherEntry *last = qsg->nsg ? &qsg->sg[qsg->nsg - 1] : NULL;
+
+    if (last && last->base + last->len == addr) {
+        last->len += len;
+        qsg->size += len;
+    } else {
+        qemu_sglist_add(qsg, addr, len);
+    }
+}
+
+/*
+ * The request's QEMUSGList is allocated once when the queue is created and
+ * only reset here, so mapping a command does not allocate in the common case.
+ */
 static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
     uint32_t len, NvmeCtrl *n)
 {
     hwaddr trans_len = n->page_size - (prp1 % n->page_size);
     trans_len = MIN(len, trans_len);
-    int num_prps = (len >> n->page_bits) + 1;
 
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
 
-    pci_dma_sglist_init(qsg, &n->parent_obj, num_prps);
-    qemu_sglist_add(qsg, prp1, trans_len);
+    qemu_sglist_reset(qsg);
+    nvme_sg_add(qsg, prp1, trans_len);
     len -= trans_len;
     if (len) {
         if (!prp2) {
@@ -126,7 +344,7 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
                 }
 
                 trans_len = MIN(len, n->page_size);
-                qemu_sglist_add(qsg, prp_ent, trans_len);
+                nvme_sg_add(qsg, prp_ent, trans_len);
                 len -= trans_len;
                 i++;
             }
@@ -134,22 +352,124 @@ static uint16_t nvme_map_prp(QEMUSGList *qsg, uint64_t prp1, uint64_t prp2,
             if (prp2 & (n->page_size - 1)) {
                 goto unmap;
             }
-            qemu_sglist_add(qsg, prp2, len);
+            nvme_sg_add(qsg, prp2, len);
         }
     }
     return NVME_SUCCESS;
 
  unmap:
-    qemu_sglist_destroy(qsg);
+    qemu_sglist_reset(qsg);
     return NVME_INVALID_FIELD | NVME_DNR;
 }
 
+#define NVME_SGL_SEGMENT_CHUNK 256
+
+static uint16_t nvme_map_sgl(QEMUSGList *qsg, NvmeSglDescriptor *sgl,
+    uint32_t len, NvmeCtrl *n)
+{
+    NvmeSglDescriptor segment[NVME_SGL_SEGMENT_CHUNK];
+    uint64_t addr = le64_to_cpu(sgl->addr);
+    uint32_t seg_len = le32_to_cpu(sgl->len);
+    uint8_t type = NVME_SGL_TYPE(sgl->type);
+    uint32_t nsgld, i, j, n_chunk;
+
+    qemu_sglist_reset(qsg);
+
+    if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK) {
+        if (seg_len != len) {
+            return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+        }
+        nvme_sg_add(qsg, addr, seg_len);
+        return NVME_SUCCESS;
+    }
+
+    while (type == NVME_SGL_DESCR_TYPE_SEGMENT ||
+           type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+        bool last = type == NVME_SGL_DESCR_TYPE_LAST_SEGMENT;
+        dma_addr_t mapped = qsg->size;
+
+        if (!seg_len || seg_len % sizeof(NvmeSglDescriptor)) {
+            goto invalid_seg;
+        }
+
+        /* Bound the walk, only a trailing segment descriptor carries no data */
+        nsgld = seg_len / sizeof(NvmeSglDescriptor);
+        if (nsgld > len - qsg->size + 1) {
+            qemu_sglist_reset(qsg);
+            return NVME_INVALID_NUM_SGL_DESCRS | NVME_DNR;
+        }
+        type = NVME_SGL_DESCR_TYPE_DATA_BLOCK;
+        for (i = 0; i < nsgld; i += n_chunk) {
+            n_chunk = MIN(nsgld - i, NVME_SGL_SEGMENT_CHUNK);
+            pci_dma_read(&n->parent_obj, addr + i * sizeof(*segment), segment,
+                n_chunk * sizeof(*segment));
+
+            for (j = 0; j < n_chunk; j++) {
+                NvmeSglDescriptor *d = &segment[j];
+                uint32_t dlen = le32_to_cpu(d->len);
+
+                switch (NVME_SGL_TYPE(d->type)) {
+                case NVME_SGL_DESCR_TYPE_DATA_BLOCK:
+                    if (dlen > len - qsg->size) {
+                        goto invalid_len;
+                    }
+                    if (dlen) {
+                        nvme_sg_add(qsg, le64_to_cpu(d->addr), dlen);
+                    }
+                    break;
+                case NVME_SGL_DESCR_TYPE_SEGMENT:
+                case NVME_SGL_DESCR_TYPE_LAST_SEGMENT:
+                    /* Only the last descriptor of a segment may chain */
+                    if (last || i + j != nsgld - 1) {
+                        goto invalid_seg;
+                    }
+                    type = NVME_SGL_TYPE(d->type);
+                    addr = le64_to_cpu(d->addr);
+                    seg_len = dlen;
+                    break;
+                default:
+                    qemu_sglist_reset(qsg);
+                    return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+                }
+            }
+        }
+
+        if (last) {
+            break;
+        }
+        /* A segment must describe data, this also bounds the walk */
+        if (type == NVME_SGL_DESCR_TYPE_DATA_BLOCK || qsg->size == mapped) {
+            goto invalid_seg;
+        }
+    }
+
+    if (type != NVME_SGL_DESCR_TYPE_DATA_BLOCK &&
+        type != NVME_SGL_DESCR_TYPE_LAST_SEGMENT) {
+        qemu_sglist_reset(qsg);
+        return NVME_SGL_DESCR_TYPE_INVALID | NVME_DNR;
+    }
+    if (qsg->size != len) {
+        goto invalid_len;
+    }
+    return NVME_SUCCESS;
+
+ invalid_len:
+    qemu_sglist_reset(qsg);
+    return NVME_DATA_SGL_LEN_INVALID | NVME_DNR;
+
+ invalid_seg:
+    qemu_sglist_reset(qsg);
+    return NVME_INVALID_SGL_SEG_DESCR | NVME_DNR;
+}
+
 static uint16_t nvme_dma_read_prp(NvmeCtrl *n, uint8_t *ptr, uint32_t len,
     uint64_t prp1, uint64_t prp2)
 {
     QEMUSGList qsg;
 
+    pci_dma_sglist_init(&qsg, &n->parent_obj, 2);
     if (nvme_map_prp(&qsg, prp1, prp2, len, n)) {
+        qemu_sglist_destroy(&qsg);
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     if (dma_buf_read(ptr, len, &qsg)) {
@@ -165,6 +485,13 @@ static void nvme_post_cqes(void *opaque)
     NvmeCQueue *cq = opaque;
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
+    uint32_t posted = 0;
+
+    if (cq->db_addr) {
+        nvme_update_cq_eventidx(cq);
+        smp_mb();
+        nvme_update_cq_head(cq);
+    }
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
         NvmeSQueue *sq;
@@ -184,8 +511,9 @@ static void nvme_post_cqes(void *opaque)
         pci_dma_write(&n->parent_obj, addr, (void *)&req->cqe,
             sizeof(req->cqe));
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
     }
-    nvme_isr_notify(n, cq);
+    nvme_cq_notify(n, cq, posted);
 }
 
 static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
@@ -193,7 +521,7 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     assert(cq->cqid == req->sq->cqid);
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
-    timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+    nvme_kick_cq(cq);
 }
 
 static void nvme_rw_cb(void *opaque, int ret)
@@ -210,16 +538,12 @@ static void nvme_rw_cb(void *opaque, int ret)
         block_acct_failed(blk_get_stats(n->conf.blk), &req->acct);
         req->status = NVME_INTERNAL_DEV_ERROR;
     }
-    if (req->has_sg) {
-        qemu_sglist_destroy(&req->qsg);
-    }
     nvme_enqueue_req_completion(cq, req);
 }
 
 static uint16_t nvme_flush(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     NvmeRequest *req)
 {
-    req->has_sg = false;
     block_acct_start(blk_get_stats(n->conf.blk), &req->acct, 0,
          BLOCK_ACCT_FLUSH);
     req->aiocb = blk_aio_flush(n->conf.blk, nvme_rw_cb, req);
@@ -242,20 +566,38 @@ static uint16_t nvme_rw(NvmeCtrl *n, NvmeNamespace *ns, NvmeCmd *cmd,
     uint64_t aio_slba  = slba << (data_shift - BDRV_SECTOR_BITS);
     int is_write = rw->opcode == NVME_CMD_WRITE ? 1 : 0;
     enum BlockAcctType acct = is_write ? BLOCK_ACCT_WRITE : BLOCK_ACCT_READ;
+    uint16_t status;
 
     if ((slba + nlb) > ns->id_ns.nsze) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
         return NVME_LBA_RANGE | NVME_DNR;
     }
 
-    if (nvme_map_prp(&req->qsg, prp1, prp2, data_size, n)) {
+    switch (NVME_CMD_FLAGS_PSDT(rw->flags)) {
+    case NVME_PSDT_PRP:
+        status = nvme_map_prp(&req->qsg, prp1, prp2, data_size, n);
+        break;
+    case NVME_PSDT_SGL_MPTR_CONTIG:
+    case NVME_PSDT_SGL_MPTR_SGL: {
+        /* SGL1 occupies the PRP entry fields */
+        NvmeSglDescriptor sgl;
+
+        memcpy(&sgl, &rw->prp1, sizeof(sgl));
+        status = nvme_map_sgl(&req->qsg, &sgl, data_size, n);
+        break;
+    }
+    default:
+        /* PSDT 3 is reserved */
+        status = NVME_INVALID_FIELD | NVME_DNR;
+        break;
+    }
+    if (status) {
         block_acct_invalid(blk_get_stats(n->conf.blk), acct);
-        return NVME_INVALID_FIELD | NVME_DNR;
+        return status;
     }
 
     assert((nlb << data_shift) == req->qsg.size);
 
-    req->has_sg = true;
     dma_acct_start(n->conf.blk, &req->acct, &req->qsg, acct);
     req->aiocb = is_write ?
         dma_blk_write(n->conf.blk, &req->qsg, aio_slba, nvme_rw_cb, req) :
@@ -287,9 +629,23 @@ static uint16_t nvme_io_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 
 static void nvme_free_sq(NvmeSQueue *sq, NvmeCtrl *n)
 {
+    int i;
+
     n->sq[sq->sqid] = NULL;
-    timer_del(sq->timer);
-    timer_free(sq->timer);
+    if (sq->ioeventfd_enabled) {
+        nvme_cleanup_ioeventfd(n, &sq->notifier, 0x1000 + (sq->sqid << 3));
+        sq->ioeventfd_enabled = false;
+    }
+    if (sq->bh) {
+        qemu_bh_delete(sq->bh);
+        sq->bh = NULL;
+    } else {
+        timer_del(sq->timer);
+        timer_free(sq->timer);
+    }
+    for (i = 0; i < sq->size; i++) {
+        qemu_sglist_destroy(&sq->io_req[i].qsg);
+    }
     g_free(sq->io_req);
     if (sq->sqid) {
         g_free(sq);
@@ -349,14 +705,24 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     QTAILQ_INIT(&sq->out_req_list);
     for (i = 0; i < sq->size; i++) {
         sq->io_req[i].sq = sq;
+        pci_dma_sglist_init(&sq->io_req[i].qsg, &n->parent_obj, 2);
         QTAILQ_INSERT_TAIL(&(sq->req_list), &sq->io_req[i], entry);
     }
-    sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    if (n->timer_free) {
+        sq->bh = aio_bh_new(sqid ? n->ctx : qemu_get_aio_context(),
+            nvme_process_sq, sq);
+    } else {
+        sq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_process_sq, sq);
+    }
 
     assert(n->cq[cqid]);
     cq = n->cq[cqid];
     QTAILQ_INSERT_TAIL(&(cq->sq_list), sq, entry);
     n->sq[sqid] = sq;
+
+    if (sqid && n->dbbuf_enabled) {
+        nvme_init_sq_dbbuf(n, sq);
+    }
 }
 
 static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -393,8 +759,24 @@ static uint16_t nvme_create_sq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 {
     n->cq[cq->cqid] = NULL;
-    timer_del(cq->timer);
-    timer_free(cq->timer);
+    if (cq->ioeventfd_enabled) {
+        nvme_cleanup_ioeventfd(n, &cq->notifier,
+            0x1000 + (cq->cqid << 3) + (1 << 2));
+        cq->ioeventfd_enabled = false;
+    }
+    if (cq->bh) {
+        qemu_bh_delete(cq->bh);
+        cq->bh = NULL;
+    } else {
+        timer_del(cq->timer);
+        timer_free(cq->timer);
+    }
+    if (cq->irq_bh) {
+        qemu_bh_delete(cq->irq_bh);
+        cq->irq_bh = NULL;
+    }
+    timer_del(cq->intc_timer);
+    timer_free(cq->intc_timer);
     msix_vector_unuse(&n->parent_obj, cq->vector);
     if (cq->cqid) {
         g_free(cq);
@@ -422,6 +804,8 @@ static uint16_t nvme_del_cq(NvmeCtrl *n, NvmeCmd *cmd)
 static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     uint16_t cqid, uint16_t vector, uint16_t size, uint16_t irq_enabled)
 {
+    AioContext *ctx = cqid ? n->ctx : qemu_get_aio_context();
+
     cq->ctrl = n;
     cq->cqid = cqid;
     cq->size = size;
@@ -430,11 +814,25 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     cq->irq_enabled = irq_enabled;
     cq->vector = vector;
     cq->head = cq->tail = 0;
+    cq->pending_cqes = 0;
     QTAILQ_INIT(&cq->req_list);
     QTAILQ_INIT(&cq->sq_list);
     msix_vector_use(&n->parent_obj, cq->vector);
     n->cq[cqid] = cq;
-    cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    if (n->timer_free) {
+        cq->bh = aio_bh_new(ctx, nvme_post_cqes, cq);
+    } else {
+        cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    }
+    cq->intc_timer = aio_timer_new(ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+        nvme_intc_expired, cq);
+    if (ctx != qemu_get_aio_context()) {
+        /* Interrupts are injected from the main loop under the BQL */
+        cq->irq_bh = qemu_bh_new(nvme_irq_bh, cq);
+    }
+    if (cqid && n->dbbuf_enabled) {
+        nvme_init_cq_dbbuf(n, cq);
+    }
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
@@ -456,7 +854,7 @@ static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeCmd *cmd)
     if (!prp1) {
         return NVME_INVALID_FIELD | NVME_DNR;
     }
-    if (vector > n->num_queues) {
+    if (vector >= n->num_queues) {
         return NVME_INVALID_IRQ_VECTOR | NVME_DNR;
     }
     if (!(NVME_CQ_FLAGS_PC(qflags))) {
@@ -494,6 +892,7 @@ static uint16_t nvme_identify(NvmeCtrl *n, NvmeCmd *cmd)
 static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     uint32_t dw10 = le32_to_cpu(cmd->cdw10);
+    uint32_t dw11 = le32_to_cpu(cmd->cdw11);
     uint32_t result;
 
     switch (dw10) {
@@ -503,6 +902,16 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
     case NVME_NUMBER_OF_QUEUES:
         result = cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        result = cpu_to_le32(n->features.int_coalescing);
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        result = cpu_to_le32(
+            n->features.int_vector_config[NVME_INTVC_IV(dw11)]);
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
@@ -524,12 +933,49 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         req->cqe.result =
             cpu_to_le32((n->num_queues - 1) | ((n->num_queues - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
+    case NVME_INTERRUPT_VECTOR_CONF:
+        if (NVME_INTVC_IV(dw11) >= n->num_queues) {
+            return NVME_INVALID_FIELD | NVME_DNR;
+        }
+        n->features.int_vector_config[NVME_INTVC_IV(dw11)] = dw11 & 0x1ffff;
+        break;
     default:
         return NVME_INVALID_FIELD | NVME_DNR;
     }
     return NVME_SUCCESS;
 }
 
+static uint16_t nvme_dbbuf_config(NvmeCtrl *n, NvmeCmd *cmd)
+{
+    uint64_t dbs_addr = le64_to_cpu(cmd->prp1);
+    uint64_t eis_addr = le64_to_cpu(cmd->prp2);
+    int i;
+
+    /* Both buffers must be page aligned */
+    if (!dbs_addr || dbs_addr & (n->page_size - 1) ||
+        !eis_addr || eis_addr & (n->page_size - 1)) {
+        return NVME_INVALID_FIELD | NVME_DNR;
+    }
+
+    n->dbbuf_dbs = dbs_addr;
+    n->dbbuf_eis = eis_addr;
+    n->dbbuf_enabled = true;
+
+    /* Shadow doorbells are only used for I/O queues */
+    for (i = 1; i < n->num_queues; i++) {
+        if (n->sq[i]) {
+            nvme_init_sq_dbbuf(n, n->sq[i]);
+        }
+        if (n->cq[i]) {
+            nvme_init_cq_dbbuf(n, n->cq[i]);
+        }
+    }
+    return NVME_SUCCESS;
+}
+
 static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
 {
     switch (cmd->opcode) {
@@ -547,6 +993,8 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeCmd *cmd, NvmeRequest *req)
         return nvme_set_feature(n, cmd, req);
     case NVME_ADM_CMD_GET_FEATURES:
         return nvme_get_feature(n, cmd, req);
+    case NVME_ADM_CMD_DBBUF_CONFIG:
+        return nvme_dbbuf_config(n, cmd);
     default:
         return NVME_INVALID_OPCODE | NVME_DNR;
     }
@@ -563,6 +1011,10 @@ static void nvme_process_sq(void *opaque)
     NvmeCmd cmd;
     NvmeRequest *req;
 
+    if (sq->db_addr) {
+        nvme_update_sq_tail(sq);
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * n->sqe_size;
         pci_dma_read(&n->parent_obj, addr, (void *)&cmd, sizeof(cmd));
@@ -574,12 +1026,66 @@ static void nvme_process_sq(void *opaque)
         memset(&req->cqe, 0, sizeof(req->cqe));
         req->cqe.cid = cmd.cid;
 
-        status = sq->sqid ? nvme_io_cmd(n, &cmd, req) :
-            nvme_admin_cmd(n, &cmd, req);
+        if (sq->sqid) {
+            status = nvme_io_cmd(n, &cmd, req);
+        } else {
+            /* Admin commands may create, delete or drain I/O queues */
+            aio_context_acquire(n->ctx);
+            status = nvme_admin_cmd(n, &cmd, req);
+            aio_context_release(n->ctx);
+        }
         if (status != NVME_NO_COMPLETE) {
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+
+        if (sq->db_addr) {
+            nvme_update_sq_eventidx(sq);
+            smp_mb();
+            nvme_update_sq_tail(sq);
+        }
+    }
+}
+
+static void nvme_reset_features(NvmeCtrl *n)
+{
+    int i;
+
+    n->features.int_coalescing = 0;
+    for (i = 0; i < n->num_queues; i++) {
+        n->features.int_vector_config[i] = i;
+    }
+}
+
+/* Block operations that are not safe while the drive is in the iothread */
+static void nvme_set_up_op_blockers(NvmeCtrl *n)
+{
+    BlockBackend *blk = n->conf.blk;
+
+    assert(!n->blocker);
+    error_setg(&n->blocker, "block device is in use by data plane");
+    blk_op_block_all(blk, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_RESIZE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_DRIVE_DEL, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_BACKUP_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_CHANGE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_COMMIT_TARGET, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_EJECT, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_EXTERNAL_SNAPSHOT, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_INTERNAL_SNAPSHOT_DELETE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_MIRROR_SOURCE, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_STREAM, n->blocker);
+    blk_op_unblock(blk, BLOCK_OP_TYPE_REPLACE, n->blocker);
+}
+
+static void nvme_remove_op_blockers(NvmeCtrl *n)
+{
+    if (n->blocker) {
+        blk_op_unblock_all(n->conf.blk, n->blocker);
+        error_free(n->blocker);
+        n->blocker = NULL;
     }
 }
 
@@ -587,6 +1093,7 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
 {
     int i;
 
+    aio_context_acquire(n->ctx);
     for (i = 0; i < n->num_queues; i++) {
         if (n->sq[i] != NULL) {
             nvme_free_sq(n->sq[i], n);
@@ -599,6 +1106,16 @@ static void nvme_clear_ctrl(NvmeCtrl *n)
     }
 
     blk_flush(n->conf.blk);
+
+    /* Drain and switch the drive back to the QEMU main loop */
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, qemu_get_aio_context());
+    }
+    aio_context_release(n->ctx);
+
+    nvme_reset_features(n);
+    n->dbbuf_enabled = false;
+    n->dbbuf_dbs = n->dbbuf_eis = 0;
     n->bar.cc = 0;
 }
 
@@ -624,6 +1141,9 @@ static int nvme_start_ctrl(NvmeCtrl *n)
     n->max_prp_ents = n->page_size / sizeof(uint64_t);
     n->cqe_size = 1 << NVME_CC_IOCQES(n->bar.cc);
     n->sqe_size = 1 << NVME_CC_IOSQES(n->bar.cc);
+    if (n->iothread) {
+        blk_set_aio_context(n->conf.blk, n->ctx);
+    }
     nvme_init_cq(&n->admin_cq, n, n->bar.acq, 0, 0,
         NVME_AQA_ACQS(n->bar.aqa) + 1, 1);
     nvme_init_sq(&n->admin_sq, n, n->bar.asq, 0, 0,
@@ -732,9 +1252,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         if (start_sqs) {
             NvmeSQueue *sq;
             QTAILQ_FOREACH(sq, &cq->sq_list, entry) {
-                timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+                nvme_kick_sq(sq);
             }
-            timer_mod(cq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+            nvme_kick_cq(cq);
         }
 
         if (cq->tail != cq->head) {
@@ -755,7 +1275,7 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
         }
 
         sq->tail = new_tail;
-        timer_mod(sq->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 500);
+        nvme_kick_sq(sq);
     }
 }
 
@@ -766,7 +1286,10 @@ static void nvme_mmio_write(void *opaque, hwaddr addr, uint64_t data,
     if (addr < sizeof(n->bar)) {
         nvme_write_bar(n, addr, data, size);
     } else if (addr >= 0x1000) {
+        /* The queues are processed in the iothread, if there is one */
+        aio_context_acquire(n->ctx);
         nvme_process_db(n, addr, data);
+        aio_context_release(n->ctx);
     }
 }
 
@@ -804,6 +1327,18 @@ static int nvme_init(PCIDevice *pci_dev)
     }
     blkconf_blocksizes(&n->conf);
 
+    if (n->iothread) {
+        if (blk_op_is_blocked(n->conf.blk, BLOCK_OP_TYPE_DATAPLANE, NULL)) {
+            return -1;
+        }
+        object_ref(OBJECT(n->iothread));
+        n->ctx = iothread_get_aio_context(n->iothread);
+        n->timer_free = true;
+        nvme_set_up_op_blockers(n);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     pci_conf = pci_dev->config;
     pci_conf[PCI_INTERRUPT_PIN] = 1;
     pci_config_set_prog_interface(pci_dev->config, 0x2);
@@ -818,6 +1353,8 @@ static int nvme_init(PCIDevice *pci_dev)
     n->namespaces = g_new0(NvmeNamespace, n->num_namespaces);
     n->sq = g_new0(NvmeSQueue *, n->num_queues);
     n->cq = g_new0(NvmeCQueue *, n->num_queues);
+    n->features.int_vector_config = g_new0(uint32_t, n->num_queues);
+    nvme_reset_features(n);
 
     memory_region_init_io(&n->iomem, OBJECT(n), &nvme_mmio_ops, n,
                           "nvme", n->reg_size);
@@ -835,12 +1372,13 @@ static int nvme_init(PCIDevice *pci_dev)
     id->ieee[0] = 0x00;
     id->ieee[1] = 0x02;
     id->ieee[2] = 0xb3;
-    id->oacs = cpu_to_le16(0);
+    id->oacs = cpu_to_le16(NVME_OACS_DBBUF);
     id->frmw = 7 << 1;
     id->lpa = 1 << 0;
     id->sqes = (0x6 << 4) | 0x6;
     id->cqes = (0x4 << 4) | 0x4;
     id->nn = cpu_to_le32(n->num_namespaces);
+    id->sgls = cpu_to_le32(NVME_SGLS_SUPPORTED);
     id->psd[0].mp = cpu_to_le16(0x9c4);
     id->psd[0].enlat = cpu_to_le32(0x10);
     id->psd[0].exlat = cpu_to_le32(0x4);
@@ -884,12 +1422,19 @@ static void nvme_exit(PCIDevice *pci_dev)
     g_free(n->namespaces);
     g_free(n->cq);
     g_free(n->sq);
+    g_free(n->features.int_vector_config);
     msix_uninit_exclusive_bar(pci_dev);
+    if (n->iothread) {
+        nvme_remove_op_blockers(n);
+        object_unref(OBJECT(n->iothread));
+    }
 }
 
 static Property nvme_props[] = {
     DEFINE_BLOCK_PROPERTIES(NvmeCtrl, conf),
     DEFINE_PROP_STRING("serial", NvmeCtrl, serial),
+    DEFINE_PROP_BOOL("timer-free", NvmeCtrl, timer_free, false),
+    DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, ioeventfd, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -921,6 +1466,10 @@ static void nvme_instance_init(Object *obj)
 {
     NvmeCtrl *s = NVME(obj);
 
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &s->conf.bootindex,
                                   "bootindex", "/namespace@1,0",
                                   DEVICE(obj), &error_abort);
@@ -56,6 +56,21 @@
 #define   VM_CAPABILITIES_ATTN     0x10
 #define VM_CMD_FORCEOFF            0x09
 
+/* How long the external BMC has to answer a message. */
+#define EXTERN_RSP_TIMEOUT_NS      4000000000ULL
+#define EXTERN_SEND_RETRY_NS       10000000ULL
+
+/* Worst case size of an encoded message, with every byte escaped. */
+#define EXTERN_MSG_MAX_ENCODED     ((MAX_IPMI_MSG_SIZE + 2) * 2 + 1)
+
+typedef struct IPMIExternReq {
+    QTAILQ_ENTRY(IPMIExternReq) next;
+    bool in_flight;
+    uint8_t netfn;
+    uint8_t cmd;
+    int64_t deadline;
+} IPMIExternReq;
+
 #define TYPE_IPMI_BMC_EXTERN "ipmi-bmc-extern"
 #define IPMI_BMC_EXTERN(obj) OBJECT_CHECK(IPMIBmcExtern, (obj), \
                                         TYPE_IPMI_BMC_EXTERN)
@@ -70,17 +85,44 @@ typedef struct IPMIBmcExtern {
     unsigned int inpos;
     bool in_escape;
     bool in_too_many;
-    bool waiting_rsp;
-    bool sending_cmd;
 
-    unsigned char outbuf[(MAX_IPMI_MSG_SIZE + 2) * 2 + 1];
+    /*
+     * Encoded messages and commands not yet taken by the chardev, in
+     * the order they were queued.  Nothing waits for a response before
+     * the next message goes out.
+     */
+    unsigned char *outbuf;
     unsigned int outpos;
     unsigned int outlen;
+    unsigned int outsize;
+    guint watch;
+    struct QEMUTimer *retry_timer;
 
+    /*
+     * Messages waiting for a response from the external BMC, indexed by
+     * message ID.  in_flight keeps them in the order they were sent,
+     * which is also the order their deadlines expire in.
+     */
+    IPMIExternReq reqs[256];
+    QTAILQ_HEAD(IPMIExternReqList, IPMIExternReq) in_flight;
     struct QEMUTimer *extern_timer;
 
     /* A reset event is pending to be sent upstream. */
     bool send_reset;
+
+    /*
+     * The most recent message still waiting for a response, on migration.
+     * Its ID goes in a subsection, which an older QEMU cannot load; turn
+     * off migrate_request to migrate there, the interface then gets the
+     * error for message ID 0.
+     */
+    bool migrate_request;
+    bool waiting_rsp;
+    uint8_t mig_msg_id;
+    uint8_t mig_netfn;
+    uint8_t mig_cmd;
+    /* The interface has yet to get the error for that message */
+    bool mig_fail_pending;
 } IPMIBmcExtern;
 
 static int can_receive(void *opaque);
@@ -98,66 +140,168 @@ ipmb_checksum(const unsigned char *data, int size, unsigned char start)
         return csum;
 }
 
+/*
+ * Make room for len more bytes at the end of outbuf, dropping what the
+ * chardev has already taken.
+ */
+static void extern_out_reserve(IPMIBmcExtern *ibe, unsigned int len)
+{
+    if (ibe->outpos) {
+        memmove(ibe->outbuf, ibe->outbuf + ibe->outpos,
+                ibe->outlen - ibe->outpos);
+        ibe->outlen -= ibe->outpos;
+        ibe->outpos = 0;
+    }
+    if (ibe->outlen + len > ibe->outsize) {
+        ibe->outsize = MAX(ibe->outsize * 2, ibe->outlen + len);
+        ibe->outbuf = g_realloc(ibe->outbuf, ibe->outsize);
+    }
+}
+
+static void extern_out_flush(IPMIBmcExtern *ibe)
+{
+    if (ibe->watch) {
+        g_source_remove(ibe->watch);
+        ibe->watch = 0;
+    }
+    timer_del(ibe->retry_timer);
+    ibe->outpos = 0;
+    ibe->outlen = 0;
+}
+
+static void continue_send(IPMIBmcExtern *ibe);
+
+static gboolean extern_send_unblocked(GIOChannel *chan, GIOCondition cond,
+                                      void *opaque)
+{
+    IPMIBmcExtern *ibe = opaque;
+
+    ibe->watch = 0;
+    continue_send(ibe);
+    return FALSE;
+}
+
+static void extern_send_retry(void *opaque)
+{
+    continue_send(opaque);
+}
+
 static void continue_send(IPMIBmcExtern *ibe)
 {
-    if (ibe->outlen == 0) {
-        goto check_reset;
+    int ret;
+
+    if (ibe->connected && ibe->send_reset) {
+        /* Queue the reset behind anything already pending */
+        ibe->send_reset = false;
+        extern_out_reserve(ibe, 2);
+        ibe->outbuf[ibe->outlen++] = VM_CMD_RESET;
+        ibe->outbuf[ibe->outlen++] = VM_CMD_CHAR;
+    }
+
+    while (ibe->outpos < ibe->outlen) {
+        ret = qemu_chr_fe_write(ibe->chr, ibe->outbuf + ibe->outpos,
+                                ibe->outlen - ibe->outpos);
+        if (ret <= 0) {
+            break;
+        }
+        ibe->outpos += ret;
     }
- send:
-    ibe->outpos += qemu_chr_fe_write(ibe->chr, ibe->outbuf + ibe->outpos,
-                                     ibe->outlen - ibe->outpos);
+
     if (ibe->outpos < ibe->outlen) {
-        /* Not fully transmitted, try again in a 10ms */
-        timer_mod_ns(ibe->extern_timer,
-                     qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 10000000);
+        /* Not fully transmitted, try again when the chardev has room. */
+        if (!ibe->watch) {
+            ibe->watch = qemu_chr_fe_add_watch(ibe->chr, G_IO_OUT | G_IO_HUP,
+                                               extern_send_unblocked, ibe);
+        }
+        if (!ibe->watch) {
+            timer_mod_ns(ibe->retry_timer,
+                         qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                         EXTERN_SEND_RETRY_NS);
+        }
     } else {
         /* Sent */
         ibe->outlen = 0;
         ibe->outpos = 0;
-        if (!ibe->sending_cmd) {
-            ibe->waiting_rsp = true;
-        } else {
-            ibe->sending_cmd = false;
-        }
-    check_reset:
-        if (ibe->connected && ibe->send_reset) {
-            /* Send the reset */
-            ibe->outbuf[0] = VM_CMD_RESET;
-            ibe->outbuf[1] = VM_CMD_CHAR;
-            ibe->outlen = 2;
-            ibe->outpos = 0;
-            ibe->send_reset = false;
-            ibe->sending_cmd = true;
-            goto send;
-        }
+    }
+}
 
-        if (ibe->waiting_rsp) {
-            /* Make sure we get a response within 4 seconds. */
-            timer_mod_ns(ibe->extern_timer,
-                         qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + 4000000000ULL);
-        }
+static void extern_arm_timer(IPMIBmcExtern *ibe)
+{
+    IPMIExternReq *req = QTAILQ_FIRST(&ibe->in_flight);
+
+    if (ibe->mig_fail_pending) {
+        timer_mod_ns(ibe->extern_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    } else if (req) {
+        timer_mod_ns(ibe->extern_timer, req->deadline);
+    } else {
+        timer_del(ibe->extern_timer);
     }
-    return;
+}
+
+static void extern_req_done(IPMIBmcExtern *ibe, IPMIExternReq *req)
+{
+    QTAILQ_REMOVE(&ibe->in_flight, req, next);
+    req->in_flight = false;
+}
+
+/* Return an error to the interface for a message without a response. */
+static void extern_fail_req(IPMIBmcExtern *ibe, IPMIExternReq *req,
+                            uint8_t err)
+{
+    IPMIInterface *s = ibe->parent.intf;
+    IPMIInterfaceClass *k = IPMI_INTERFACE_GET_CLASS(s);
+    unsigned char rsp[3];
+
+    extern_req_done(ibe, req);
+    rsp[0] = req->netfn | 0x04;
+    rsp[1] = req->cmd;
+    rsp[2] = err;
+    k->handle_rsp(s, req - ibe->reqs, rsp, 3);
+}
+
+static void extern_fail_all(IPMIBmcExtern *ibe, uint8_t err)
+{
+    IPMIExternReq *req;
+
+    while ((req = QTAILQ_FIRST(&ibe->in_flight))) {
+        extern_fail_req(ibe, req, err);
+    }
+    extern_arm_timer(ibe);
+}
+
+/*
+ * We don't directly restore waiting_rsp, instead we return an error on
+ * the interface if a response was being waited for.  Only the most recent
+ * message can still be wanted by the interface.
+ */
+static void extern_fail_migrated(IPMIBmcExtern *ibe)
+{
+    IPMIInterface *s = ibe->parent.intf;
+    IPMIInterfaceClass *k = IPMI_INTERFACE_GET_CLASS(s);
+    unsigned char rsp[3];
+
+    ibe->mig_fail_pending = false;
+    rsp[0] = ibe->mig_netfn | 0x04;
+    rsp[1] = ibe->mig_cmd;
+    rsp[2] = IPMI_CC_BMC_INIT_IN_PROGRESS;
+    k->handle_rsp(s, ibe->mig_msg_id, rsp, 3);
 }
 
 static void extern_timeout(void *opaque)
 {
     IPMIBmcExtern *ibe = opaque;
-    IPMIInterface *s = ibe->parent.intf;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    IPMIExternReq *req;
 
-    if (ibe->connected) {
-        if (ibe->waiting_rsp && (ibe->outlen == 0)) {
-            IPMIInterfaceClass *k = IPMI_INTERFACE_GET_CLASS(s);
-            /* The message response timed out, return an error. */
-            ibe->waiting_rsp = false;
-            ibe->inbuf[1] = ibe->outbuf[1] | 0x04;
-            ibe->inbuf[2] = ibe->outbuf[2];
-            ibe->inbuf[3] = IPMI_CC_TIMEOUT;
-            k->handle_rsp(s, ibe->outbuf[0], ibe->inbuf + 1, 3);
-        } else {
-            continue_send(ibe);
-        }
+    if (ibe->mig_fail_pending) {
+        extern_fail_migrated(ibe);
     }
+
+    /* The message response timed out, return an error. */
+    while ((req = QTAILQ_FIRST(&ibe->in_flight)) && req->deadline <= now) {
+        extern_fail_req(ibe, req, IPMI_CC_TIMEOUT);
+    }
+    extern_arm_timer(ibe);
 }
 
 static void addchar(IPMIBmcExtern *ibe, unsigned char ch)
@@ -184,16 +328,10 @@ static void ipmi_bmc_extern_handle_command(IPMIBmc *b,
 {
     IPMIBmcExtern *ibe = IPMI_BMC_EXTERN(b);
     IPMIInterface *s = ibe->parent.intf;
+    IPMIExternReq *req = &ibe->reqs[msg_id];
     uint8_t err = 0, csum;
     unsigned int i;
 
-    if (ibe->outlen) {
-        /* We already have a command queued.  Shouldn't ever happen. */
-        fprintf(stderr, "IPMI KCS: Got command when not finished with the"
-                " previous commmand\n");
-        abort();
-    }
-
     /* If it's too short or it was truncated, return an error. */
     if (cmd_len < 2) {
         err = IPMI_CC_REQUEST_DATA_LENGTH_INVALID;
@@ -208,11 +346,26 @@ static void ipmi_bmc_extern_handle_command(IPMIBmc *b,
         rsp[0] = cmd[0] | 0x04;
         rsp[1] = cmd[1];
         rsp[2] = err;
-        ibe->waiting_rsp = false;
         k->handle_rsp(s, msg_id, rsp, 3);
         goto out;
     }
 
+    if (req->in_flight) {
+        /*
+         * The interface has given up on the previous message with this
+         * ID, a late response to it would be for the new one.
+         */
+        extern_req_done(ibe, req);
+    }
+    req->in_flight = true;
+    req->netfn = cmd[0];
+    req->cmd = cmd[1];
+    req->deadline = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+        EXTERN_RSP_TIMEOUT_NS;
+    QTAILQ_INSERT_TAIL(&ibe->in_flight, req, next);
+    extern_arm_timer(ibe);
+
+    extern_out_reserve(ibe, EXTERN_MSG_MAX_ENCODED);
     addchar(ibe, msg_id);
     for (i = 0; i < cmd_len; i++) {
         addchar(ibe, cmd[i]);
@@ -281,6 +434,7 @@ static void handle_hw_op(IPMIBmcExtern *ibe, unsigned char hw_op)
 static void handle_msg(IPMIBmcExtern *ibe)
 {
     IPMIInterfaceClass *k = IPMI_INTERFACE_GET_CLASS(ibe->parent.intf);
+    IPMIExternReq *req;
 
     if (ibe->in_escape) {
         ipmi_debug("msg escape not ended\n");
@@ -300,8 +454,13 @@ static void handle_msg(IPMIBmcExtern *ibe)
         ibe->inpos--; /* Remove checkum */
     }
 
-    timer_del(ibe->extern_timer);
-    ibe->waiting_rsp = false;
+    req = &ibe->reqs[ibe->inbuf[0]];
+    if (!req->in_flight) {
+        ipmi_debug("msg response to nothing outstanding\n");
+        return;
+    }
+    extern_req_done(ibe, req);
+    extern_arm_timer(ibe);
     k->handle_rsp(ibe->parent.intf, ibe->inbuf[0], ibe->inbuf + 1, ibe->inpos - 1);
 }
 
@@ -310,15 +469,39 @@ static int can_receive(void *opaque)
     return 1;
 }
 
+static inline bool is_data_char(unsigned char ch)
+{
+    return ch != VM_MSG_CHAR && ch != VM_CMD_CHAR && ch != VM_ESCAPE_CHAR;
+}
+
 static void receive(void *opaque, const uint8_t *buf, int size)
 {
     IPMIBmcExtern *ibe = opaque;
-    int i;
-    unsigned char hw_op;
+    int i, n;
+    unsigned int room;
 
     for (i = 0; i < size; i++) {
         unsigned char ch = buf[i];
 
+        if (!ibe->in_escape && is_data_char(ch)) {
+            /* Copy a whole run of unescaped data at once. */
+            for (n = 1; i + n < size && is_data_char(buf[i + n]); n++) {
+                /* nothing */
+            }
+            if (!ibe->in_too_many) {
+                room = sizeof(ibe->inbuf) - ibe->inpos;
+                if (n > room) {
+                    ibe->in_too_many = true;
+                } else {
+                    room = n;
+                }
+                memcpy(ibe->inbuf + ibe->inpos, buf + i, room);
+                ibe->inpos += room;
+            }
+            i += n - 1;
+            continue;
+        }
+
         switch (ch) {
         case VM_MSG_CHAR:
             handle_msg(ibe);
@@ -344,9 +527,8 @@ static void receive(void *opaque, const uint8_t *buf, int size)
             if (ibe->inpos < 1) {
                 break;
             }
-            hw_op = ibe->inbuf[0];
             ibe->inpos = 0;
-            goto out_hw_op;
+            handle_hw_op(ibe, ibe->inbuf[0]);
             break;
 
         case VM_ESCAPE_CHAR:
@@ -354,10 +536,9 @@ static void receive(void *opaque, const uint8_t *buf, int size)
             break;
 
         default:
-            if (ibe->in_escape) {
-                ch &= ~0x10;
-                ibe->in_escape = false;
-            }
+            /* The escaped character */
+            ch &= ~0x10;
+            ibe->in_escape = false;
             if (ibe->in_too_many) {
                 break;
             }
@@ -370,10 +551,6 @@ static void receive(void *opaque, const uint8_t *buf, int size)
             break;
         }
     }
-    return;
-
- out_hw_op:
-    handle_hw_op(ibe, hw_op);
 }
 
 static void chr_event(void *opaque, int event)
@@ -386,8 +563,8 @@ static void chr_event(void *opaque, int event)
     switch (event) {
     case CHR_EVENT_OPENED:
         ibe->connected = true;
-        ibe->outpos = 0;
-        ibe->outlen = 0;
+        extern_out_flush(ibe);
+        extern_out_reserve(ibe, 8);
         addchar(ibe, VM_CMD_VERSION);
         addchar(ibe, VM_PROTOCOL_VERSION);
         ibe->outbuf[ibe->outlen] = VM_CMD_CHAR;
@@ -406,7 +583,6 @@ static void chr_event(void *opaque, int event)
         addchar(ibe, v);
         ibe->outbuf[ibe->outlen] = VM_CMD_CHAR;
         ibe->outlen++;
-        ibe->sending_cmd = false;
         continue_send(ibe);
         break;
 
@@ -415,13 +591,8 @@ static void chr_event(void *opaque, int event)
             return;
         }
         ibe->connected = false;
-        if (ibe->waiting_rsp) {
-            ibe->waiting_rsp = false;
-            ibe->inbuf[1] = ibe->outbuf[1] | 0x04;
-            ibe->inbuf[2] = ibe->outbuf[2];
-            ibe->inbuf[3] = IPMI_CC_BMC_INIT_IN_PROGRESS;
-            k->handle_rsp(s, ibe->outbuf[0], ibe->inbuf + 1, 3);
-        }
+        extern_out_flush(ibe);
+        extern_fail_all(ibe, IPMI_CC_BMC_INIT_IN_PROGRESS);
         break;
     }
 }
@@ -446,36 +617,67 @@ static void ipmi_bmc_extern_realize(DeviceState *dev, Error **errp)
     qemu_chr_add_handlers(ibe->chr, can_receive, receive, chr_event, ibe);
 }
 
+static void ipmi_bmc_extern_pre_save(void *opaque)
+{
+    IPMIBmcExtern *ibe = opaque;
+    IPMIExternReq *req = QTAILQ_LAST(&ibe->in_flight, IPMIExternReqList);
+
+    ibe->waiting_rsp = req != NULL;
+    if (req) {
+        ibe->mig_msg_id = req - ibe->reqs;
+        ibe->mig_netfn = req->netfn;
+        ibe->mig_cmd = req->cmd;
+    }
+}
+
 static int ipmi_bmc_extern_post_migrate(void *opaque, int version_id)
 {
     IPMIBmcExtern *ibe = opaque;
 
     /*
-     * We don't directly restore waiting_rsp, Instead, we return an
-     * error on the interface if a response was being waited for.
+     * The interface may be loaded after us and would lose the response,
+     * so send it once the VM runs again and the virtual clock moves.
      */
-    if (ibe->waiting_rsp) {
-        IPMIInterface *ii = ibe->parent.intf;
-        IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-
-        ibe->waiting_rsp = false;
-        ibe->inbuf[1] = ibe->outbuf[1] | 0x04;
-        ibe->inbuf[2] = ibe->outbuf[2];
-        ibe->inbuf[3] = IPMI_CC_BMC_INIT_IN_PROGRESS;
-        iic->handle_rsp(ii, ibe->outbuf[0], ibe->inbuf + 1, 3);
-    }
+    ibe->mig_fail_pending = ibe->waiting_rsp;
+    ibe->waiting_rsp = false;
+    extern_arm_timer(ibe);
     return 0;
 }
 
+static bool ipmi_bmc_extern_request_needed(void *opaque)
+{
+    IPMIBmcExtern *ibe = opaque;
+
+    return ibe->migrate_request && ibe->waiting_rsp;
+}
+
+static const VMStateDescription vmstate_ipmi_bmc_extern_request = {
+    .name = TYPE_IPMI_BMC_EXTERN "/request",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = ipmi_bmc_extern_request_needed,
+    .fields      = (VMStateField[]) {
+        VMSTATE_UINT8(mig_msg_id, IPMIBmcExtern),
+        VMSTATE_UINT8(mig_netfn, IPMIBmcExtern),
+        VMSTATE_UINT8(mig_cmd, IPMIBmcExtern),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ipmi_bmc_extern = {
     .name = TYPE_IPMI_BMC_EXTERN,
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_save = ipmi_bmc_extern_pre_save,
     .post_load = ipmi_bmc_extern_post_migrate,
     .fields      = (VMStateField[]) {
         VMSTATE_BOOL(send_reset, IPMIBmcExtern),
         VMSTATE_BOOL(waiting_rsp, IPMIBmcExtern),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_ipmi_bmc_extern_request,
+        NULL
     }
 };
 
@@ -483,12 +685,16 @@ static void ipmi_bmc_extern_init(Object *obj)
 {
     IPMIBmcExtern *ibe = IPMI_BMC_EXTERN(obj);
 
+    QTAILQ_INIT(&ibe->in_flight);
     ibe->extern_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, extern_timeout, ibe);
+    ibe->retry_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, extern_send_retry,
+                                    ibe);
     vmstate_register(NULL, 0, &vmstate_ipmi_bmc_extern, ibe);
 }
 
 static Property ipmi_bmc_extern_properties[] = {
     DEFINE_PROP_CHR("chardev", IPMIBmcExtern, chr),
+    DEFINE_PROP_BOOL("migrate_request", IPMIBmcExtern, migrate_request, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
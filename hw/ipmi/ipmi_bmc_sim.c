@@ -27,6 +27,7 @@
 #include "qemu/timer.h"
 #include "hw/ipmi/ipmi.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 #define IPMI_NETFN_CHASSIS            0x00
 
@@ -97,11 +98,17 @@ struct ipmi_time {
     long tv_nsec;
 };
 
-#define MAX_SEL_SIZE 128
+#define IPMI_SEL_ENTRY_SIZE 16
+#define DEFAULT_SEL_SIZE 128
+/* Get SEL Info reports the free space in bytes in a 16-bit field. */
+#define MAX_SEL_SIZE (0xfffe / IPMI_SEL_ENTRY_SIZE)
 
 typedef struct IPMISel {
-    uint8_t sel[MAX_SEL_SIZE][16];
+    uint8_t (*sel)[IPMI_SEL_ENTRY_SIZE];
+    unsigned int alloc; /* Entries allocated in sel */
+    uint32_t max_size; /* In entries */
     unsigned int next_free;
+    int fd; /* Persistent copy of the SEL, -1 if none */
     long time_offset;
     uint16_t reservation;
     uint8_t last_addition[4];
@@ -109,11 +116,25 @@ typedef struct IPMISel {
     uint8_t overflow;
 } IPMISel;
 
-#define MAX_SDR_SIZE 16384
+#define DEFAULT_SDR_SIZE 16384
+/* Record ID 0xffff is reserved to mean the last record. */
+#define MAX_SDR_ENTRIES 0xffff
+#define MAX_SDR_RECORD_SIZE 255
+/* Anything bigger could never be filled before running out of record IDs. */
+#define MAX_SDR_SIZE (MAX_SDR_ENTRIES * MAX_SDR_RECORD_SIZE)
 
 typedef struct IPMISdr {
-    uint8_t sdr[MAX_SDR_SIZE];
+    uint8_t *sdr;
+    unsigned int alloc; /* Bytes allocated in sdr */
+    uint32_t max_size; /* In bytes */
     unsigned int next_free;
+    /*
+     * Record IDs are handed out in order starting from 0, and are only
+     * reused after the repository is cleared, so the offset of each
+     * record in sdr is indexed by its record ID.
+     */
+    unsigned int *index;
+    unsigned int index_alloc;
     uint16_t next_rec_id;
     uint16_t reservation;
     uint8_t last_addition[4];
@@ -149,7 +170,8 @@ typedef struct IPMISensor {
                                              (v & 0xc0))
 #define IPMI_SENSOR_IS_DISCRETE(s) ((s)->evt_reading_type_code != 1)
 
-#define MAX_SENSORS 20
+/* Sensor numbers are 8 bits and 0xff is reserved. */
+#define MAX_SENSORS 255
 #define IPMI_WATCHDOG_SENSOR 0
 
 typedef struct IPMIBmcSim IPMIBmcSim;
@@ -213,6 +235,8 @@ struct IPMIBmcSim {
     IPMISel sel;
     IPMISdr sdr;
     IPMISensor sensors[MAX_SENSORS];
+    char *sdr_filename;
+    char *sel_filename;
 
     /* Odd netfns are for responses, so we only need the even ones. */
     const IPMINetfn *netfns[MAX_NETFNS / 2];
@@ -341,14 +365,19 @@ static void sdr_inc_reservation(IPMISdr *sdr)
     }
 }
 
+/*
+ * Records are only ever appended, so an addition does not move anything
+ * a reader holding a reservation may be looking at and the reservation
+ * is left alone.  Only clearing the repository cancels it.
+ */
 static int sdr_add_entry(IPMIBmcSim *ibs,
                          const struct ipmi_sdr_header *sdrh_entry,
                          unsigned int len, uint16_t *recid)
 {
-    struct ipmi_sdr_header *sdrh =
-        (struct ipmi_sdr_header *) &ibs->sdr.sdr[ibs->sdr.next_free];
+    IPMISdr *sdr = &ibs->sdr;
+    struct ipmi_sdr_header *sdrh;
 
-    if ((len < IPMI_SDR_HEADER_SIZE) || (len > 255)) {
+    if ((len < IPMI_SDR_HEADER_SIZE) || (len > MAX_SDR_RECORD_SIZE)) {
         return 1;
     }
 
@@ -356,52 +385,61 @@ static int sdr_add_entry(IPMIBmcSim *ibs,
         return 1;
     }
 
-    if (ibs->sdr.next_free + len > MAX_SDR_SIZE) {
-        ibs->sdr.overflow = 1;
+    if (sdr->next_free + len > sdr->max_size ||
+        sdr->next_rec_id == MAX_SDR_ENTRIES) {
+        sdr->overflow = 1;
         return 1;
     }
 
+    if (sdr->next_free + len > sdr->alloc) {
+        sdr->alloc = MIN(MAX(sdr->alloc * 2, sdr->next_free + len),
+                         sdr->max_size);
+        sdr->sdr = g_realloc(sdr->sdr, sdr->alloc);
+    }
+    if (sdr->next_rec_id == sdr->index_alloc) {
+        sdr->index_alloc = MAX(sdr->index_alloc * 2, 16);
+        sdr->index = g_renew(unsigned int, sdr->index, sdr->index_alloc);
+    }
+
+    sdrh = (struct ipmi_sdr_header *) &sdr->sdr[sdr->next_free];
     memcpy(sdrh, sdrh_entry, len);
-    sdrh->rec_id[0] = ibs->sdr.next_rec_id & 0xff;
-    sdrh->rec_id[1] = (ibs->sdr.next_rec_id >> 8) & 0xff;
+    sdrh->rec_id[0] = sdr->next_rec_id & 0xff;
+    sdrh->rec_id[1] = (sdr->next_rec_id >> 8) & 0xff;
     sdrh->sdr_version = 0x51; /* Conform to IPMI 1.5 spec */
+    sdr->index[sdr->next_rec_id] = sdr->next_free;
 
     if (recid) {
-        *recid = ibs->sdr.next_rec_id;
+        *recid = sdr->next_rec_id;
     }
-    ibs->sdr.next_rec_id++;
-    set_timestamp(ibs, ibs->sdr.last_addition);
-    ibs->sdr.next_free += len;
-    sdr_inc_reservation(&ibs->sdr);
+    sdr->next_rec_id++;
+    set_timestamp(ibs, sdr->last_addition);
+    sdr->next_free += len;
     return 0;
 }
 
 static int sdr_find_entry(IPMISdr *sdr, uint16_t recid,
                           unsigned int *retpos, uint16_t *nextrec)
 {
-    unsigned int pos = *retpos;
-
-    while (pos < sdr->next_free) {
-        struct ipmi_sdr_header *sdrh =
-            (struct ipmi_sdr_header *) &sdr->sdr[pos];
-        uint16_t trec = ipmi_sdr_recid(sdrh);
-        unsigned int nextpos = pos + ipmi_sdr_length(sdrh);
-
-        if (trec == recid) {
-            if (nextrec) {
-                if (nextpos >= sdr->next_free) {
-                    *nextrec = 0xffff;
-                } else {
-                    *nextrec = (sdr->sdr[nextpos] |
-                                (sdr->sdr[nextpos + 1] << 8));
-                }
-            }
-            *retpos = pos;
-            return 0;
+    if (recid == 0xffff) {
+        /* Last record */
+        if (sdr->next_rec_id == 0) {
+            return 1;
         }
-        pos = nextpos;
+        recid = sdr->next_rec_id - 1;
     }
-    return 1;
+    if (recid >= sdr->next_rec_id) {
+        return 1;
+    }
+
+    if (nextrec) {
+        if (recid + 1 == sdr->next_rec_id) {
+            *nextrec = 0xffff;
+        } else {
+            *nextrec = recid + 1;
+        }
+    }
+    *retpos = sdr->index[recid];
+    return 0;
 }
 
 static void sel_inc_reservation(IPMISel *sel)
@@ -412,22 +450,55 @@ static void sel_inc_reservation(IPMISel *sel)
     }
 }
 
-/* Returns 1 if the SEL is full and can't hold the event. */
+static void sel_save_entry(IPMISel *sel, unsigned int entry)
+{
+    if (sel->fd < 0) {
+        return;
+    }
+    if (pwrite(sel->fd, sel->sel[entry], IPMI_SEL_ENTRY_SIZE,
+               (off_t) entry * IPMI_SEL_ENTRY_SIZE) != IPMI_SEL_ENTRY_SIZE) {
+        error_report("Unable to save SEL entry %u: %s", entry,
+                     strerror(errno));
+    }
+}
+
+static void sel_clear(IPMIBmcSim *ibs)
+{
+    ibs->sel.next_free = 0;
+    ibs->sel.overflow = 0;
+    set_timestamp(ibs, ibs->sel.last_clear);
+    sel_inc_reservation(&ibs->sel);
+    if (ibs->sel.fd >= 0 && ftruncate(ibs->sel.fd, 0) < 0) {
+        error_report("Unable to clear SEL file: %s", strerror(errno));
+    }
+}
+
+/*
+ * Returns 1 if the SEL is full and can't hold the event.  As with the
+ * SDR repository, entries are appended, so adding one leaves the
+ * reservation alone.
+ */
 static int sel_add_event(IPMIBmcSim *ibs, uint8_t *event)
 {
+    IPMISel *sel = &ibs->sel;
+
     event[0] = 0xff;
     event[1] = 0xff;
     set_timestamp(ibs, event + 3);
-    if (ibs->sel.next_free == MAX_SEL_SIZE) {
-        ibs->sel.overflow = 1;
+    if (sel->next_free == sel->max_size) {
+        sel->overflow = 1;
         return 1;
     }
-    event[0] = ibs->sel.next_free & 0xff;
-    event[1] = (ibs->sel.next_free >> 8) & 0xff;
-    memcpy(ibs->sel.last_addition, event + 3, 4);
-    memcpy(ibs->sel.sel[ibs->sel.next_free], event, 16);
-    ibs->sel.next_free++;
-    sel_inc_reservation(&ibs->sel);
+    if (sel->next_free == sel->alloc) {
+        sel->alloc = MIN(MAX(sel->alloc * 2, 16), sel->max_size);
+        sel->sel = g_realloc(sel->sel, sel->alloc * IPMI_SEL_ENTRY_SIZE);
+    }
+    event[0] = sel->next_free & 0xff;
+    event[1] = (sel->next_free >> 8) & 0xff;
+    memcpy(sel->last_addition, event + 3, 4);
+    memcpy(sel->sel[sel->next_free], event, IPMI_SEL_ENTRY_SIZE);
+    sel_save_entry(sel, sel->next_free);
+    sel->next_free++;
     return 0;
 }
 
@@ -1187,13 +1258,15 @@ static void get_sdr_rep_info(IPMIBmcSim *ibs,
                              uint8_t *cmd, unsigned int cmd_len,
                              RspBuffer *rsp)
 {
-    unsigned int i;
+    unsigned int i, val;
 
     rsp_buffer_push(rsp, 0x51); /* Conform to IPMI 1.5 spec */
     rsp_buffer_push(rsp, ibs->sdr.next_rec_id & 0xff);
     rsp_buffer_push(rsp, (ibs->sdr.next_rec_id >> 8) & 0xff);
-    rsp_buffer_push(rsp, (MAX_SDR_SIZE - ibs->sdr.next_free) & 0xff);
-    rsp_buffer_push(rsp, ((MAX_SDR_SIZE - ibs->sdr.next_free) >> 8) & 0xff);
+    /* 0xfffe means at least that much, 0xffff would be unspecified. */
+    val = MIN(ibs->sdr.max_size - ibs->sdr.next_free, 0xfffe);
+    rsp_buffer_push(rsp, val & 0xff);
+    rsp_buffer_push(rsp, (val >> 8) & 0xff);
     for (i = 0; i < 4; i++) {
         rsp_buffer_push(rsp, ibs->sdr.last_addition[i]);
     }
@@ -1208,6 +1281,7 @@ static void reserve_sdr_rep(IPMIBmcSim *ibs,
                             uint8_t *cmd, unsigned int cmd_len,
                             RspBuffer *rsp)
 {
+    sdr_inc_reservation(&ibs->sdr);
     rsp_buffer_push(rsp, ibs->sdr.reservation & 0xff);
     rsp_buffer_push(rsp, (ibs->sdr.reservation >> 8) & 0xff);
 }
@@ -1227,7 +1301,6 @@ static void get_sdr(IPMIBmcSim *ibs,
         }
     }
 
-    pos = 0;
     if (sdr_find_entry(&ibs->sdr, cmd[4] | (cmd[5] << 8),
                        &pos, &nextrec)) {
         rsp_buffer_set_error(rsp, IPMI_CC_REQ_ENTRY_NOT_PRESENT);
@@ -1261,7 +1334,7 @@ static void add_sdr(IPMIBmcSim *ibs,
                     RspBuffer *rsp)
 {
     uint16_t recid;
-    struct ipmi_sdr_header *sdrh = (struct ipmi_sdr_header *) cmd + 2;
+    struct ipmi_sdr_header *sdrh = (struct ipmi_sdr_header *) (cmd + 2);
 
     if (sdr_add_entry(ibs, sdrh, cmd_len - 2, &recid)) {
         rsp_buffer_set_error(rsp, IPMI_CC_INVALID_DATA_FIELD);
@@ -1286,6 +1359,7 @@ static void clear_sdr_rep(IPMIBmcSim *ibs,
     }
     if (cmd[7] == 0xaa) {
         ibs->sdr.next_free = 0;
+        ibs->sdr.next_rec_id = 0;
         ibs->sdr.overflow = 0;
         set_timestamp(ibs, ibs->sdr.last_clear);
         rsp_buffer_push(rsp, 1); /* Erasure complete */
@@ -1307,7 +1381,7 @@ static void get_sel_info(IPMIBmcSim *ibs,
     rsp_buffer_push(rsp, 0x51); /* Conform to IPMI 1.5 */
     rsp_buffer_push(rsp, ibs->sel.next_free & 0xff);
     rsp_buffer_push(rsp, (ibs->sel.next_free >> 8) & 0xff);
-    val = (MAX_SEL_SIZE - ibs->sel.next_free) * 16;
+    val = (ibs->sel.max_size - ibs->sel.next_free) * IPMI_SEL_ENTRY_SIZE;
     rsp_buffer_push(rsp, val & 0xff);
     rsp_buffer_push(rsp, (val >> 8) & 0xff);
     for (i = 0; i < 4; i++) {
@@ -1324,6 +1398,7 @@ static void reserve_sel(IPMIBmcSim *ibs,
                         uint8_t *cmd, unsigned int cmd_len,
                         RspBuffer *rsp)
 {
+    sel_inc_reservation(&ibs->sel);
     rsp_buffer_push(rsp, ibs->sel.reservation & 0xff);
     rsp_buffer_push(rsp, (ibs->sel.reservation >> 8) & 0xff);
 }
@@ -1403,11 +1478,8 @@ static void clear_sel(IPMIBmcSim *ibs,
         return;
     }
     if (cmd[7] == 0xaa) {
-        ibs->sel.next_free = 0;
-        ibs->sel.overflow = 0;
-        set_timestamp(ibs, ibs->sdr.last_clear);
+        sel_clear(ibs);
         rsp_buffer_push(rsp, 1); /* Erasure complete */
-        sel_inc_reservation(&ibs->sel);
     } else if (cmd[7] == 0) {
         rsp_buffer_push(rsp, 1); /* Erasure complete */
     } else {
@@ -1692,15 +1764,29 @@ static uint8_t init_sdrs[] = {
     'W',  'a',  't',  'c',  'h',  'd',  'o',  'g',
 };
 
-static void ipmi_sdr_init(IPMIBmcSim *ibs)
+static void ipmi_sdr_init(IPMIBmcSim *ibs, Error **errp)
 {
     unsigned int i;
     int len;
-    size_t sdrs_size;
+    gsize sdrs_size;
     uint8_t *sdrs;
-
-    sdrs_size = sizeof(init_sdrs);
-    sdrs = init_sdrs;
+    gchar *sdrs_buf = NULL;
+    GError *gerr = NULL;
+
+    if (ibs->sdr_filename &&
+        !g_file_get_contents(ibs->sdr_filename, &sdrs_buf, &sdrs_size,
+                             &gerr)) {
+        error_setg(errp, "Unable to read SDR file '%s': %s",
+                   ibs->sdr_filename, gerr->message);
+        g_error_free(gerr);
+        return;
+    }
+    if (sdrs_buf) {
+        sdrs = (uint8_t *) sdrs_buf;
+    } else {
+        sdrs_size = sizeof(init_sdrs);
+        sdrs = init_sdrs;
+    }
 
     for (i = 0; i < sdrs_size; i += len) {
         struct ipmi_sdr_header *sdrh;
@@ -1713,9 +1799,65 @@ static void ipmi_sdr_init(IPMIBmcSim *ibs)
         len = ipmi_sdr_length(sdrh);
         if (i + len > sdrs_size) {
             error_report("Problem with recid 0x%4.4x", i);
-            return;
+            break;
+        }
+        if (sdr_add_entry(ibs, sdrh, len, NULL)) {
+            error_report("Unable to add SDR at offset 0x%4.4x", i);
+            break;
         }
-        sdr_add_entry(ibs, sdrh, len, NULL);
+    }
+    g_free(sdrs_buf);
+}
+
+static void ipmi_sel_init(IPMIBmcSim *ibs, Error **errp)
+{
+    IPMISel *sel = &ibs->sel;
+    gchar *buf;
+    gsize len;
+    GError *gerr = NULL;
+    unsigned int i;
+
+    sel->fd = -1;
+    if (!ibs->sel_filename) {
+        return;
+    }
+
+    sel->fd = qemu_open(ibs->sel_filename, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (sel->fd < 0) {
+        error_setg_errno(errp, errno, "Unable to open SEL file '%s'",
+                         ibs->sel_filename);
+        return;
+    }
+    if (!g_file_get_contents(ibs->sel_filename, &buf, &len, &gerr)) {
+        error_setg(errp, "Unable to read SEL file '%s': %s",
+                   ibs->sel_filename, gerr->message);
+        g_error_free(gerr);
+        qemu_close(sel->fd);
+        sel->fd = -1;
+        return;
+    }
+
+    sel->next_free = MIN(len / IPMI_SEL_ENTRY_SIZE, sel->max_size);
+    sel->alloc = sel->next_free;
+    sel->sel = g_malloc(sel->alloc * IPMI_SEL_ENTRY_SIZE);
+    memcpy(sel->sel, buf, sel->next_free * IPMI_SEL_ENTRY_SIZE);
+    g_free(buf);
+    for (i = 0; i < sel->next_free; i++) {
+        /* Record IDs are the position in the SEL, as in sel_add_event. */
+        sel->sel[i][0] = i & 0xff;
+        sel->sel[i][1] = (i >> 8) & 0xff;
+    }
+    if (sel->next_free) {
+        memcpy(sel->last_addition, sel->sel[sel->next_free - 1] + 3, 4);
+    }
+
+    /* Drop anything that no longer fits, or a partially written entry. */
+    if (len != sel->next_free * IPMI_SEL_ENTRY_SIZE &&
+        ftruncate(sel->fd, sel->next_free * IPMI_SEL_ENTRY_SIZE) < 0) {
+        error_setg_errno(errp, errno, "Unable to truncate SEL file '%s'",
+                         ibs->sel_filename);
+        qemu_close(sel->fd);
+        sel->fd = -1;
     }
 }
 
@@ -1752,14 +1894,21 @@ static void ipmi_sim_realize(DeviceState *dev, Error **errp)
     IPMIBmc *b = IPMI_BMC(dev);
     unsigned int i;
     IPMIBmcSim *ibs = IPMI_BMC_SIMULATOR(b);
+    Error *err = NULL;
 
-    qemu_mutex_init(&ibs->lock);
-    QTAILQ_INIT(&ibs->rcvbufs);
+    if (ibs->sel.max_size == 0 || ibs->sel.max_size > MAX_SEL_SIZE) {
+        error_setg(errp, "sel_size must be between 1 and %d", MAX_SEL_SIZE);
+        return;
+    }
 
-    ibs->bmc_global_enables = (1 << IPMI_BMC_EVENT_LOG_BIT);
-    ibs->device_id = 0x20;
-    ibs->ipmi_version = 0x02; /* IPMI 2.0 */
-    ibs->restart_cause = 0;
+    if (ibs->sdr.max_size < IPMI_SDR_HEADER_SIZE ||
+        ibs->sdr.max_size > MAX_SDR_SIZE) {
+        error_setg(errp, "sdr_size must be between %zu and %d",
+                   IPMI_SDR_HEADER_SIZE, MAX_SDR_SIZE);
+        return;
+    }
+
+    /* Defaults first, loading the SEL and SDRs may overwrite them */
     for (i = 0; i < 4; i++) {
         ibs->sel.last_addition[i] = 0xff;
         ibs->sel.last_clear[i] = 0xff;
@@ -1767,7 +1916,31 @@ static void ipmi_sim_realize(DeviceState *dev, Error **errp)
         ibs->sdr.last_clear[i] = 0xff;
     }
 
-    ipmi_sdr_init(ibs);
+    ipmi_sel_init(ibs, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    ipmi_sdr_init(ibs, &err);
+    if (err) {
+        error_propagate(errp, err);
+        if (ibs->sel.fd >= 0) {
+            qemu_close(ibs->sel.fd);
+            ibs->sel.fd = -1;
+        }
+        g_free(ibs->sel.sel);
+        ibs->sel.sel = NULL;
+        return;
+    }
+
+    qemu_mutex_init(&ibs->lock);
+    QTAILQ_INIT(&ibs->rcvbufs);
+
+    ibs->bmc_global_enables = (1 << IPMI_BMC_EVENT_LOG_BIT);
+    ibs->device_id = 0x20;
+    ibs->ipmi_version = 0x02; /* IPMI 2.0 */
+    ibs->restart_cause = 0;
 
     ibs->acpi_power_state[0] = 0;
     ibs->acpi_power_state[1] = 0;
@@ -1786,12 +1959,21 @@ static void ipmi_sim_realize(DeviceState *dev, Error **errp)
     vmstate_register(NULL, 0, &vmstate_ipmi_sim, ibs);
 }
 
+static Property ipmi_sim_properties[] = {
+    DEFINE_PROP_UINT32("sdr_size", IPMIBmcSim, sdr.max_size, DEFAULT_SDR_SIZE),
+    DEFINE_PROP_UINT32("sel_size", IPMIBmcSim, sel.max_size, DEFAULT_SEL_SIZE),
+    DEFINE_PROP_STRING("sdrfile", IPMIBmcSim, sdr_filename),
+    DEFINE_PROP_STRING("selfile", IPMIBmcSim, sel_filename),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void ipmi_sim_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     IPMIBmcClass *bk = IPMI_BMC_CLASS(oc);
 
     dc->realize = ipmi_sim_realize;
+    dc->props = ipmi_sim_properties;
     bk->handle_command = ipmi_sim_handle_command;
 }
 
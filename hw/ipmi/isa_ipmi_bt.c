@@ -90,8 +90,6 @@
 typedef struct IPMIBT {
     IPMIBmc *bmc;
 
-    bool do_wake;
-
     qemu_irq irq;
 
     uint32_t io_base;
@@ -123,11 +121,8 @@ typedef struct IPMIBT {
 
 #define IPMI_CMD_GET_BT_INTF_CAP        0x36
 
-static void ipmi_bt_handle_event(IPMIInterface *ii)
+static void ipmi_bt_signal(IPMIBT *ib)
 {
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIBT *ib = iic->get_backend_data(ii);
-
     if (ib->inlen < 4) {
         goto out;
     }
@@ -181,6 +176,14 @@ static void ipmi_bt_handle_event(IPMIInterface *ii)
     return;
 }
 
+static void ipmi_bt_handle_event(IPMIInterface *ii)
+{
+    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
+    IPMIBT *ib = iic->get_backend_data(ii);
+
+    ipmi_bt_signal(ib);
+}
+
 static void ipmi_bt_handle_rsp(IPMIInterface *ii, uint8_t msg_id,
                                 unsigned char *rsp, unsigned int rsp_len)
 {
@@ -217,9 +220,7 @@ static void ipmi_bt_handle_rsp(IPMIInterface *ii, uint8_t msg_id,
 
 static uint64_t ipmi_bt_ioport_read(void *opaque, hwaddr addr, unsigned size)
 {
-    IPMIInterface *ii = opaque;
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIBT *ib = iic->get_backend_data(ii);
+    IPMIBT *ib = opaque;
     uint32_t ret = 0xff;
 
     switch (addr & 3) {
@@ -245,23 +246,10 @@ static uint64_t ipmi_bt_ioport_read(void *opaque, hwaddr addr, unsigned size)
     return ret;
 }
 
-static void ipmi_bt_signal(IPMIBT *ib, IPMIInterface *ii)
-{
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-
-    ib->do_wake = 1;
-    while (ib->do_wake) {
-        ib->do_wake = 0;
-        iic->handle_if_event(ii);
-    }
-}
-
 static void ipmi_bt_ioport_write(void *opaque, hwaddr addr, uint64_t val,
                                  unsigned size)
 {
-    IPMIInterface *ii = opaque;
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIBT *ib = iic->get_backend_data(ii);
+    IPMIBT *ib = opaque;
 
     switch (addr & 3) {
     case 0:
@@ -284,7 +272,7 @@ static void ipmi_bt_ioport_write(void *opaque, hwaddr addr, uint64_t val,
         }
         if (IPMI_BT_GET_H2B_ATN(val)) {
             IPMI_BT_SET_BBUSY(ib->control_reg, 1);
-            ipmi_bt_signal(ib, ii);
+            ipmi_bt_signal(ib);
         }
         break;
 
@@ -387,7 +375,7 @@ static void ipmi_bt_init(IPMIInterface *ii, Error **errp)
 
     ib->io_length = 3;
 
-    memory_region_init_io(&ib->io, NULL, &ipmi_bt_io_ops, ii, "ipmi-bt", 3);
+    memory_region_init_io(&ib->io, NULL, &ipmi_bt_io_ops, ib, "ipmi-bt", 3);
 }
 
 
@@ -71,8 +71,6 @@
 typedef struct IPMIKCS {
     IPMIBmc *bmc;
 
-    bool do_wake;
-
     qemu_irq irq;
 
     uint32_t io_base;
@@ -116,22 +114,8 @@ typedef struct IPMIKCS {
         }                                                                     \
     } while (0)
 
-static void ipmi_kcs_signal(IPMIKCS *ik, IPMIInterface *ii)
-{
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-
-    ik->do_wake = 1;
-    while (ik->do_wake) {
-        ik->do_wake = 0;
-        iic->handle_if_event(ii);
-    }
-}
-
-static void ipmi_kcs_handle_event(IPMIInterface *ii)
+static void ipmi_kcs_signal(IPMIKCS *ik)
 {
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIKCS *ik = iic->get_backend_data(ii);
-
     if (ik->cmd_reg == IPMI_KCS_ABORT_STATUS_CMD) {
         if (IPMI_KCS_GET_STATE(ik->status_reg) != IPMI_KCS_ERROR_STATE) {
             ik->waiting_rsp++; /* Invalidate the message */
@@ -225,6 +209,48 @@ static void ipmi_kcs_handle_event(IPMIInterface *ii)
     return;
 }
 
+static void ipmi_kcs_handle_event(IPMIInterface *ii)
+{
+    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
+    IPMIKCS *ik = iic->get_backend_data(ii);
+
+    ipmi_kcs_signal(ik);
+}
+
+/*
+ * Data bytes in the middle of a write and read acknowledges in the
+ * middle of a response make up nearly all of the port accesses of a
+ * transfer, and neither changes the interface state.  Move those bytes
+ * directly instead of latching them into data_in_reg and running the
+ * state machine.  Returns false if the byte needs the slow path.
+ */
+static bool ipmi_kcs_data_fast_path(IPMIKCS *ik, uint8_t val)
+{
+    switch (IPMI_KCS_GET_STATE(ik->status_reg)) {
+    case IPMI_KCS_WRITE_STATE:
+        if (ik->write_end) {
+            return false;
+        }
+        /* As in ipmi_kcs_signal(), the BMC handles input overrun. */
+        if (ik->inlen < sizeof(ik->inmsg)) {
+            ik->inmsg[ik->inlen] = val;
+        }
+        ik->inlen++;
+        SET_OBF();
+        return true;
+
+    case IPMI_KCS_READ_STATE:
+        if (val != IPMI_KCS_READ_CMD || ik->outpos >= ik->outlen) {
+            return false;
+        }
+        ik->data_out_reg = ik->outmsg[ik->outpos];
+        ik->outpos++;
+        SET_OBF();
+        return true;
+    }
+    return false;
+}
+
 static void ipmi_kcs_handle_rsp(IPMIInterface *ii, uint8_t msg_id,
                                 unsigned char *rsp, unsigned int rsp_len)
 {
@@ -244,16 +270,14 @@ static void ipmi_kcs_handle_rsp(IPMIInterface *ii, uint8_t msg_id,
         }
         IPMI_KCS_SET_STATE(ik->status_reg, IPMI_KCS_READ_STATE);
         ik->data_in_reg = IPMI_KCS_READ_CMD;
-        ipmi_kcs_signal(ik, ii);
+        ipmi_kcs_signal(ik);
     }
 }
 
 
 static uint64_t ipmi_kcs_ioport_read(void *opaque, hwaddr addr, unsigned size)
 {
-    IPMIInterface *ii = opaque;
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIKCS *ik = iic->get_backend_data(ii);
+    IPMIKCS *ik = opaque;
     uint32_t ret;
 
     switch (addr & 1) {
@@ -283,9 +307,7 @@ static uint64_t ipmi_kcs_ioport_read(void *opaque, hwaddr addr, unsigned size)
 static void ipmi_kcs_ioport_write(void *opaque, hwaddr addr, uint64_t val,
                                   unsigned size)
 {
-    IPMIInterface *ii = opaque;
-    IPMIInterfaceClass *iic = IPMI_INTERFACE_GET_CLASS(ii);
-    IPMIKCS *ik = iic->get_backend_data(ii);
+    IPMIKCS *ik = opaque;
 
     if (IPMI_KCS_GET_IBF(ik->status_reg)) {
         return;
@@ -293,6 +315,9 @@ static void ipmi_kcs_ioport_write(void *opaque, hwaddr addr, uint64_t val,
 
     switch (addr & 1) {
     case 0:
+        if (ipmi_kcs_data_fast_path(ik, val)) {
+            return;
+        }
         ik->data_in_reg = val;
         break;
 
@@ -301,7 +326,7 @@ static void ipmi_kcs_ioport_write(void *opaque, hwaddr addr, uint64_t val,
         break;
     }
     IPMI_KCS_SET_IBF(ik->status_reg, 1);
-    ipmi_kcs_signal(ik, ii);
+    ipmi_kcs_signal(ik);
 }
 
 const MemoryRegionOps ipmi_kcs_io_ops = {
@@ -351,7 +376,7 @@ static void ipmi_kcs_init(IPMIInterface *ii, Error **errp)
     IPMIKCS *ik = iic->get_backend_data(ii);
 
     ik->io_length = 2;
-    memory_region_init_io(&ik->io, NULL, &ipmi_kcs_io_ops, ii, "ipmi-kcs", 2);
+    memory_region_init_io(&ik->io, NULL, &ipmi_kcs_io_ops, ik, "ipmi-kcs", 2);
 }
 
 #define TYPE_ISA_IPMI_KCS "isa-ipmi-kcs"
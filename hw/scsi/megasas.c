@@ -27,7 +27,11 @@
 #include "hw/pci/msix.h"
 #include "qemu/iov.h"
 #include "hw/scsi/scsi.h"
+#include "hw/hotplug.h"
 #include "block/scsi.h"
+#include "sysemu/iothread.h"
+#include "sysemu/sysemu.h"
+#include "qapi/error.h"
 #include "trace.h"
 
 #include "mfi.h"
@@ -35,6 +39,8 @@
 #define MEGASAS_VERSION_GEN1 "1.70"
 #define MEGASAS_VERSION_GEN2 "1.80"
 #define MEGASAS_MAX_FRAMES 2048         /* Firmware limit at 65535 */
+#define MEGASAS_FRAME_HASH_BITS 10
+#define MEGASAS_FRAME_HASH_SIZE (1 << MEGASAS_FRAME_HASH_BITS)
 #define MEGASAS_DEFAULT_FRAMES 1000     /* Windows requires this */
 #define MEGASAS_GEN2_DEFAULT_FRAMES 1008     /* Windows requires this */
 #define MEGASAS_MAX_SGE 128             /* Firmware limit */
@@ -74,6 +80,8 @@ typedef struct MegasasCmd {
     size_t iov_size;
     size_t iov_offset;
     struct MegasasState *state;
+    QLIST_ENTRY(MegasasCmd) hash_next;
+    QSLIST_ENTRY(MegasasCmd) free_next;
 } MegasasCmd;
 
 typedef struct MegasasState {
@@ -115,8 +123,34 @@ typedef struct MegasasState {
     uint64_t consumer_pa;
     uint64_t producer_pa;
 
+    /*
+     * Reply coalescing: intr_throttle_* are the properties, intc_* the
+     * values currently in use, which the guest may change through
+     * CTRL_SET_PROPERTIES if coalescing was enabled.
+     */
+    uint32_t intr_throttle_cnt;
+    uint32_t intr_throttle_timeout;
+    uint16_t intc_cnt;
+    uint16_t intc_timeout;
+    int pending_replies;
+    QEMUTimer *intc_timer;
+    VMChangeStateEntry *vmstate_change;
+
+    /* Frames posted to the inbound queue, processed in the IOThread */
+    uint64_t frame_post[MEGASAS_MAX_FRAMES];
+    int frame_post_head;
+    int frame_post_tail;
+
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *frame_bh;
+    QEMUBH *irq_bh;
+    Error *blocker;
+
     MegasasCmd frames[MEGASAS_MAX_FRAMES];
-    DECLARE_BITMAP(frame_map, MEGASAS_MAX_FRAMES);
+    /* In-flight frames hashed by guest address, and the unused ones */
+    QLIST_HEAD(, MegasasCmd) frame_hash[MEGASAS_FRAME_HASH_SIZE];
+    QSLIST_HEAD(, MegasasCmd) frame_free;
     SCSIBus bus;
 } MegasasState;
 
@@ -152,6 +186,17 @@ static bool megasas_intr_enabled(MegasasState *s)
     return false;
 }
 
+/*
+ * Masking the reply interrupt bits leaves the controller running, only
+ * writing all ones to OMSK disables (and resets) it.
+ */
+static bool megasas_intr_masked(MegasasState *s)
+{
+    MegasasBaseClass *base_class = MEGASAS_DEVICE_GET_CLASS(s);
+
+    return (s->intr_mask & base_class->osts) == base_class->osts;
+}
+
 static bool megasas_use_queue64(MegasasState *s)
 {
     return s->flags & MEGASAS_MASK_USE_QUEUE64;
@@ -447,34 +492,40 @@ static int megasas_next_index(MegasasState *s, int index, int limit)
     return index;
 }
 
+static unsigned int megasas_frame_hash(hwaddr frame)
+{
+    return ((uint64_t)frame * 0x9e3779b97f4a7c15ULL) >>
+        (64 - MEGASAS_FRAME_HASH_BITS);
+}
+
 static MegasasCmd *megasas_lookup_frame(MegasasState *s,
     hwaddr frame)
 {
-    MegasasCmd *cmd = NULL;
-    int num = 0, index;
-
-    index = s->reply_queue_head;
+    MegasasCmd *cmd;
 
-    while (num < s->fw_cmds) {
-        if (s->frames[index].pa && s->frames[index].pa == frame) {
-            cmd = &s->frames[index];
-            break;
+    QLIST_FOREACH(cmd, &s->frame_hash[megasas_frame_hash(frame)], hash_next) {
+        if (cmd->pa == frame) {
+            return cmd;
         }
-        index = megasas_next_index(s, index, s->fw_cmds);
-        num++;
     }
-
-    return cmd;
+    return NULL;
 }
 
 static void megasas_unmap_frame(MegasasState *s, MegasasCmd *cmd)
 {
     PCIDevice *p = PCI_DEVICE(s);
 
-    pci_dma_unmap(p, cmd->frame, cmd->pa_size, 0, 0);
+    /* Already released, e.g. by megasas_reset_frames() during INIT */
+    if (!cmd->pa) {
+        return;
+    }
+    if (cmd->frame) {
+        pci_dma_unmap(p, cmd->frame, cmd->pa_size, 0, 0);
+    }
     cmd->frame = NULL;
     cmd->pa = 0;
-    clear_bit(cmd->index, s->frame_map);
+    QLIST_REMOVE(cmd, hash_next);
+    QSLIST_INSERT_HEAD(&s->frame_free, cmd, free_next);
 }
 
 /*
@@ -488,33 +539,24 @@ static MegasasCmd *megasas_enqueue_frame(MegasasState *s,
     MegasasCmd *cmd = NULL;
     int frame_size = MFI_FRAME_SIZE * 16;
     hwaddr frame_size_p = frame_size;
-    unsigned long index;
 
-    index = 0;
-    while (index < s->fw_cmds) {
-        index = find_next_zero_bit(s->frame_map, s->fw_cmds, index);
-        if (!s->frames[index].pa)
-            break;
-        /* Busy frame found */
-        trace_megasas_qf_mapped(index);
-    }
-    if (index >= s->fw_cmds) {
+    cmd = QSLIST_FIRST(&s->frame_free);
+    if (!cmd) {
         /* All frames busy */
         trace_megasas_qf_busy(frame);
         return NULL;
     }
-    cmd = &s->frames[index];
-    set_bit(index, s->frame_map);
-    trace_megasas_qf_new(index, frame);
+    QSLIST_REMOVE_HEAD(&s->frame_free, free_next);
+    trace_megasas_qf_new(cmd->index, frame);
 
     cmd->pa = frame;
+    QLIST_INSERT_HEAD(&s->frame_hash[megasas_frame_hash(frame)],
+                      cmd, hash_next);
     /* Map all possible frames */
     cmd->frame = pci_dma_map(pcid, frame, &frame_size_p, 0);
     if (frame_size_p != frame_size) {
         trace_megasas_qf_map_failed(cmd->index, (unsigned long)frame);
-        if (cmd->frame) {
-            megasas_unmap_frame(s, cmd);
-        }
+        megasas_unmap_frame(s, cmd);
         s->event_count++;
         return NULL;
     }
@@ -535,6 +577,109 @@ static MegasasCmd *megasas_enqueue_frame(MegasasState *s,
     return cmd;
 }
 
+/* Context: QEMU global mutex held */
+static void megasas_notify(MegasasState *s)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(s);
+
+    if (msix_enabled(pci_dev)) {
+        trace_megasas_msix_raise(0);
+        msix_notify(pci_dev, 0);
+    } else if (msi_enabled(pci_dev)) {
+        trace_megasas_msi_raise(0);
+        msi_notify(pci_dev, 0);
+    } else {
+        s->doorbell++;
+        if (s->doorbell == 1) {
+            trace_megasas_irq_raise();
+            pci_irq_assert(pci_dev);
+        }
+    }
+}
+
+static void megasas_irq_bh(void *opaque)
+{
+    MegasasState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    if (!megasas_intr_masked(s)) {
+        megasas_notify(s);
+    }
+    aio_context_release(s->ctx);
+}
+
+static void megasas_raise_irq(MegasasState *s)
+{
+    if (s->irq_bh && !qemu_mutex_iothread_locked()) {
+        /* Completed in the IOThread, inject from the main loop */
+        qemu_bh_schedule(s->irq_bh);
+    } else {
+        megasas_notify(s);
+    }
+}
+
+static bool megasas_intc_enabled(MegasasState *s)
+{
+    return s->intc_cnt > 1;
+}
+
+/*
+ * Publish the reply queue head and interrupt the guest.  While the reply
+ * interrupt is masked, the OMSK write that unmasks it raises it instead.
+ */
+static void megasas_flush_replies(MegasasState *s)
+{
+    timer_del(s->intc_timer);
+    s->pending_replies = 0;
+    stl_le_pci_dma(PCI_DEVICE(s), s->producer_pa, s->reply_queue_head);
+    if (!megasas_intr_masked(s)) {
+        megasas_raise_irq(s);
+    }
+}
+
+/* Replies the guest has not consumed yet */
+static bool megasas_replies_unacked(MegasasState *s)
+{
+    if (!s->consumer_pa) {
+        return false;
+    }
+    s->reply_queue_tail = ldl_le_pci_dma(PCI_DEVICE(s), s->consumer_pa);
+    return s->reply_queue_head != s->reply_queue_tail;
+}
+
+static void megasas_coalesce_reply(MegasasState *s)
+{
+    if (++s->pending_replies >= s->intc_cnt) {
+        megasas_flush_replies(s);
+    } else if (!timer_pending(s->intc_timer)) {
+        timer_mod(s->intc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  s->intc_timeout * SCALE_US);
+    }
+}
+
+static void megasas_intc_expired(void *opaque)
+{
+    MegasasState *s = opaque;
+
+    if (s->pending_replies && megasas_intr_enabled(s)) {
+        trace_megasas_intc_expired(s->pending_replies);
+        megasas_flush_replies(s);
+    }
+}
+
+static void megasas_vm_state_change(void *opaque, int running,
+                                    RunState state)
+{
+    MegasasState *s = opaque;
+
+    /* Don't leave replies hidden from the guest across migration */
+    if (!running) {
+        aio_context_acquire(s->ctx);
+        megasas_intc_expired(s);
+        aio_context_release(s->ctx);
+    }
+}
+
 static void megasas_complete_frame(MegasasState *s, uint64_t context)
 {
     PCIDevice *pci_dev = PCI_DEVICE(s);
@@ -567,20 +712,11 @@ static void megasas_complete_frame(MegasasState *s, uint64_t context)
         s->reply_queue_head = megasas_next_index(s, tail, s->fw_cmds);
         trace_megasas_qf_update(s->reply_queue_head, s->reply_queue_tail,
                                 s->busy);
-        stl_le_pci_dma(pci_dev, s->producer_pa, s->reply_queue_head);
-        /* Notify HBA */
-        if (msix_enabled(pci_dev)) {
-            trace_megasas_msix_raise(0);
-            msix_notify(pci_dev, 0);
-        } else if (msi_enabled(pci_dev)) {
-            trace_megasas_msi_raise(0);
-            msi_notify(pci_dev, 0);
+        /* Only delay the reply while more commands are outstanding */
+        if (megasas_intc_enabled(s) && s->busy) {
+            megasas_coalesce_reply(s);
         } else {
-            s->doorbell++;
-            if (s->doorbell == 1) {
-                trace_megasas_irq_raise();
-                pci_irq_assert(pci_dev);
-            }
+            megasas_flush_replies(s);
         }
     } else {
         trace_megasas_qf_complete_noirq(context);
@@ -598,7 +734,15 @@ static void megasas_reset_frames(MegasasState *s)
             megasas_unmap_frame(s, cmd);
         }
     }
-    bitmap_zero(s->frame_map, MEGASAS_MAX_FRAMES);
+
+    /* Rebuild the free list so that the lowest indices are handed out first */
+    for (i = 0; i < MEGASAS_FRAME_HASH_SIZE; i++) {
+        QLIST_INIT(&s->frame_hash[i]);
+    }
+    QSLIST_INIT(&s->frame_free);
+    for (i = s->fw_cmds - 1; i >= 0; i--) {
+        QSLIST_INSERT_HEAD(&s->frame_free, &s->frames[i], free_next);
+    }
 }
 
 static void megasas_abort_command(MegasasCmd *cmd)
@@ -711,6 +855,17 @@ static void megasas_finish_dcmd(MegasasCmd *cmd, uint32_t iov_size)
     cmd->iov_size = 0;
 }
 
+static void megasas_get_throttle(MegasasState *s, struct mfi_ctrl_props *props)
+{
+    if (s->intr_throttle_cnt > 1) {
+        props->intr_throttle_cnt = cpu_to_le16(s->intc_cnt);
+        props->intr_throttle_timeout = cpu_to_le16(s->intc_timeout);
+    } else {
+        props->intr_throttle_cnt = cpu_to_le16(16);
+        props->intr_throttle_timeout = cpu_to_le16(50);
+    }
+}
+
 static int megasas_ctrl_get_info(MegasasState *s, MegasasCmd *cmd)
 {
     PCIDevice *pci_dev = PCI_DEVICE(s);
@@ -810,8 +965,7 @@ static int megasas_ctrl_get_info(MegasasState *s, MegasasCmd *cmd)
     info.stripe_sz_ops.min = 3;
     info.stripe_sz_ops.max = ctz32(MEGASAS_MAX_SECTORS + 1);
     info.properties.pred_fail_poll_interval = cpu_to_le16(300);
-    info.properties.intr_throttle_cnt = cpu_to_le16(16);
-    info.properties.intr_throttle_timeout = cpu_to_le16(50);
+    megasas_get_throttle(s, &info.properties);
     info.properties.rebuild_rate = 30;
     info.properties.patrol_read_rate = 30;
     info.properties.bgi_rate = 30;
@@ -1390,8 +1544,7 @@ static int megasas_dcmd_get_properties(MegasasState *s, MegasasCmd *cmd)
         return MFI_STAT_INVALID_PARAMETER;
     }
     info.pred_fail_poll_interval = cpu_to_le16(300);
-    info.intr_throttle_cnt = cpu_to_le16(16);
-    info.intr_throttle_timeout = cpu_to_le16(50);
+    megasas_get_throttle(s, &info);
     info.rebuild_rate = 30;
     info.patrol_read_rate = 30;
     info.bgi_rate = 30;
@@ -1450,6 +1603,11 @@ static int megasas_dcmd_set_properties(MegasasState *s, MegasasCmd *cmd)
         return MFI_STAT_INVALID_PARAMETER;
     }
     dma_buf_write((uint8_t *)&info, dcmd_size, &cmd->qsg);
+    if (s->intr_throttle_cnt > 1) {
+        s->intc_cnt = MAX(le16_to_cpu(info.intr_throttle_cnt), 1);
+        s->intc_timeout = le16_to_cpu(info.intr_throttle_timeout);
+        trace_megasas_intc_update(s->intc_cnt, s->intc_timeout);
+    }
     trace_megasas_dcmd_unsupported(cmd->index, cmd->iov_size);
     return MFI_STAT_OK;
 }
@@ -2001,10 +2159,36 @@ static void megasas_handle_frame(MegasasState *s, uint64_t frame_addr,
     }
 }
 
-static uint64_t megasas_mmio_read(void *opaque, hwaddr addr,
-                                  unsigned size)
+static void megasas_process_frames(void *opaque)
 {
     MegasasState *s = opaque;
+    uint64_t frame;
+
+    while (s->frame_post_head != s->frame_post_tail) {
+        frame = s->frame_post[s->frame_post_head];
+        s->frame_post_head = megasas_next_index(s, s->frame_post_head,
+                                                MEGASAS_MAX_FRAMES);
+        megasas_handle_frame(s, frame & ~0x1F, (frame >> 1) & 0xF);
+    }
+}
+
+static void megasas_post_frame(MegasasState *s, uint64_t frame_addr,
+                               uint32_t frame_count)
+{
+    int tail = megasas_next_index(s, s->frame_post_tail, MEGASAS_MAX_FRAMES);
+
+    if (!s->frame_bh || tail == s->frame_post_head) {
+        megasas_handle_frame(s, frame_addr, frame_count);
+        return;
+    }
+    s->frame_post[s->frame_post_tail] = frame_addr | (frame_count << 1);
+    s->frame_post_tail = tail;
+    qemu_bh_schedule(s->frame_bh);
+}
+
+static uint64_t megasas_do_mmio_read(MegasasState *s, hwaddr addr,
+                                     unsigned size)
+{
     PCIDevice *pci_dev = PCI_DEVICE(s);
     MegasasBaseClass *base_class = MEGASAS_DEVICE_GET_CLASS(s);
     uint32_t retval = 0;
@@ -2054,10 +2238,9 @@ static uint64_t megasas_mmio_read(void *opaque, hwaddr addr,
 
 static int adp_reset_seq[] = {0x00, 0x04, 0x0b, 0x02, 0x07, 0x0d};
 
-static void megasas_mmio_write(void *opaque, hwaddr addr,
-                               uint64_t val, unsigned size)
+static void megasas_do_mmio_write(MegasasState *s, hwaddr addr,
+                                  uint64_t val, unsigned size)
 {
-    MegasasState *s = opaque;
     PCIDevice *pci_dev = PCI_DEVICE(s);
     uint64_t frame_addr;
     uint32_t frame_count;
@@ -2087,6 +2270,13 @@ static void megasas_mmio_write(void *opaque, hwaddr addr,
     case MFI_OMSK:
         trace_megasas_mmio_writel("MFI_OMSK", val);
         s->intr_mask = val;
+        /*
+         * Don't sit on replies that were coalesced or completed while the
+         * interrupt was masked, nor drop them in the reset below.
+         */
+        if (s->pending_replies || megasas_replies_unacked(s)) {
+            megasas_flush_replies(s);
+        }
         if (!megasas_intr_enabled(s) &&
             !msi_enabled(pci_dev) &&
             !msix_enabled(pci_dev)) {
@@ -2136,7 +2326,7 @@ static void megasas_mmio_write(void *opaque, hwaddr addr,
         frame_addr |= ((uint64_t)s->frame_hi << 32);
         s->frame_hi = 0;
         frame_count = (val >> 1) & 0xF;
-        megasas_handle_frame(s, frame_addr, frame_count);
+        megasas_post_frame(s, frame_addr, frame_count);
         break;
     case MFI_SEQ:
         trace_megasas_mmio_writel("MFI_SEQ", val);
@@ -2168,6 +2358,28 @@ static void megasas_mmio_write(void *opaque, hwaddr addr,
     }
 }
 
+static uint64_t megasas_mmio_read(void *opaque, hwaddr addr,
+                                  unsigned size)
+{
+    MegasasState *s = opaque;
+    uint64_t ret;
+
+    aio_context_acquire(s->ctx);
+    ret = megasas_do_mmio_read(s, addr, size);
+    aio_context_release(s->ctx);
+    return ret;
+}
+
+static void megasas_mmio_write(void *opaque, hwaddr addr,
+                               uint64_t val, unsigned size)
+{
+    MegasasState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    megasas_do_mmio_write(s, addr, val, size);
+    aio_context_release(s->ctx);
+}
+
 static const MemoryRegionOps megasas_mmio_ops = {
     .read = megasas_mmio_read,
     .write = megasas_mmio_write,
@@ -2228,6 +2440,15 @@ static void megasas_soft_reset(MegasasState *s)
     MegasasCmd *cmd;
 
     trace_megasas_reset(s->fw_state);
+    s->frame_post_head = s->frame_post_tail = 0;
+    s->pending_replies = 0;
+    timer_del(s->intc_timer);
+    /* Drop what the guest set through CTRL_SET_PROPERTIES */
+    s->intc_cnt = MIN(s->intr_throttle_cnt, UINT16_MAX);
+    s->intc_timeout = MIN(s->intr_throttle_timeout, UINT16_MAX);
+    if (s->frame_bh) {
+        qemu_bh_cancel(s->frame_bh);
+    }
     for (i = 0; i < s->fw_cmds; i++) {
         cmd = &s->frames[i];
         megasas_abort_command(cmd);
@@ -2265,9 +2486,44 @@ static void megasas_scsi_reset(DeviceState *dev)
 {
     MegasasState *s = MEGASAS(dev);
 
+    aio_context_acquire(s->ctx);
     megasas_soft_reset(s);
+    aio_context_release(s->ctx);
+}
+
+/* Only sent once the guest has changed the coalescing properties */
+static bool megasas_intc_needed(void *opaque)
+{
+    MegasasState *s = opaque;
+
+    return s->intc_cnt != MIN(s->intr_throttle_cnt, UINT16_MAX) ||
+           s->intc_timeout != MIN(s->intr_throttle_timeout, UINT16_MAX);
 }
 
+static const VMStateDescription vmstate_megasas_gen1_intc = {
+    .name = "megasas/intc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = megasas_intc_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(intc_cnt, MegasasState),
+        VMSTATE_UINT16(intc_timeout, MegasasState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_megasas_gen2_intc = {
+    .name = "megasas-gen2/intc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = megasas_intc_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(intc_cnt, MegasasState),
+        VMSTATE_UINT16(intc_timeout, MegasasState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_megasas_gen1 = {
     .name = "megasas",
     .version_id = 0,
@@ -2283,6 +2539,10 @@ static const VMStateDescription vmstate_megasas_gen1 = {
         VMSTATE_UINT64(consumer_pa, MegasasState),
         VMSTATE_UINT64(producer_pa, MegasasState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_megasas_gen1_intc,
+        NULL
     }
 };
 
@@ -2302,6 +2562,10 @@ static const VMStateDescription vmstate_megasas_gen2 = {
         VMSTATE_UINT64(consumer_pa, MegasasState),
         VMSTATE_UINT64(producer_pa, MegasasState),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription*[]) {
+        &vmstate_megasas_gen2_intc,
+        NULL
     }
 };
 
@@ -2315,6 +2579,42 @@ static void megasas_scsi_uninit(PCIDevice *d)
     if (megasas_use_msi(s)) {
         msi_uninit(d);
     }
+    qemu_del_vm_change_state_handler(s->vmstate_change);
+    timer_del(s->intc_timer);
+    timer_free(s->intc_timer);
+    if (s->iothread) {
+        qemu_bh_delete(s->frame_bh);
+        qemu_bh_delete(s->irq_bh);
+        error_free(s->blocker);
+        object_unref(OBJECT(s->iothread));
+    }
+}
+
+static void megasas_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
+                            Error **errp)
+{
+    MegasasState *s = MEGASAS(hotplug_dev);
+    SCSIDevice *sd = SCSI_DEVICE(dev);
+
+    if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
+        return;
+    }
+    blk_op_block_all(sd->conf.blk, s->blocker);
+    aio_context_acquire(s->ctx);
+    blk_set_aio_context(sd->conf.blk, s->ctx);
+    aio_context_release(s->ctx);
+}
+
+static void megasas_hotunplug(HotplugHandler *hotplug_dev, DeviceState *dev,
+                              Error **errp)
+{
+    MegasasState *s = MEGASAS(hotplug_dev);
+    SCSIDevice *sd = SCSI_DEVICE(dev);
+
+    blk_op_unblock_all(sd->conf.blk, s->blocker);
+    aio_context_acquire(s->ctx);
+    qdev_simple_device_unplug_cb(hotplug_dev, dev, errp);
+    aio_context_release(s->ctx);
 }
 
 static const struct SCSIBusInfo megasas_scsi_info = {
@@ -2410,9 +2710,30 @@ static void megasas_scsi_realize(PCIDevice *dev, Error **errp)
         s->frames[i].pa = 0;
         s->frames[i].state = s;
     }
+    megasas_reset_frames(s);
+
+    if (s->iothread) {
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+        s->frame_bh = aio_bh_new(s->ctx, megasas_process_frames, s);
+        s->irq_bh = qemu_bh_new(megasas_irq_bh, s);
+        error_setg(&s->blocker, "block device is in use by data plane");
+    } else {
+        s->ctx = qemu_get_aio_context();
+    }
+    s->intc_cnt = MIN(s->intr_throttle_cnt, UINT16_MAX);
+    s->intc_timeout = MIN(s->intr_throttle_timeout, UINT16_MAX);
+    s->intc_timer = aio_timer_new(s->ctx, QEMU_CLOCK_VIRTUAL, SCALE_NS,
+                                  megasas_intc_expired, s);
+    s->vmstate_change = qemu_add_vm_change_state_handler(
+        megasas_vm_state_change, s);
 
     scsi_bus_new(&s->bus, sizeof(s->bus), DEVICE(dev),
                  &megasas_scsi_info, NULL);
+    if (s->iothread) {
+        /* Move the drives to the IOThread as they are attached */
+        qbus_set_hotplug_handler(BUS(&s->bus), DEVICE(s), &error_abort);
+    }
     if (!d->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus, errp);
     }
@@ -2423,6 +2744,10 @@ static Property megasas_properties_gen1[] = {
                        MEGASAS_DEFAULT_SGE),
     DEFINE_PROP_UINT32("max_cmds", MegasasState, fw_cmds,
                        MEGASAS_DEFAULT_FRAMES),
+    DEFINE_PROP_UINT32("intr_throttle_cnt", MegasasState, intr_throttle_cnt,
+                       0),
+    DEFINE_PROP_UINT32("intr_throttle_timeout", MegasasState,
+                       intr_throttle_timeout, 50),
     DEFINE_PROP_STRING("hba_serial", MegasasState, hba_serial),
     DEFINE_PROP_UINT64("sas_address", MegasasState, sas_addr, 0),
     DEFINE_PROP_BIT("use_msi", MegasasState, flags,
@@ -2439,6 +2764,10 @@ static Property megasas_properties_gen2[] = {
                        MEGASAS_DEFAULT_SGE),
     DEFINE_PROP_UINT32("max_cmds", MegasasState, fw_cmds,
                        MEGASAS_GEN2_DEFAULT_FRAMES),
+    DEFINE_PROP_UINT32("intr_throttle_cnt", MegasasState, intr_throttle_cnt,
+                       0),
+    DEFINE_PROP_UINT32("intr_throttle_timeout", MegasasState,
+                       intr_throttle_timeout, 50),
     DEFINE_PROP_STRING("hba_serial", MegasasState, hba_serial),
     DEFINE_PROP_UINT64("sas_address", MegasasState, sas_addr, 0),
     DEFINE_PROP_BIT("use_msi", MegasasState, flags,
@@ -2500,6 +2829,7 @@ static void megasas_class_init(ObjectClass *oc, void *data)
     DeviceClass *dc = DEVICE_CLASS(oc);
     PCIDeviceClass *pc = PCI_DEVICE_CLASS(oc);
     MegasasBaseClass *e = MEGASAS_DEVICE_CLASS(oc);
+    HotplugHandlerClass *hc = HOTPLUG_HANDLER_CLASS(oc);
     const MegasasInfo *info = data;
 
     pc->realize = megasas_scsi_realize;
@@ -2518,16 +2848,33 @@ static void megasas_class_init(ObjectClass *oc, void *data)
     dc->props = info->props;
     dc->reset = megasas_scsi_reset;
     dc->vmsd = info->vmsd;
+    hc->plug = megasas_hotplug;
+    hc->unplug = megasas_hotunplug;
     set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
     dc->desc = info->desc;
 }
 
+static void megasas_instance_init(Object *obj)
+{
+    MegasasState *s = MEGASAS(obj);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
+}
+
 static const TypeInfo megasas_info = {
     .name  = TYPE_MEGASAS_BASE,
     .parent = TYPE_PCI_DEVICE,
     .instance_size = sizeof(MegasasState),
+    .instance_init = megasas_instance_init,
     .class_size = sizeof(MegasasBaseClass),
     .abstract = true,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_HOTPLUG_HANDLER },
+        { }
+    },
 };
 
 static void megasas_register_types(void)
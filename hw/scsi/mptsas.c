@@ -30,7 +30,9 @@
 #include "hw/pci/msi.h"
 #include "qemu/iov.h"
 #include "hw/scsi/scsi.h"
+#include "hw/hotplug.h"
 #include "block/scsi.h"
+#include "qapi/error.h"
 #include "trace.h"
 
 #include "mptsas.h"
@@ -58,7 +60,8 @@ struct MPTSASRequest {
     QTAILQ_ENTRY(MPTSASRequest) next;
 };
 
-static void mptsas_update_interrupt(MPTSASState *s)
+/* Context: QEMU global mutex held */
+static void mptsas_set_interrupt(MPTSASState *s)
 {
     PCIDevice *pci = (PCIDevice *) s;
     uint32_t state = s->intr_status & ~(s->intr_mask | MPI_HIS_IOP_DOORBELL_STATUS);
@@ -74,6 +77,25 @@ static void mptsas_update_interrupt(MPTSASState *s)
     pci_set_irq(pci, !!state);
 }
 
+static void mptsas_irq_bh(void *opaque)
+{
+    MPTSASState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    mptsas_set_interrupt(s);
+    aio_context_release(s->ctx);
+}
+
+static void mptsas_update_interrupt(MPTSASState *s)
+{
+    if (s->irq_bh && !qemu_mutex_iothread_locked()) {
+        /* Called from the IOThread, inject from the main loop */
+        qemu_bh_schedule(s->irq_bh);
+    } else {
+        mptsas_set_interrupt(s);
+    }
+}
+
 static void mptsas_set_fault(MPTSASState *s, uint32_t code)
 {
     if ((s->state & MPI_IOC_STATE_FAULT) == 0) {
@@ -994,10 +1016,9 @@ static uint32_t mptsas_reply_post_read(MPTSASState *s)
     return ret;
 }
 
-static uint64_t mptsas_mmio_read(void *opaque, hwaddr addr,
-                                  unsigned size)
+static uint64_t mptsas_do_mmio_read(MPTSASState *s, hwaddr addr,
+                                    unsigned size)
 {
-    MPTSASState *s = opaque;
     uint32_t ret = 0;
 
     switch (addr & ~3) {
@@ -1029,11 +1050,9 @@ static uint64_t mptsas_mmio_read(void *opaque, hwaddr addr,
     return ret;
 }
 
-static void mptsas_mmio_write(void *opaque, hwaddr addr,
-                               uint64_t val, unsigned size)
+static void mptsas_do_mmio_write(MPTSASState *s, hwaddr addr,
+                                 uint64_t val, unsigned size)
 {
-    MPTSASState *s = opaque;
-
     trace_mptsas_mmio_write(s, addr, val);
     switch (addr) {
     case MPI_DOORBELL_OFFSET:
@@ -1082,6 +1101,28 @@ static void mptsas_mmio_write(void *opaque, hwaddr addr,
     }
 }
 
+static uint64_t mptsas_mmio_read(void *opaque, hwaddr addr,
+                                 unsigned size)
+{
+    MPTSASState *s = opaque;
+    uint64_t ret;
+
+    aio_context_acquire(s->ctx);
+    ret = mptsas_do_mmio_read(s, addr, size);
+    aio_context_release(s->ctx);
+    return ret;
+}
+
+static void mptsas_mmio_write(void *opaque, hwaddr addr,
+                              uint64_t val, unsigned size)
+{
+    MPTSASState *s = opaque;
+
+    aio_context_acquire(s->ctx);
+    mptsas_do_mmio_write(s, addr, val, size);
+    aio_context_release(s->ctx);
+}
+
 static const MemoryRegionOps mptsas_mmio_ops = {
     .read = mptsas_mmio_read,
     .write = mptsas_mmio_write,
@@ -1304,11 +1345,24 @@ static void mptsas_scsi_init(PCIDevice *dev, Error **errp)
     }
     s->max_devices = MPTSAS_NUM_PORTS;
 
-    s->request_bh = qemu_bh_new(mptsas_fetch_requests, s);
+    if (s->iothread) {
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+        s->request_bh = aio_bh_new(s->ctx, mptsas_fetch_requests, s);
+        s->irq_bh = qemu_bh_new(mptsas_irq_bh, s);
+        error_setg(&s->blocker, "block device is in use by data plane");
+    } else {
+        s->ctx = qemu_get_aio_context();
+        s->request_bh = qemu_bh_new(mptsas_fetch_requests, s);
+    }
 
     QTAILQ_INIT(&s->pending);
 
     scsi_bus_new(&s->bus, sizeof(s->bus), &dev->qdev, &mptsas_scsi_info, NULL);
+    if (s->iothread) {
+        /* Move the drives to the IOThread as they are attached */
+        qbus_set_hotplug_handler(BUS(&s->bus), DEVICE(s), &error_abort);
+    }
     if (!d->hotplugged) {
         scsi_bus_legacy_handle_cmdline(&s->bus, errp);
     }
@@ -1322,13 +1376,47 @@ static void mptsas_scsi_uninit(PCIDevice *dev)
     if (s->msi_in_use) {
         msi_uninit(dev);
     }
+    if (s->iothread) {
+        qemu_bh_delete(s->irq_bh);
+        error_free(s->blocker);
+        object_unref(OBJECT(s->iothread));
+    }
 }
 
 static void mptsas_reset(DeviceState *dev)
 {
     MPTSASState *s = MPT_SAS(dev);
 
+    aio_context_acquire(s->ctx);
     mptsas_hard_reset(s);
+    aio_context_release(s->ctx);
+}
+
+static void mptsas_hotplug(HotplugHandler *hotplug_dev, DeviceState *dev,
+                           Error **errp)
+{
+    MPTSASState *s = MPT_SAS(hotplug_dev);
+    SCSIDevice *sd = SCSI_DEVICE(dev);
+
+    if (blk_op_is_blocked(sd->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
+        return;
+    }
+    blk_op_block_all(sd->conf.blk, s->blocker);
+    aio_context_acquire(s->ctx);
+    blk_set_aio_context(sd->conf.blk, s->ctx);
+    aio_context_release(s->ctx);
+}
+
+static void mptsas_hotunplug(HotplugHandler *hotplug_dev, DeviceState *dev,
+                             Error **errp)
+{
+    MPTSASState *s = MPT_SAS(hotplug_dev);
+    SCSIDevice *sd = SCSI_DEVICE(dev);
+
+    blk_op_unblock_all(sd->conf.blk, s->blocker);
+    aio_context_acquire(s->ctx);
+    qdev_simple_device_unplug_cb(hotplug_dev, dev, errp);
+    aio_context_release(s->ctx);
 }
 
 static int mptsas_post_load(void *opaque, int version_id)
@@ -1411,6 +1499,7 @@ static void mptsas1068_class_init(ObjectClass *oc, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(oc);
     PCIDeviceClass *pc = PCI_DEVICE_CLASS(oc);
+    HotplugHandlerClass *hc = HOTPLUG_HANDLER_CLASS(oc);
 
     pc->realize = mptsas_scsi_init;
     pc->exit = mptsas_scsi_uninit;
@@ -1424,13 +1513,30 @@ static void mptsas1068_class_init(ObjectClass *oc, void *data)
     dc->reset = mptsas_reset;
     dc->vmsd = &vmstate_mptsas;
     dc->desc = "LSI SAS 1068";
+    hc->plug = mptsas_hotplug;
+    hc->unplug = mptsas_hotunplug;
+}
+
+static void mptsas_instance_init(Object *obj)
+{
+    MPTSASState *s = MPT_SAS(obj);
+
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&s->iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, &error_abort);
 }
 
 static const TypeInfo mptsas_info = {
     .name = TYPE_MPTSAS1068,
     .parent = TYPE_PCI_DEVICE,
     .instance_size = sizeof(MPTSASState),
+    .instance_init = mptsas_instance_init,
     .class_init = mptsas1068_class_init,
+    .interfaces = (InterfaceInfo[]) {
+        { TYPE_HOTPLUG_HANDLER },
+        { }
+    },
 };
 
 static void mptsas_register_types(void)
@@ -2,6 +2,7 @@
 #define MPTSAS_H
 
 #include "mpi.h"
+#include "sysemu/iothread.h"
 
 #define MPTSAS_NUM_PORTS 8
 #define MPTSAS_MAX_FRAMES 2048     /* Firmware limit at 65535 */
@@ -27,6 +28,11 @@ struct MPTSASState {
     MemoryRegion diag_io;
     QEMUBH *request_bh;
 
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *irq_bh;
+    Error *blocker;
+
     uint32_t msi_available;
     uint64_t sas_addr;
 
@@ -46,6 +46,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -119,6 +120,10 @@ struct AioContext {
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
+    /* Thread pool size limits, see aio_context_set_thread_pool_params() */
+    int thread_pool_min;
+    int thread_pool_max;
+
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
@@ -128,6 +133,24 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Number of AioHandlers without .io_poll(); polling is only possible
+     * when this is zero, because events on the other handlers would
+     * otherwise be delayed until polling times out.
+     */
+    int poll_disable_cnt;
+
+    /* Polling mode parameters, see aio_context_set_poll_params() */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Polling statistics: a hit is a busy-poll phase that found an event,
+     * a miss is one that timed out and fell back to ppoll/epoll.
+     */
+    uint64_t poll_hits;
+    uint64_t poll_misses;
 };
 
 /**
@@ -315,6 +338,22 @@ void aio_set_fd_handler(AioContext *ctx,
                         IOHandler *io_write,
                         void *opaque);
 
+/* Like aio_set_fd_handler, but also register an @io_poll callback.
+ *
+ * @io_poll is called repeatedly by aio_poll() during busy polling, before
+ * blocking in ppoll/epoll.  It must be cheap, must not block, and should
+ * return true if it made progress (typically by invoking the same work as
+ * @io_read).  Busy polling only happens while every handler in the
+ * AioContext has an @io_poll callback.
+ */
+void aio_set_fd_handler_poll(AioContext *ctx,
+                             int fd,
+                             bool is_external,
+                             IOHandler *io_read,
+                             IOHandler *io_write,
+                             AioPollFn *io_poll,
+                             void *opaque);
+
 /* Register an event notifier and associated callbacks.  Behaves very similarly
  * to event_notifier_set_handler.  Unlike event_notifier_set_handler, these callbacks
  * will be invoked when using aio_poll().
@@ -327,6 +366,15 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Like aio_set_event_notifier, but also register an @io_poll callback
+ * that is passed @notifier.  See aio_set_fd_handler_poll.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 bool is_external,
+                                 EventNotifierHandler *io_read,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -335,6 +383,18 @@ GSource *aio_get_g_source(AioContext *ctx);
 /* Return the ThreadPool bound to this AioContext */
 struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 
+/**
+ * aio_context_set_thread_pool_params:
+ * @ctx: the aio context
+ * @min: number of worker threads that are kept around even when idle
+ * @max: maximum number of worker threads
+ *
+ * Set the size limits of the AioContext's thread pool.  They apply to the
+ * pool when it is created, or right away if it already exists.
+ */
+void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
+                                        int64_t max, Error **errp);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -441,4 +501,20 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: polling time growth factor; 0 selects the default of 2
+ * @shrink: polling time shrink factor; 0 stops polling on the first
+ *          wait that is longer than @max_ns
+ *
+ * The polling time adapts to the workload: it grows while events arrive
+ * shortly after aio_poll() starts waiting and shrinks when waits exceed
+ * @max_ns.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
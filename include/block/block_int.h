@@ -57,6 +57,7 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -209,6 +210,12 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Coroutine version of bdrv_write_compressed.  Drivers that implement it
+     * must cope with several compressed writes in flight at the same time.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -226,6 +233,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(BlockDriverState *bs);
 
     int (*bdrv_save_vmstate)(BlockDriverState *bs, QEMUIOVector *qiov,
                              int64_t pos);
@@ -317,6 +325,17 @@ struct BlockDriver {
      */
     void (*bdrv_drain)(BlockDriverState *bs);
 
+    /**
+     * Check whether a new persistent dirty bitmap with the given name and
+     * granularity can be stored in the image.  Drivers that implement this
+     * store all persistent bitmaps of @bs when the image is closed or
+     * inactivated, and load them again when it is opened.
+     */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs,
+                                        const char *name,
+                                        uint32_t granularity,
+                                        Error **errp);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
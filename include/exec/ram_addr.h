@@ -36,6 +36,12 @@ struct RAMBlock {
     /* RCU-enabled, writes protected by the ramlist lock */
     QLIST_ENTRY(RAMBlock) next;
     int fd;
+    /* XBZRLE statistics of the outgoing migration, see migration/ram.c.
+     * unsigned long so that they can be accessed atomically on any host. */
+    unsigned long xbzrle_lookups;
+    unsigned long xbzrle_pages;
+    unsigned long xbzrle_cache_miss;
+    unsigned long xbzrle_overflows;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
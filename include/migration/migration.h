@@ -171,6 +171,9 @@ struct MigrationState
     QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
     /* The RAMBlock used in the last src_page_request */
     RAMBlock *last_req_rb;
+
+    /* Where the multifd channels connect to (tcp: migrations only) */
+    char *multifd_host_port;
 };
 
 void migrate_set_state(int *state, int old_state, int new_state);
@@ -189,6 +192,8 @@ void tcp_start_incoming_migration(const char *host_port, Error **errp);
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp);
 
+int tcp_multifd_connect(const char *host_port, Error **errp);
+
 void unix_start_incoming_migration(const char *path, Error **errp);
 
 void unix_start_outgoing_migration(MigrationState *s, const char *path, Error **errp);
@@ -224,6 +229,11 @@ void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
 void migrate_decompress_threads_create(void);
 void migrate_decompress_threads_join(void);
+int multifd_save_setup(const char *host_port, Error **errp);
+void multifd_save_shutdown(void);
+void multifd_save_cleanup(void);
+void multifd_load_setup(int listen_fd);
+void multifd_load_cleanup(void);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
@@ -242,6 +252,8 @@ uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
+XBZRLEBlockStatsList *xbzrle_mig_block_stats(void);
+bool xbzrle_mig_enabled(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
 void ram_debug_dump_bitmap(unsigned long *todump, bool expected);
@@ -270,10 +282,12 @@ bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 
 bool migrate_auto_converge(void);
+bool migrate_auto_tune(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool test_xbzrle_encode_next_accel(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -283,7 +297,10 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
 bool migrate_use_events(void);
 
 /* Sending on the return path - generic and then for each message type */
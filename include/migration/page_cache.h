@@ -39,7 +39,8 @@ void cache_fini(PageCache *cache);
 /**
  * cache_is_cached: Checks to see if the page is cached
  *
- * Returns %true if page is cached
+ * Returns %true if page is cached.  A hit makes the page less likely to
+ * be replaced by cache_insert().
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
@@ -60,7 +61,9 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the set of the page is full, the page that was hit least recently
+ * is replaced.
  *
  * Returns -1 when the page isn't inserted into cache
  *
@@ -73,8 +76,9 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
 /**
- * cache_resize: resize the page cache. In case of size reduction the extra
- * pages will be freed
+ * cache_resize: resize the page cache. The cached pages are kept without
+ * copying their data.  In case of size reduction the pages that were hit
+ * least will be freed
  *
  * Returns -1 on error new cache size on success
  *
@@ -0,0 +1,49 @@
+/*
+ * Page compression codecs for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_PAGE_COMPRESS_H
+#define QEMU_MIGRATION_PAGE_COMPRESS_H
+
+#include "qapi-types.h"
+
+/*
+ * A compressor keeps the codec state of one compression thread, so that
+ * it is not set up again for every page.  Each page is compressed on its
+ * own and can be decompressed without any of the others.
+ */
+typedef struct PageCompressor PageCompressor;
+typedef struct PageDecompressor PageDecompressor;
+
+bool page_compress_method_supported(MigrationCompressMethod method);
+
+/* Largest compressed size of @size bytes */
+size_t page_compress_bound(MigrationCompressMethod method, size_t size);
+
+PageCompressor *page_compressor_new(MigrationCompressMethod method, int level);
+void page_compressor_free(PageCompressor *c);
+MigrationCompressMethod page_compressor_method(PageCompressor *c);
+
+/*
+ * Compress @size bytes from @src into @dest, which must be able to hold
+ * page_compress_bound() bytes.  Returns the compressed size, or -1 on
+ * error.
+ */
+ssize_t page_compress(PageCompressor *c, uint8_t *dest, size_t dest_size,
+                      const uint8_t *src, size_t size);
+
+PageDecompressor *page_decompressor_new(void);
+void page_decompressor_free(PageDecompressor *d);
+
+/*
+ * Decompress @len bytes from @src, which must expand to exactly @size
+ * bytes at @dest.  Returns 0 on success and -1 on error.
+ */
+int page_decompress(PageDecompressor *d, MigrationCompressMethod method,
+                    uint8_t *dest, size_t size,
+                    const uint8_t *src, size_t len);
+
+#endif
@@ -28,6 +28,15 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* AioContext poll parameters */
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Thread pool size limits */
+    int64_t thread_pool_min;
+    int64_t thread_pool_max;
 } IOThread;
 
 #define IOTHREAD(obj) \
@@ -0,0 +1,226 @@
+/*
+ * Guest dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * The rate is estimated without the dirty log, so that it can be measured
+ * before a migration is started and costs the guest nothing: a random
+ * sample of the pages of each RAM block is hashed, hashed again after the
+ * measurement period, and the share of pages whose hash changed is scaled
+ * up to the size of the block.  A page written several times in the period
+ * is only counted once, as it would be by a migration iteration.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qerror.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/ram_addr.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTYRATE_SAMPLE_PAGES_PER_GB   512
+#define DIRTYRATE_MIN_SAMPLE_PAGES      32
+#define DIRTYRATE_MAX_CALC_TIME         60
+
+typedef struct DirtyRateSample {
+    char idstr[256];
+    ram_addr_t used_length;
+    int64_t sample_pages;
+    int64_t dirty_pages;
+    /* In bytes per second */
+    uint64_t dirty_rate;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+} DirtyRateSample;
+
+/* Protected by the iothread lock */
+static struct {
+    DirtyRateStatus status;
+    int64_t start_time;
+    int64_t calc_time;
+    uint64_t dirty_rate;
+    DirtyRateSample *samples;
+    int nr_samples;
+} dirty_rate;
+
+static uint32_t dirty_rate_hash(RAMBlock *block, ram_addr_t offset)
+{
+    return crc32(0, ramblock_ptr(block, offset), TARGET_PAGE_SIZE);
+}
+
+/* Called with rcu_read_lock() */
+static DirtyRateSample *dirty_rate_sample(int *nr_samples)
+{
+    DirtyRateSample *samples, *s;
+    RAMBlock *block;
+    int64_t pages, i;
+    int n = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        n++;
+    }
+    samples = g_new0(DirtyRateSample, n);
+
+    s = samples;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (s == samples + n) {
+            /* A block was added meanwhile, leave it out */
+            break;
+        }
+        pages = block->used_length >> TARGET_PAGE_BITS;
+        if (!pages) {
+            continue;
+        }
+        pstrcpy(s->idstr, sizeof(s->idstr), block->idstr);
+        s->used_length = block->used_length;
+        s->sample_pages = (block->used_length >> 30) *
+                          DIRTYRATE_SAMPLE_PAGES_PER_GB;
+        s->sample_pages = MAX(s->sample_pages, DIRTYRATE_MIN_SAMPLE_PAGES);
+        s->sample_pages = MIN(s->sample_pages, pages);
+        s->offsets = g_new(ram_addr_t, s->sample_pages);
+        s->hashes = g_new(uint32_t, s->sample_pages);
+        for (i = 0; i < s->sample_pages; i++) {
+            s->offsets[i] = (ram_addr_t)g_random_int_range(0, pages)
+                            << TARGET_PAGE_BITS;
+            s->hashes[i] = dirty_rate_hash(block, s->offsets[i]);
+        }
+        s++;
+    }
+
+    *nr_samples = s - samples;
+    return samples;
+}
+
+/* Called with rcu_read_lock() */
+static void dirty_rate_compare(DirtyRateSample *s)
+{
+    RAMBlock *block = qemu_ram_block_by_name(s->idstr);
+    int64_t i;
+
+    if (!block || block->used_length != s->used_length) {
+        /* The block went away or was resized, its sample is meaningless */
+        s->sample_pages = 0;
+        return;
+    }
+
+    for (i = 0; i < s->sample_pages; i++) {
+        if (dirty_rate_hash(block, s->offsets[i]) != s->hashes[i]) {
+            s->dirty_pages++;
+        }
+    }
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    int64_t calc_time = dirty_rate.calc_time;
+    DirtyRateSample *samples, *s;
+    uint64_t total_rate = 0;
+    int i, n;
+
+    rcu_register_thread();
+
+    rcu_read_lock();
+    samples = dirty_rate_sample(&n);
+    rcu_read_unlock();
+
+    g_usleep(calc_time * G_USEC_PER_SEC);
+
+    rcu_read_lock();
+    for (i = 0; i < n; i++) {
+        dirty_rate_compare(&samples[i]);
+    }
+    rcu_read_unlock();
+
+    rcu_unregister_thread();
+
+    for (i = 0; i < n; i++) {
+        s = &samples[i];
+        g_free(s->offsets);
+        g_free(s->hashes);
+        s->offsets = NULL;
+        s->hashes = NULL;
+        if (s->sample_pages) {
+            s->dirty_rate = s->used_length / s->sample_pages *
+                            s->dirty_pages / calc_time;
+            total_rate += s->dirty_rate;
+        }
+    }
+
+    trace_dirty_rate_measured(calc_time, total_rate >> 20);
+
+    qemu_mutex_lock_iothread();
+    g_free(dirty_rate.samples);
+    dirty_rate.samples = samples;
+    dirty_rate.nr_samples = n;
+    dirty_rate.dirty_rate = total_rate;
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    QemuThread thread;
+
+    if (dirty_rate.status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTYRATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "a value between 1 and 60");
+        return;
+    }
+
+    dirty_rate.status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate.start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    dirty_rate.calc_time = calc_time;
+
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateBlockList **tail = &info->blocks, *entry;
+    DirtyRateSample *s;
+    int i;
+
+    info->status = dirty_rate.status;
+    info->start_time = dirty_rate.start_time;
+    info->calc_time = dirty_rate.calc_time;
+    if (dirty_rate.status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate.dirty_rate >> 20;
+    for (i = 0; i < dirty_rate.nr_samples; i++) {
+        s = &dirty_rate.samples[i];
+        if (!s->sample_pages) {
+            continue;
+        }
+        entry = g_new0(DirtyRateBlockList, 1);
+        entry->value = g_new0(DirtyRateBlock, 1);
+        entry->value->id = g_strdup(s->idstr);
+        entry->value->sample_pages = s->sample_pages;
+        entry->value->dirty_pages = s->dirty_pages;
+        entry->value->dirty_rate = s->dirty_rate >> 20;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    info->has_blocks = !!info->blocks;
+
+    return info;
+}
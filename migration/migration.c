@@ -27,6 +27,7 @@
 #include "qemu/rcu.h"
 #include "migration/block.h"
 #include "migration/postcopy-ram.h"
+#include "migration/page_compress.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
 #include "trace.h"
@@ -52,6 +53,8 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT 10
+/* Default number of parallel RAM channels for multifd */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -91,6 +94,10 @@ MigrationState *migrate_get_current(void)
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INITIAL,
         .parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                 DEFAULT_MIGRATE_X_CPU_THROTTLE_INCREMENT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] =
+                MIGRATION_COMPRESS_METHOD_ZLIB,
     };
 
     if (!once) {
@@ -404,6 +411,7 @@ static void process_incoming_migration_co(void *opaque)
         /* Else if something went wrong then just fall out of the normal exit */
     }
 
+    multifd_load_cleanup();
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
 
@@ -525,6 +533,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
     params->x_cpu_throttle_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+    params->compress_method =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
 
     return params;
 }
@@ -549,7 +561,7 @@ static bool migration_is_setup_or_active(int state)
 
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
-    if (migrate_use_xbzrle()) {
+    if (migrate_use_xbzrle() || xbzrle_mig_enabled()) {
         info->has_xbzrle_cache = true;
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
@@ -558,6 +570,8 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->blocks = xbzrle_mig_block_stats();
+        info->xbzrle_cache->has_blocks = !!info->xbzrle_cache->blocks;
     }
 }
 
@@ -710,6 +724,17 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        if (migrate_postcopy_ram() || migrate_use_compression()) {
+            /* Multifd channels only carry normal pages, and a page that
+             * is in flight on a channel can't be placed atomically.
+             */
+            error_report("Multifd is not currently compatible with "
+                         "compression or postcopy");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -721,7 +746,12 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 bool has_x_cpu_throttle_initial,
                                 int64_t x_cpu_throttle_initial,
                                 bool has_x_cpu_throttle_increment,
-                                int64_t x_cpu_throttle_increment, Error **errp)
+                                int64_t x_cpu_throttle_increment,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_compress_method,
+                                MigrationCompressMethod compress_method,
+                                Error **errp)
 {
     MigrationState *s = migrate_get_current();
 
@@ -756,6 +786,24 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "x_cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_compress_method &&
+            !page_compress_method_supported(compress_method)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "compress_method",
+                   "a compression method supported by this build");
+        return;
+    }
+    if ((has_x_multifd_channels || has_compress_method) &&
+            migration_is_setup_or_active(s->state)) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
@@ -776,6 +824,13 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT] =
                                                     x_cpu_throttle_increment;
     }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+    if (has_compress_method) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD] = compress_method;
+    }
 }
 
 void qmp_migrate_start_postcopy(Error **errp)
@@ -829,6 +884,7 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         migrate_compress_threads_join();
+        multifd_save_cleanup();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -881,6 +937,7 @@ static void migrate_fd_cancel(MigrationState *s)
      */
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
+        multifd_save_shutdown();
     }
 }
 
@@ -1032,6 +1089,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_use_multifd() && !strstart(uri, "tcp:", NULL)) {
+        error_setg(errp, "x-multifd requires a tcp: migration URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1146,6 +1208,15 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_auto_tune(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_AUTO_TUNE];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -1182,6 +1253,15 @@ int migrate_compress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
 }
 
+MigrationCompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_METHOD];
+}
+
 int migrate_decompress_threads(void)
 {
     MigrationState *s;
@@ -1191,6 +1271,24 @@ int migrate_decompress_threads(void)
     return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -1675,6 +1773,15 @@ static void *migration_thread(void *opaque)
         qemu_savevm_send_postcopy_advise(s->to_dst_file);
     }
 
+    if (migrate_use_multifd()) {
+        Error *local_err = NULL;
+
+        if (multifd_save_setup(s->multifd_host_port, &local_err) < 0) {
+            error_report_err(local_err);
+            qemu_file_set_error(s->to_dst_file, -EIO);
+        }
+    }
+
     qemu_savevm_state_begin(s->to_dst_file, &s->params);
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
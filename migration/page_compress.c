@@ -0,0 +1,266 @@
+/*
+ * Page compression codecs for RAM migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * zlib produces exactly the stream that compress2() used to, so that
+ * older destinations can still load it.  zstd and lz4 are much cheaper
+ * per byte and are what makes compression pay off on fast links; zstd
+ * still compresses about as well as zlib at its low levels, lz4 trades
+ * some of the ratio for the fastest decompression.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "migration/page_compress.h"
+
+struct PageCompressor {
+    MigrationCompressMethod method;
+    int level;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd_cctx;
+#endif
+};
+
+struct PageDecompressor {
+    bool zstream_ready;
+    z_stream zstream;
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zstd_dctx;
+#endif
+};
+
+bool page_compress_method_supported(MigrationCompressMethod method)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+size_t page_compress_bound(MigrationCompressMethod method, size_t size)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return compressBound(size);
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_compressBound(size);
+#endif
+    default:
+        abort();
+    }
+}
+
+PageCompressor *page_compressor_new(MigrationCompressMethod method, int level)
+{
+    PageCompressor *c = g_new0(PageCompressor, 1);
+
+    assert(page_compress_method_supported(method));
+    c->method = method;
+    c->level = level;
+
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        if (deflateInit(&c->zstream, level) != Z_OK) {
+            error_report("Failed to initialize zlib compression");
+            abort();
+        }
+        break;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        /* Level 0 would be zstd's default, which is already too slow */
+        c->level = MAX(level, 1);
+        c->zstd_cctx = ZSTD_createCCtx();
+        if (!c->zstd_cctx) {
+            error_report("Failed to initialize zstd compression");
+            abort();
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+
+    return c;
+}
+
+void page_compressor_free(PageCompressor *c)
+{
+    if (!c) {
+        return;
+    }
+
+    switch (c->method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        deflateEnd(&c->zstream);
+        break;
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD:
+        ZSTD_freeCCtx(c->zstd_cctx);
+        break;
+#endif
+    default:
+        break;
+    }
+    g_free(c);
+}
+
+MigrationCompressMethod page_compressor_method(PageCompressor *c)
+{
+    return c->method;
+}
+
+static ssize_t page_compress_zlib(PageCompressor *c,
+                                  uint8_t *dest, size_t dest_size,
+                                  const uint8_t *src, size_t size)
+{
+    z_stream *zs = &c->zstream;
+
+    if (deflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (uint8_t *)src;
+    zs->avail_in = size;
+    zs->next_out = dest;
+    zs->avail_out = dest_size;
+
+    if (deflate(zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return dest_size - zs->avail_out;
+}
+
+ssize_t page_compress(PageCompressor *c, uint8_t *dest, size_t dest_size,
+                      const uint8_t *src, size_t size)
+{
+    switch (c->method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return page_compress_zlib(c, dest, dest_size, src, size);
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        ret = ZSTD_compressCCtx(c->zstd_cctx, dest, dest_size, src, size,
+                                c->level);
+        return ZSTD_isError(ret) ? -1 : ret;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4: {
+        int ret;
+
+        ret = LZ4_compress_default((const char *)src, (char *)dest,
+                                   size, dest_size);
+        return ret > 0 ? ret : -1;
+    }
+#endif
+    default:
+        abort();
+    }
+}
+
+PageDecompressor *page_decompressor_new(void)
+{
+    return g_new0(PageDecompressor, 1);
+}
+
+void page_decompressor_free(PageDecompressor *d)
+{
+    if (!d) {
+        return;
+    }
+    if (d->zstream_ready) {
+        inflateEnd(&d->zstream);
+    }
+#ifdef CONFIG_ZSTD
+    ZSTD_freeDCtx(d->zstd_dctx);
+#endif
+    g_free(d);
+}
+
+static int page_decompress_zlib(PageDecompressor *d,
+                                uint8_t *dest, size_t size,
+                                const uint8_t *src, size_t len)
+{
+    z_stream *zs = &d->zstream;
+
+    if (!d->zstream_ready) {
+        if (inflateInit(zs) != Z_OK) {
+            return -1;
+        }
+        d->zstream_ready = true;
+    } else if (inflateReset(zs) != Z_OK) {
+        return -1;
+    }
+    zs->next_in = (uint8_t *)src;
+    zs->avail_in = len;
+    zs->next_out = dest;
+    zs->avail_out = size;
+
+    if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_out) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Codec state is set up on first use, because the stream only tells which
+ * codec a page uses when the page arrives.
+ */
+int page_decompress(PageDecompressor *d, MigrationCompressMethod method,
+                    uint8_t *dest, size_t size,
+                    const uint8_t *src, size_t len)
+{
+    switch (method) {
+    case MIGRATION_COMPRESS_METHOD_ZLIB:
+        return page_decompress_zlib(d, dest, size, src, len);
+#ifdef CONFIG_ZSTD
+    case MIGRATION_COMPRESS_METHOD_ZSTD: {
+        size_t ret;
+
+        if (!d->zstd_dctx) {
+            d->zstd_dctx = ZSTD_createDCtx();
+            if (!d->zstd_dctx) {
+                return -1;
+            }
+        }
+        ret = ZSTD_decompressDCtx(d->zstd_dctx, dest, size, src, len);
+        return !ZSTD_isError(ret) && ret == size ? 0 : -1;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case MIGRATION_COMPRESS_METHOD_LZ4:
+        return LZ4_decompress_safe((const char *)src, (char *)dest,
+                                   len, size) == (int)size ? 0 : -1;
+#endif
+    default:
+        return -1;
+    }
+}
@@ -26,17 +26,18 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qapi-event.h"
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
+#include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/postcopy-ram.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
+#include "migration/page_compress.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
@@ -66,6 +67,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -89,15 +91,20 @@ static struct {
 /* buffer used for XBZRLE decoding */
 static uint8_t *xbzrle_decoded_buf;
 
+/* Whether pages are sent through XBZRLE.  Set from the xbzrle capability
+ * at setup, and turned on or off later by x-auto-tune.
+ */
+static bool xbzrle_enabled;
+
 static void XBZRLE_cache_lock(void)
 {
-    if (migrate_use_xbzrle())
+    if (migrate_use_xbzrle() || migrate_auto_tune())
         qemu_mutex_lock(&XBZRLE.lock);
 }
 
 static void XBZRLE_cache_unlock(void)
 {
-    if (migrate_use_xbzrle())
+    if (migrate_use_xbzrle() || migrate_auto_tune())
         qemu_mutex_unlock(&XBZRLE.lock);
 }
 
@@ -109,7 +116,6 @@ static void XBZRLE_cache_unlock(void)
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
     int64_t ret;
 
     if (new_size < TARGET_PAGE_SIZE) {
@@ -122,16 +128,13 @@ int64_t xbzrle_cache_resize(int64_t new_size)
         if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
             goto out_new_size;
         }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
+        /* Keep what is cached, so that the migration does not have to
+         * start over with a cold cache */
+        if (cache_resize(XBZRLE.cache, new_size / TARGET_PAGE_SIZE) < 0) {
+            error_report("Error resizing cache");
             ret = -1;
             goto out;
         }
-
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
     }
 
 out_new_size:
@@ -141,6 +144,38 @@ out:
     return ret;
 }
 
+static int xbzrle_init(void)
+{
+    XBZRLE_cache_lock();
+    XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
+                              TARGET_PAGE_SIZE,
+                              TARGET_PAGE_SIZE);
+    if (!XBZRLE.cache) {
+        XBZRLE_cache_unlock();
+        error_report("Error creating cache");
+        return -1;
+    }
+    XBZRLE_cache_unlock();
+
+    /* We prefer not to abort if there is no memory */
+    XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
+    if (!XBZRLE.encoded_buf) {
+        error_report("Error allocating encoded_buf");
+        return -1;
+    }
+
+    XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
+    if (!XBZRLE.current_buf) {
+        error_report("Error allocating current_buf");
+        g_free(XBZRLE.encoded_buf);
+        XBZRLE.encoded_buf = NULL;
+        return -1;
+    }
+
+    xbzrle_enabled = true;
+    return 0;
+}
+
 /* accounting for migration statistics */
 typedef struct AccountingInfo {
     uint64_t dup_pages;
@@ -216,6 +251,42 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+bool xbzrle_mig_enabled(void)
+{
+    return xbzrle_enabled;
+}
+
+/* Called from the main thread; the counters are only updated by the
+ * migration thread, so a slightly stale value may be returned */
+XBZRLEBlockStatsList *xbzrle_mig_block_stats(void)
+{
+    XBZRLEBlockStatsList *head = NULL, **tail = &head;
+    XBZRLEBlockStatsList *entry;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        unsigned long lookups = atomic_read(&block->xbzrle_lookups);
+        unsigned long misses = atomic_read(&block->xbzrle_cache_miss);
+
+        if (!lookups) {
+            continue;
+        }
+        entry = g_new0(XBZRLEBlockStatsList, 1);
+        entry->value = g_new0(XBZRLEBlockStats, 1);
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->pages = atomic_read(&block->xbzrle_pages);
+        entry->value->cache_miss = misses;
+        entry->value->cache_miss_rate = (double)misses / lookups;
+        entry->value->overflow = atomic_read(&block->xbzrle_overflows);
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+
+    return head;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -250,45 +321,73 @@ static struct BitmapRcu {
     unsigned long *unsentmap;
 } *migration_bitmap_rcu;
 
+/*
+ * Pages are handed to the (de)compression threads in batches of up to
+ * this many pages of one RAMBlock, so that the thread handoff is not paid
+ * for every page.
+ */
+#define COMPRESS_BATCH_PAGES 16
+
+/*
+ * The length of a compressed page is sent in the low bits of a be32, the
+ * top byte tells the codec.  zlib is 0, which is what older versions send.
+ */
+#define COMPRESS_LEN_MASK       0xffffff
+#define COMPRESS_METHOD_SHIFT   24
+
 struct CompressParam {
     bool start;
     bool done;
-    QEMUFile *file;
     QemuMutex mutex;
     QemuCond cond;
+    PageCompressor *compressor;
     RAMBlock *block;
-    ram_addr_t offset;
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    int pages;
+    /* The batch in wire format, sent by the migration thread */
+    uint8_t *buf;
+    size_t buf_len;
 };
 typedef struct CompressParam CompressParam;
 
 struct DecompressParam {
     bool start;
+    bool done;
     QemuMutex mutex;
     QemuCond cond;
-    void *des;
+    PageDecompressor *decompressor;
+    int pages;
+    void *des[COMPRESS_BATCH_PAGES];
+    int len[COMPRESS_BATCH_PAGES];
+    MigrationCompressMethod method[COMPRESS_BATCH_PAGES];
+    /* The compressed pages of the batch, back to back */
     uint8_t *compbuf;
-    int len;
+    size_t compbuf_len;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
+/* The batch the migration thread is adding pages to, not started yet */
+static CompressParam *comp_filling;
 /* comp_done_cond is used to wake up the migration thread when
  * one of the compression threads has finished the compression.
  * comp_done_lock is used to co-work with comp_done_cond.
  */
 static QemuMutex *comp_done_lock;
 static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
 
 static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
+static DecompressParam *decomp_filling;
+/* Same as comp_done_lock and comp_done_cond, for the incoming side */
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
 
-static int do_compress_ram_page(CompressParam *param);
+static void do_compress_ram_pages(CompressParam *param);
 
 static void *do_data_compress(void *opaque)
 {
@@ -306,7 +405,7 @@ static void *do_data_compress(void *opaque)
             qemu_cond_wait(&param->cond, &param->mutex);
         }
         if (!quit_comp_thread) {
-            do_compress_ram_page(param);
+            do_compress_ram_pages(param);
         }
         param->start = false;
         qemu_mutex_unlock(&param->mutex);
@@ -344,7 +443,8 @@ void migrate_compress_threads_join(void)
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
+        page_compressor_free(comp_param[i].compressor);
+        g_free(comp_param[i].buf);
         qemu_mutex_destroy(&comp_param[i].mutex);
         qemu_cond_destroy(&comp_param[i].cond);
     }
@@ -356,19 +456,26 @@ void migrate_compress_threads_join(void)
     g_free(comp_done_lock);
     compress_threads = NULL;
     comp_param = NULL;
+    comp_filling = NULL;
     comp_done_cond = NULL;
     comp_done_lock = NULL;
 }
 
 void migrate_compress_threads_create(void)
 {
+    MigrationCompressMethod method = migrate_compress_method();
+    size_t record_size;
     int i, thread_count;
 
     if (!migrate_use_compression()) {
         return;
     }
     quit_comp_thread = false;
-    compression_switch = true;
+    /* With x-auto-tune, compression waits until it is needed */
+    compression_switch = !migrate_auto_tune();
+    comp_filling = NULL;
+    /* Page header, length and data, enough for an uncompressed page too */
+    record_size = 8 + 4 + page_compress_bound(method, TARGET_PAGE_SIZE);
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
@@ -377,10 +484,9 @@ void migrate_compress_threads_create(void)
     qemu_cond_init(comp_done_cond);
     qemu_mutex_init(comp_done_lock);
     for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
+        comp_param[i].compressor =
+            page_compressor_new(method, migrate_compress_level());
+        comp_param[i].buf = g_malloc(COMPRESS_BATCH_PAGES * record_size);
         comp_param[i].done = true;
         qemu_mutex_init(&comp_param[i].mutex);
         qemu_cond_init(&comp_param[i].cond);
@@ -414,6 +520,7 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
         qemu_put_byte(f, len);
         qemu_put_buffer(f, (uint8_t *)block->idstr, len);
         size += 1 + len;
+        last_sent_block = block;
     }
     return size;
 }
@@ -449,7 +556,7 @@ static void mig_throttle_guest_down(void)
  */
 static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 {
-    if (ram_bulk_stage || !migrate_use_xbzrle()) {
+    if (ram_bulk_stage || !xbzrle_enabled) {
         return;
     }
 
@@ -484,8 +591,10 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
 
+    atomic_set(&block->xbzrle_lookups, block->xbzrle_lookups + 1);
     if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
         acct_info.xbzrle_cache_miss++;
+        atomic_set(&block->xbzrle_cache_miss, block->xbzrle_cache_miss + 1);
         if (!last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
                              bitmap_sync_count) == -1) {
@@ -514,6 +623,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     } else if (encoded_len == -1) {
         DPRINTF("Overflow\n");
         acct_info.xbzrle_overflows++;
+        atomic_set(&block->xbzrle_overflows, block->xbzrle_overflows + 1);
         /* update data in the cache */
         if (!last_stage) {
             memcpy(prev_cached_page, *current_data, TARGET_PAGE_SIZE);
@@ -534,6 +644,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     qemu_put_buffer(f, XBZRLE.encoded_buf, encoded_len);
     bytes_xbzrle += encoded_len + 1 + 2;
     acct_info.xbzrle_pages++;
+    atomic_set(&block->xbzrle_pages, block->xbzrle_pages + 1);
     acct_info.xbzrle_bytes += bytes_xbzrle;
     *bytes_transferred += bytes_xbzrle;
 
@@ -600,6 +711,7 @@ static int64_t bytes_xfer_prev;
 static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
+static int auto_tune_high_cnt;
 
 static void migration_bitmap_sync_init(void)
 {
@@ -608,6 +720,59 @@ static void migration_bitmap_sync_init(void)
     num_dirty_pages_period = 0;
     xbzrle_cache_miss_prev = 0;
     iterations_prev = 0;
+    auto_tune_high_cnt = 0;
+}
+
+/* Seconds the guest must outpace the migration before each step */
+#define AUTO_TUNE_PERIODS 3
+
+/*
+ * x-auto-tune: while the guest dirties memory faster than we send it,
+ * take one step every AUTO_TUNE_PERIODS seconds.  XBZRLE comes first
+ * because it needs nothing from the destination; compression and
+ * postcopy need their capabilities set on both sides; throttling the
+ * guest is the last resort.
+ *
+ * @dirty_bytes: bytes dirtied during the last second
+ * @xfer_bytes: bytes sent during the last second
+ */
+static void migration_auto_tune(MigrationState *s, uint64_t dirty_bytes,
+                                uint64_t xfer_bytes)
+{
+    const char *action;
+
+    /* The bulk stage sends everything once, whatever the dirty rate */
+    if (ram_bulk_stage || dirty_bytes <= xfer_bytes / 2) {
+        auto_tune_high_cnt = 0;
+        return;
+    }
+    if (++auto_tune_high_cnt < AUTO_TUNE_PERIODS) {
+        return;
+    }
+    auto_tune_high_cnt = 0;
+
+    if (!xbzrle_enabled && !compression_switch && !XBZRLE.cache) {
+        if (xbzrle_init() < 0) {
+            return;
+        }
+        action = "xbzrle";
+    } else if (migrate_use_compression() && !compression_switch) {
+        /* The compressed path bypasses XBZRLE */
+        xbzrle_enabled = false;
+        compression_switch = true;
+        action = "compress";
+    } else if (migrate_postcopy_ram() && !atomic_read(&s->start_postcopy)) {
+        /* The destination can't load XBZRLE pages in postcopy */
+        xbzrle_enabled = false;
+        atomic_set(&s->start_postcopy, true);
+        action = "postcopy";
+    } else if (!migrate_auto_converge()) {
+        mig_throttle_guest_down();
+        action = "throttle";
+    } else {
+        return;
+    }
+    trace_migration_auto_tune(action, dirty_bytes, xfer_bytes);
 }
 
 static void migration_bitmap_sync(void)
@@ -646,14 +811,13 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        bytes_xfer_now = ram_bytes_transferred();
         if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
                amount of bytes that just got transferred since the last time we
                were in this routine. If that happens twice, start or increase
                throttling */
-            bytes_xfer_now = ram_bytes_transferred();
-
             if (s->dirty_pages_rate &&
                (num_dirty_pages_period * TARGET_PAGE_SIZE >
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
@@ -662,10 +826,14 @@ static void migration_bitmap_sync(void)
                     dirty_rate_high_cnt = 0;
                     mig_throttle_guest_down();
              }
-             bytes_xfer_prev = bytes_xfer_now;
         }
+        if (migrate_auto_tune() && s->dirty_pages_rate) {
+            migration_auto_tune(s, num_dirty_pages_period * TARGET_PAGE_SIZE,
+                                bytes_xfer_now - bytes_xfer_prev);
+        }
+        bytes_xfer_prev = bytes_xfer_now;
 
-        if (migrate_use_xbzrle()) {
+        if (xbzrle_enabled) {
             if (iterations_prev != acct_info.iterations) {
                 acct_info.xbzrle_cache_miss_rate =
                    (double)(acct_info.xbzrle_cache_miss -
@@ -715,6 +883,336 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
+/* Multiple RAM channels (multifd)
+ *
+ * With the x-multifd capability, normal pages are not written to the main
+ * stream.  The migration thread collects them in batches of up to
+ * MULTIFD_PAGES_PER_PACKET pages from one RAMBlock and hands each batch to
+ * an idle channel.  Every channel is a separate TCP connection with its own
+ * sender thread on the source and receiver thread on the destination, and
+ * a packet carries the offsets of its pages, so channels don't have to be
+ * in order with each other or with the main stream.
+ *
+ * A page is sent at most once between two syncs of the dirty bitmap, so
+ * pages only need ordering against the previous and next round.  After
+ * each iteration that queued pages, a sync packet is sent on every channel
+ * and RAM_SAVE_FLAG_MULTIFD_SYNC on the main stream.  The destination
+ * doesn't go past the flag on the main stream until all channels reached
+ * their sync packet, and the channels wait there until it does.
+ *
+ * Channel packets:
+ *   be32 MULTIFD_MAGIC, be32 MULTIFD_VERSION, byte channel id  (once)
+ *   be32 MULTIFD_FLAG_PAGES, be32 num, byte len, idstr,
+ *        num * be64 offset, num * page data
+ *   be32 MULTIFD_FLAG_SYNC
+ *   be32 MULTIFD_FLAG_END                                       (last)
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_PAGES_PER_PACKET 128
+
+#define MULTIFD_FLAG_PAGES 0x1
+#define MULTIFD_FLAG_SYNC  0x2
+#define MULTIFD_FLAG_END   0x4
+
+struct MultiFDPages {
+    RAMBlock *block;
+    unsigned int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+};
+typedef struct MultiFDPages MultiFDPages;
+
+struct MultiFDSendParams {
+    uint8_t id;
+    QemuThread thread;
+    QemuSemaphore sem;
+    QEMUFile *file;
+    /* Protected by multifd_send_state->mutex.  @pages belongs to the
+     * sender thread while @pending is set.
+     */
+    MultiFDPages *pages;
+    bool pending;
+    unsigned int sync_pending;
+    bool quit;
+};
+typedef struct MultiFDSendParams MultiFDSendParams;
+
+struct MultiFDSendState {
+    MultiFDSendParams *params;
+    int count;
+    /* Next channel to try, so that batches are spread round robin */
+    int next;
+    /* Batch being filled by the migration thread */
+    MultiFDPages *pages;
+    /* Whether a batch was handed out since the last sync */
+    bool need_sync;
+    QemuMutex mutex;
+    /* Signalled whenever a channel finishes a job or fails */
+    QemuCond cond;
+    bool error;
+};
+typedef struct MultiFDSendState MultiFDSendState;
+
+static MultiFDSendState *multifd_send_state;
+
+static void multifd_send_packet(MultiFDSendParams *p)
+{
+    MultiFDPages *pages = p->pages;
+    size_t len = strlen(pages->block->idstr);
+    unsigned int i;
+
+    qemu_put_be32(p->file, MULTIFD_FLAG_PAGES);
+    qemu_put_be32(p->file, pages->num);
+    qemu_put_byte(p->file, len);
+    qemu_put_buffer(p->file, (uint8_t *)pages->block->idstr, len);
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(p->file, pages->offset[i]);
+    }
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_buffer_async(p->file, pages->block->host + pages->offset[i],
+                              TARGET_PAGE_SIZE);
+    }
+    qemu_fflush(p->file);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+
+    rcu_register_thread();
+
+    qemu_put_be32(p->file, MULTIFD_MAGIC);
+    qemu_put_be32(p->file, MULTIFD_VERSION);
+    qemu_put_byte(p->file, p->id);
+    qemu_fflush(p->file);
+
+    while (!qemu_file_get_error(p->file)) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&multifd_send_state->mutex);
+        /* A batch is always queued before the sync that follows it */
+        if (p->pending) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            rcu_read_lock();
+            multifd_send_packet(p);
+            rcu_read_unlock();
+            qemu_mutex_lock(&multifd_send_state->mutex);
+            p->pending = false;
+        } else if (p->sync_pending) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            qemu_put_be32(p->file, MULTIFD_FLAG_SYNC);
+            qemu_fflush(p->file);
+            qemu_mutex_lock(&multifd_send_state->mutex);
+            p->sync_pending--;
+        } else if (p->quit) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            qemu_put_be32(p->file, MULTIFD_FLAG_END);
+            qemu_fflush(p->file);
+            break;
+        }
+        qemu_cond_broadcast(&multifd_send_state->cond);
+        qemu_mutex_unlock(&multifd_send_state->mutex);
+    }
+
+    if (qemu_file_get_error(p->file)) {
+        error_report("multifd channel %d: send failed", p->id);
+        qemu_mutex_lock(&multifd_send_state->mutex);
+        multifd_send_state->error = true;
+        qemu_cond_broadcast(&multifd_send_state->cond);
+        qemu_mutex_unlock(&multifd_send_state->mutex);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called from the migration thread, before the first RAM section */
+int multifd_save_setup(const char *host_port, Error **errp)
+{
+    MultiFDSendState *state;
+    int i, fd, count;
+
+    count = migrate_multifd_channels();
+    state = g_new0(MultiFDSendState, 1);
+    state->params = g_new0(MultiFDSendParams, count);
+    state->pages = g_new0(MultiFDPages, 1);
+    qemu_mutex_init(&state->mutex);
+    qemu_cond_init(&state->cond);
+    trace_multifd_save_setup(count);
+
+    /* Published before the channels exist so that a cancel can shut down
+     * the ones that are already running; a failure here leaves the rest
+     * to multifd_save_cleanup().
+     */
+    atomic_mb_set(&multifd_send_state, state);
+
+    /* The main stream is already connected, so the destination accepts it
+     * before any of these.
+     */
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &state->params[i];
+
+        fd = tcp_multifd_connect(host_port, errp);
+        if (fd < 0) {
+            error_prepend(errp, "multifd channel %d: ", i);
+            return -1;
+        }
+        p->id = i;
+        p->file = qemu_fopen_socket(fd, "wb");
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_sem_init(&p->sem, 0);
+        qemu_thread_create(&p->thread, "multifd_send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        qemu_mutex_lock(&state->mutex);
+        state->count++;
+        qemu_mutex_unlock(&state->mutex);
+    }
+
+    return 0;
+}
+
+/* Called from migrate_fd_cancel() to unblock the sender threads */
+void multifd_save_shutdown(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_file_shutdown(multifd_send_state->params[i].file);
+    }
+    multifd_send_state->error = true;
+    qemu_cond_broadcast(&multifd_send_state->cond);
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&multifd_send_state->mutex);
+        p->quit = true;
+        qemu_mutex_unlock(&multifd_send_state->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        qemu_fclose(p->file);
+        qemu_sem_destroy(&p->sem);
+        g_free(p->pages);
+    }
+    qemu_mutex_destroy(&multifd_send_state->mutex);
+    qemu_cond_destroy(&multifd_send_state->cond);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Hand the current batch to the next idle channel */
+static int multifd_send_pages(QEMUFile *f)
+{
+    MultiFDSendParams *p = NULL;
+    MultiFDPages *pages;
+    int i, idx;
+
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    while (!p) {
+        if (multifd_send_state->error) {
+            qemu_mutex_unlock(&multifd_send_state->mutex);
+            qemu_file_set_error(f, -EIO);
+            return -1;
+        }
+        for (i = 0; i < multifd_send_state->count; i++) {
+            idx = (multifd_send_state->next + i) % multifd_send_state->count;
+            if (!multifd_send_state->params[idx].pending &&
+                !multifd_send_state->params[idx].sync_pending) {
+                p = &multifd_send_state->params[idx];
+                break;
+            }
+        }
+        if (!p) {
+            qemu_cond_wait(&multifd_send_state->cond,
+                           &multifd_send_state->mutex);
+        }
+    }
+    multifd_send_state->next = (p->id + 1) % multifd_send_state->count;
+    pages = p->pages;
+    p->pages = multifd_send_state->pages;
+    p->pending = true;
+    multifd_send_state->need_sync = true;
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+    qemu_sem_post(&p->sem);
+
+    pages->block = NULL;
+    pages->num = 0;
+    multifd_send_state->pages = pages;
+    return 0;
+}
+
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num && pages->block != block) {
+        if (multifd_send_pages(f) < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages(f);
+    }
+    return 0;
+}
+
+/* Flush the current batch and order the channels against the main stream */
+static void multifd_send_sync_main(QEMUFile *f, uint64_t *bytes_transferred)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+    if (multifd_send_state->pages->num && multifd_send_pages(f) < 0) {
+        return;
+    }
+    if (!multifd_send_state->need_sync) {
+        return;
+    }
+
+    trace_multifd_send_sync_main();
+    qemu_mutex_lock(&multifd_send_state->mutex);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        multifd_send_state->params[i].sync_pending++;
+    }
+    multifd_send_state->need_sync = false;
+    qemu_mutex_unlock(&multifd_send_state->mutex);
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_post(&multifd_send_state->params[i].sem);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    *bytes_transferred += 8;
+    /* The channels stall on the destination until it reads the flag, and
+     * the next batch may wait for them before the buffer is flushed */
+    qemu_fflush(f);
+}
+
 /**
  * ram_save_page: Send the given page to the stream
  *
@@ -774,7 +1272,7 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (!ram_bulk_stage && xbzrle_enabled) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -787,7 +1285,22 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     }
 
     /* XBZRLE overflow or normal page */
-    if (pages == -1) {
+    if (pages == -1 && multifd_send_state && send_async) {
+        /* The channels send straight from guest memory, so pages that
+         * XBZRLE has cached stay on the main stream.  Account for the
+         * page here so that the rate limit and the bandwidth estimate
+         * include it.
+         */
+        if (multifd_queue_page(f, block, pss->offset) < 0) {
+            XBZRLE_cache_unlock();
+            return -1;
+        }
+        qemu_update_position(f, TARGET_PAGE_SIZE);
+        qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+        *bytes_transferred += TARGET_PAGE_SIZE;
+        pages = 1;
+        acct_info.norm_pages++;
+    } else if (pages == -1) {
         *bytes_transferred += save_page_header(f, block,
                                                offset | RAM_SAVE_FLAG_PAGE);
         if (send_async) {
@@ -805,22 +1318,43 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+/*
+ * Compress the pages of a batch into param->buf.  The stream already
+ * names the batch's RAMBlock, so every page header has
+ * RAM_SAVE_FLAG_CONTINUE set.
+ */
+static void do_compress_ram_pages(CompressParam *param)
 {
-    int bytes_sent, blen;
-    uint8_t *p;
-    RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
-
-    p = block->host + (offset & TARGET_PAGE_MASK);
-
-    bytes_sent = save_page_header(param->file, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+    MigrationCompressMethod method;
+    size_t bound;
+    int i;
 
-    return bytes_sent;
+    method = page_compressor_method(param->compressor);
+    bound = page_compress_bound(method, TARGET_PAGE_SIZE);
+    param->buf_len = 0;
+
+    for (i = 0; i < param->pages; i++) {
+        ram_addr_t offset = param->offset[i];
+        uint8_t *p = param->block->host + offset;
+        uint8_t *rec = param->buf + param->buf_len;
+        ssize_t blen;
+
+        blen = page_compress(param->compressor, rec + 12, bound,
+                             p, TARGET_PAGE_SIZE);
+        if (blen < 0) {
+            /* Rather than break the stream, send the page as it is */
+            error_report("Compress Failed!");
+            stq_be_p(rec, offset | RAM_SAVE_FLAG_CONTINUE |
+                          RAM_SAVE_FLAG_PAGE);
+            memcpy(rec + 8, p, TARGET_PAGE_SIZE);
+            param->buf_len += 8 + TARGET_PAGE_SIZE;
+            continue;
+        }
+        stq_be_p(rec, offset | RAM_SAVE_FLAG_CONTINUE |
+                      RAM_SAVE_FLAG_COMPRESS_PAGE);
+        stl_be_p(rec + 8, blen | (method << COMPRESS_METHOD_SHIFT));
+        param->buf_len += 12 + blen;
+    }
 }
 
 static inline void start_compression(CompressParam *param)
@@ -834,6 +1368,7 @@ static inline void start_compression(CompressParam *param)
 
 static inline void start_decompression(DecompressParam *param)
 {
+    param->done = false;
     qemu_mutex_lock(&param->mutex);
     param->start = true;
     qemu_cond_signal(&param->cond);
@@ -842,13 +1377,29 @@ static inline void start_decompression(DecompressParam *param)
 
 static uint64_t bytes_transferred;
 
+/* Send the output of a finished batch, returns the number of bytes */
+static size_t put_compressed_batch(QEMUFile *f, CompressParam *param)
+{
+    size_t len = param->buf_len;
+
+    if (len) {
+        qemu_put_buffer(f, param->buf, len);
+        param->buf_len = 0;
+    }
+    return len;
+}
+
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    int idx, thread_count;
 
     if (!migrate_use_compression()) {
         return;
     }
+    if (comp_filling) {
+        start_compression(comp_filling);
+        comp_filling = NULL;
+    }
     thread_count = migrate_compress_threads();
     for (idx = 0; idx < thread_count; idx++) {
         if (!comp_param[idx].done) {
@@ -859,48 +1410,53 @@ static void flush_compressed_data(QEMUFile *f)
             qemu_mutex_unlock(comp_done_lock);
         }
         if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
+            bytes_transferred += put_compressed_batch(f, &comp_param[idx]);
         }
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
-{
-    param->block = block;
-    param->offset = offset;
-}
-
+/*
+ * Add a page to the batch that is being filled, and start the batch once
+ * it is full.  A new batch goes to the first idle thread, after the
+ * output of its previous batch has been sent.
+ */
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressParam *param = comp_filling;
+    int idx, thread_count;
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
+    if (!param) {
+        thread_count = migrate_compress_threads();
+        qemu_mutex_lock(comp_done_lock);
+        while (!param) {
+            for (idx = 0; idx < thread_count; idx++) {
+                if (comp_param[idx].done) {
+                    param = &comp_param[idx];
+                    break;
+                }
+            }
+            if (!param) {
+                qemu_cond_wait(comp_done_cond, comp_done_lock);
             }
         }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
-        }
+        qemu_mutex_unlock(comp_done_lock);
+
+        *bytes_transferred += put_compressed_batch(f, param);
+        param->block = block;
+        param->pages = 0;
+        comp_filling = param;
     }
-    qemu_mutex_unlock(comp_done_lock);
 
-    return pages;
+    param->offset[param->pages++] = offset;
+    if (param->pages == COMPRESS_BATCH_PAGES) {
+        start_compression(param);
+        comp_filling = NULL;
+    }
+    acct_info.norm_pages++;
+
+    return 1;
 }
 
 /**
@@ -956,20 +1512,20 @@ static int ram_save_compressed_page(QEMUFile *f, PageSearchStatus *pss,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
-                /* Use the qemu thread to compress the data to make sure the
-                 * first page is sent out before other pages
+                /* The first page names the block, send it uncompressed
+                 * rather than stall the migration thread on compressing it
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                *bytes_transferred += save_page_header(f, block, offset |
+                                                       RAM_SAVE_FLAG_PAGE);
+                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+                *bytes_transferred += TARGET_PAGE_SIZE;
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
-                *bytes_transferred += bytes_xmit;
                 pages = 1;
             }
         } else {
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                pages = compress_page_with_multi_thread(f, block, offset,
+                pages = compress_page_with_multi_thread(f, block, pss->offset,
                                                         bytes_transferred);
             }
         }
@@ -1014,7 +1570,7 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
             /* Flag that we've looped */
             pss->complete_round = true;
             ram_bulk_stage = false;
-            if (migrate_use_xbzrle()) {
+            if (xbzrle_enabled) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
                  */
@@ -1259,13 +1815,6 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
         if (unsentmap) {
             clear_bit(dirty_ram_abs >> TARGET_PAGE_BITS, unsentmap);
         }
-        /* Only update last_sent_block if a block was actually sent; xbzrle
-         * might have decided the page was identical so didn't bother writing
-         * to the stream.
-         */
-        if (res > 0) {
-            last_sent_block = pss->block;
-        }
     }
 
     return res;
@@ -1441,6 +1990,7 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
     }
+    xbzrle_enabled = false;
     XBZRLE_cache_unlock();
 }
 
@@ -1891,33 +2441,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
-    if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
-        XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
-                                  TARGET_PAGE_SIZE,
-                                  TARGET_PAGE_SIZE);
-        if (!XBZRLE.cache) {
-            XBZRLE_cache_unlock();
-            error_report("Error creating cache");
-            return -1;
-        }
-        XBZRLE_cache_unlock();
-
-        /* We prefer not to abort if there is no memory */
-        XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
-        if (!XBZRLE.encoded_buf) {
-            error_report("Error allocating encoded_buf");
-            return -1;
-        }
-
-        XBZRLE.current_buf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!XBZRLE.current_buf) {
-            error_report("Error allocating current_buf");
-            g_free(XBZRLE.encoded_buf);
-            XBZRLE.encoded_buf = NULL;
-            return -1;
-        }
-
+    xbzrle_enabled = false;
+    if (migrate_use_xbzrle() && xbzrle_init() < 0) {
+        return -1;
+    }
+    if (migrate_use_xbzrle() || migrate_auto_tune()) {
         acct_clear();
     }
 
@@ -1956,6 +2484,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        block->xbzrle_lookups = 0;
+        block->xbzrle_pages = 0;
+        block->xbzrle_cache_miss = 0;
+        block->xbzrle_overflows = 0;
     }
 
     rcu_read_unlock();
@@ -2014,6 +2546,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_send_sync_main(f, &bytes_transferred);
     rcu_read_unlock();
 
     /*
@@ -2058,6 +2591,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync_main(f, &bytes_transferred);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2187,42 +2721,72 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
+    uint8_t *src;
+    int i;
 
+    qemu_mutex_lock(&param->mutex);
     while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
+        if (!param->start) {
             qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
-            }
-            param->start = false;
+            continue;
         }
-        qemu_mutex_unlock(&param->mutex);
+
+        src = param->compbuf;
+        for (i = 0; i < param->pages; i++) {
+            /* Decompression may fail in some case, especially when the
+             * page is dirtied while being compressed.  It's not a problem
+             * because the dirty page will be retransferred, and it won't
+             * break the data in other pages.
+             */
+            page_decompress(param->decompressor, param->method[i],
+                            param->des[i], TARGET_PAGE_SIZE,
+                            src, param->len[i]);
+            src += param->len[i];
+        }
+        param->start = false;
+
+        qemu_mutex_lock(&decomp_done_lock);
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
     }
+    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
 
+/* Largest compressed page that any of the codecs can send */
+static size_t compress_max_page_len(void)
+{
+    size_t len = 0;
+    int method;
+
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        if (page_compress_method_supported(method)) {
+            len = MAX(len, page_compress_bound(method, TARGET_PAGE_SIZE));
+        }
+    }
+    return len;
+}
+
 void migrate_decompress_threads_create(void)
 {
     int i, thread_count;
+    size_t compbuf_size = COMPRESS_BATCH_PAGES * compress_max_page_len();
 
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
+    decomp_filling = NULL;
     quit_decomp_thread = false;
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_init(&decomp_param[i].mutex);
         qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        decomp_param[i].decompressor = page_decompressor_new();
+        decomp_param[i].compbuf = g_malloc0(compbuf_size);
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2233,10 +2797,10 @@ void migrate_decompress_threads_join(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
     thread_count = migrate_decompress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_mutex_lock(&decomp_param[i].mutex);
+        quit_decomp_thread = true;
         qemu_cond_signal(&decomp_param[i].cond);
         qemu_mutex_unlock(&decomp_param[i].mutex);
     }
@@ -2244,34 +2808,324 @@ void migrate_decompress_threads_join(void)
         qemu_thread_join(decompress_threads + i);
         qemu_mutex_destroy(&decomp_param[i].mutex);
         qemu_cond_destroy(&decomp_param[i].cond);
+        page_decompressor_free(decomp_param[i].decompressor);
         g_free(decomp_param[i].compbuf);
     }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
     decomp_param = NULL;
+    decomp_filling = NULL;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+struct MultiFDRecvParams {
+    QemuThread thread;
+    /* Posted by the main thread once it has reached the sync point */
+    QemuSemaphore sem_sync;
+    QEMUFile *file;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+};
+typedef struct MultiFDRecvParams MultiFDRecvParams;
+
+struct MultiFDRecvState {
+    MultiFDRecvParams *params;
+    int count;
+    int listen_fd;
+    /* Protects the channels' file pointers against cleanup */
+    QemuMutex mutex;
+    /* Posted by each channel when it reaches a sync packet */
+    QemuSemaphore sem_sync;
+    bool quit;
+    bool failed;
+};
+typedef struct MultiFDRecvState MultiFDRecvState;
+
+static MultiFDRecvState *multifd_recv_state;
+
+static int multifd_recv_pages(MultiFDRecvParams *p)
 {
-    int idx, thread_count;
+    unsigned int num, i;
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+    void *host;
+    int ret = 0;
+
+    num = qemu_get_be32(p->file);
+    len = qemu_get_byte(p->file);
+    qemu_get_buffer(p->file, (uint8_t *)id, len);
+    id[len] = 0;
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: too many pages in packet: %u", num);
+        return -EINVAL;
+    }
+    for (i = 0; i < num; i++) {
+        p->offset[i] = qemu_get_be64(p->file);
+    }
+    if (qemu_file_get_error(p->file)) {
+        return qemu_file_get_error(p->file);
+    }
+
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(id);
+    if (!block) {
+        error_report("multifd: can't find block %s", id);
+        ret = -EINVAL;
+        goto out;
+    }
+    for (i = 0; i < num; i++) {
+        host = NULL;
+        if (!(p->offset[i] & ~TARGET_PAGE_MASK)) {
+            host = host_from_ram_block_offset(block, p->offset[i]);
+        }
+        if (!host) {
+            error_report("multifd: illegal RAM offset " RAM_ADDR_FMT,
+                         p->offset[i]);
+            ret = -EINVAL;
+            goto out;
+        }
+        qemu_get_buffer(p->file, host, TARGET_PAGE_SIZE);
+    }
+    ret = qemu_file_get_error(p->file);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    bool ended = false;
+    uint32_t flags;
+    int fd, id = -1, i;
+
+    rcu_register_thread();
+
+    do {
+        addrlen = sizeof(addr);
+        fd = qemu_accept(multifd_recv_state->listen_fd,
+                         (struct sockaddr *)&addr, &addrlen);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        goto out;
+    }
+
+    qemu_mutex_lock(&multifd_recv_state->mutex);
+    if (multifd_recv_state->quit) {
+        qemu_mutex_unlock(&multifd_recv_state->mutex);
+        closesocket(fd);
+        goto out;
+    }
+    p->file = qemu_fopen_socket(fd, "rb");
+    qemu_mutex_unlock(&multifd_recv_state->mutex);
+
+    if (qemu_get_be32(p->file) != MULTIFD_MAGIC ||
+        qemu_get_be32(p->file) != MULTIFD_VERSION) {
+        error_report("multifd: bad channel header");
+        goto out;
+    }
+    id = qemu_get_byte(p->file);
+    trace_multifd_recv_thread_start(id);
 
-    thread_count = migrate_decompress_threads();
     while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
+        flags = qemu_get_be32(p->file);
+        if (qemu_file_get_error(p->file)) {
+            break;
+        }
+        if (flags == MULTIFD_FLAG_PAGES) {
+            if (multifd_recv_pages(p) < 0) {
                 break;
             }
-        }
-        if (idx < thread_count) {
+        } else if (flags == MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        } else if (flags == MULTIFD_FLAG_END) {
+            ended = true;
+            break;
+        } else {
+            error_report("multifd channel %d: unknown packet %#x", id, flags);
             break;
         }
     }
+
+out:
+    trace_multifd_recv_thread_end(id, ended);
+    if (!ended && !atomic_read(&multifd_recv_state->quit)) {
+        error_report("multifd channel %d: receive failed", id);
+        atomic_set(&multifd_recv_state->failed, true);
+        /* Don't leave the main thread waiting for this channel's sync */
+        for (i = 0; i < multifd_recv_state->count; i++) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+        }
+    }
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Called when the main stream has been accepted.  The receiver threads
+ * accept the channels from the same listening socket and own it from now.
+ */
+void multifd_load_setup(int listen_fd)
+{
+    int i, count;
+
+    count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(MultiFDRecvState, 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    qemu_mutex_init(&multifd_recv_state->mutex);
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+    qemu_set_block(listen_fd);
+
+    for (i = 0; i < count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_thread_create(&p->thread, "multifd_recv", multifd_recv_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    /* Wake up threads that are still in accept(), in recv() or waiting
+     * for a sync that will never come.
+     */
+    qemu_mutex_lock(&multifd_recv_state->mutex);
+    atomic_set(&multifd_recv_state->quit, true);
+    shutdown(multifd_recv_state->listen_fd, SHUT_RDWR);
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->file) {
+            qemu_file_shutdown(p->file);
+        }
+        qemu_sem_post(&p->sem_sync);
+    }
+    qemu_mutex_unlock(&multifd_recv_state->mutex);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->file) {
+            qemu_fclose(p->file);
+        }
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    closesocket(multifd_recv_state->listen_fd);
+    qemu_mutex_destroy(&multifd_recv_state->mutex);
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Wait until every channel has received everything before the sync */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd sync in a stream without multifd channels; "
+                     "x-multifd must be enabled on the destination too");
+        return -EINVAL;
+    }
+
+    trace_multifd_recv_sync_main();
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->failed)) {
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+    return 0;
+}
+
+/*
+ * Queue a compressed page for decompression.  Like on the source, pages
+ * are collected into batches that go to the first idle thread.
+ */
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len,
+                                               MigrationCompressMethod method)
+{
+    DecompressParam *param = decomp_filling;
+    int idx, thread_count;
+
+    if (!param) {
+        thread_count = migrate_decompress_threads();
+        qemu_mutex_lock(&decomp_done_lock);
+        while (!param) {
+            for (idx = 0; idx < thread_count; idx++) {
+                if (decomp_param[idx].done) {
+                    param = &decomp_param[idx];
+                    break;
+                }
+            }
+            if (!param) {
+                qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+            }
+        }
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        param->pages = 0;
+        param->compbuf_len = 0;
+        decomp_filling = param;
+    }
+
+    qemu_get_buffer(f, param->compbuf + param->compbuf_len, len);
+    param->des[param->pages] = host;
+    param->len[param->pages] = len;
+    param->method[param->pages] = method;
+    param->compbuf_len += len;
+    param->pages++;
+
+    if (param->pages == COMPRESS_BATCH_PAGES) {
+        start_decompression(param);
+        decomp_filling = NULL;
+    }
+}
+
+/*
+ * Wait until all queued pages are in guest memory.  Called at the end of
+ * each section of RAM, so that a page can never be overwritten by an
+ * older copy that is still being decompressed.
+ */
+static void wait_for_decompress_done(void)
+{
+    int idx, thread_count;
+
+    if (!decomp_param) {
+        return;
+    }
+    if (decomp_filling) {
+        start_decompression(decomp_filling);
+        decomp_filling = NULL;
+    }
+    thread_count = migrate_decompress_threads();
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < thread_count; idx++) {
+        while (!decomp_param[idx].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
 }
 
 /*
@@ -2438,6 +3292,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
+        MigrationCompressMethod method;
         void *host = NULL;
         uint8_t ch;
 
@@ -2505,12 +3360,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            method = (uint32_t)len >> COMPRESS_METHOD_SHIFT;
+            len &= COMPRESS_LEN_MASK;
+            if (!page_compress_method_supported(method)) {
+                error_report("Unsupported page compression method %d",
+                             method);
+                ret = -EINVAL;
+                break;
+            }
+            if (len > page_compress_bound(method, TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            decompress_data_with_multi_threads(f, host, len);
+            decompress_data_with_multi_threads(f, host, len, method);
             break;
 
         case RAM_SAVE_FLAG_XBZRLE:
@@ -2521,8 +3384,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
+            wait_for_decompress_done();
             break;
         default:
             if (flags & RAM_SAVE_FLAG_HOOK) {
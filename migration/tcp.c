@@ -50,9 +50,17 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    g_free(s->multifd_host_port);
+    s->multifd_host_port = g_strdup(host_port);
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
+/* Blocking connect for a multifd channel, called from the migration thread */
+int tcp_multifd_connect(const char *host_port, Error **errp)
+{
+    return inet_connect(host_port, errp);
+}
+
 static void tcp_accept_incoming_migration(void *opaque)
 {
     struct sockaddr_in addr;
@@ -65,7 +73,12 @@ static void tcp_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c < 0 && errno == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
+    if (c >= 0 && migrate_use_multifd()) {
+        /* The multifd channels connect after the main stream */
+        multifd_load_setup(s);
+    } else {
+        closesocket(s);
+    }
 
     DPRINTF("accepted migration\n");
 
@@ -78,6 +91,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
+        multifd_load_cleanup();
         goto out;
     }
 
@@ -16,6 +16,7 @@
 #include <glib.h>
 
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "migration/page_cache.h"
 
 #ifdef DEBUG_CACHE
@@ -26,8 +27,20 @@
     do { } while (0)
 #endif
 
-/* the page in cache will not be replaced in two cycles */
-#define CACHED_PAGE_LIFETIME 2
+/*
+ * The cache is set associative: a page can be stored in any of the
+ * CACHE_WAYS items of the set that its address hashes to, so that a few
+ * hot pages that hash to the same set do not keep evicting each other.
+ *
+ * Replacement within a set uses the CLOCK algorithm.  Every hit raises
+ * the reference count of the item up to CACHE_MAX_REF, and the clock
+ * hand of the set decrements the counts it passes until it finds an
+ * item without references.  Pages that are dirtied again and again
+ * therefore survive a stream of pages that are only dirtied once, which
+ * start without references and are the first to go.
+ */
+#define CACHE_WAYS 8
+#define CACHE_MAX_REF 3
 
 typedef struct CacheItem CacheItem;
 
@@ -35,20 +48,53 @@ struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    uint8_t it_ref;
 };
 
 struct PageCache {
     CacheItem *page_cache;
+    /* Clock hand of each set */
+    uint8_t *hands;
     unsigned int page_size;
     int64_t max_num_items;
-    uint64_t max_item_age;
+    unsigned int ways;
+    unsigned int set_bits;
     int64_t num_items;
 };
 
-PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+static bool cache_alloc_sets(PageCache *cache, int64_t num_pages)
 {
-    int64_t i;
+    int64_t i, num_sets;
 
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    num_sets = num_pages / cache->ways;
+    cache->set_bits = ctz64(num_sets);
+    cache->max_num_items = num_pages;
+
+    DPRINTF("Setting cache sets to %" PRId64 " of %u pages\n",
+            num_sets, cache->ways);
+
+    /* We prefer not to abort if there is no memory */
+    cache->page_cache = g_try_new(CacheItem, num_pages);
+    cache->hands = g_try_new0(uint8_t, num_sets);
+    if (!cache->page_cache || !cache->hands) {
+        DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->hands);
+        return false;
+    }
+
+    for (i = 0; i < num_pages; i++) {
+        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = 0;
+    }
+    return true;
+}
+
+PageCache *cache_init(int64_t num_pages, unsigned int page_size)
+{
     PageCache *cache;
 
     if (num_pages <= 0) {
@@ -57,7 +103,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -69,26 +115,12 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
     cache->page_size = page_size;
     cache->num_items = 0;
-    cache->max_item_age = 0;
-    cache->max_num_items = num_pages;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
-
-    /* We prefer not to abort if there is no memory */
-    cache->page_cache = g_try_malloc((cache->max_num_items) *
-                                     sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
-        DPRINTF("Failed to allocate cache->page_cache\n");
+    if (!cache_alloc_sets(cache, num_pages)) {
         g_free(cache);
         return NULL;
     }
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
-        cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
-    }
-
     return cache;
 }
 
@@ -104,35 +136,45 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->hands);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Index of the first item of the set that @address belongs to */
+static size_t cache_get_set_pos(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    uint64_t page = address / cache->page_size;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    /* Fold in the upper bits, so that pages at the same offset of
+     * different large regions do not all end up in one set */
+    page ^= page >> cache->set_bits;
+    return (page & ((1ULL << cache->set_bits) - 1)) * cache->ways;
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return &cache->page_cache[pos];
+    set = &cache->page_cache[cache_get_set_pos(cache, addr)];
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
 bool cache_is_cached(const PageCache *cache, uint64_t addr,
@@ -141,13 +183,40 @@ bool cache_is_cached(const PageCache *cache, uint64_t addr,
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
+    if (!it) {
+        return false;
+    }
+
+    /* update the it_age and the references when the cache hit */
+    it->it_age = current_age;
+    if (it->it_ref < CACHE_MAX_REF) {
+        it->it_ref++;
+    }
+    return true;
+}
+
+/* Pick the item of the set at @pos to replace: a free one, or by CLOCK */
+static CacheItem *cache_get_victim(PageCache *cache, size_t pos)
+{
+    CacheItem *set = &cache->page_cache[pos];
+    uint8_t *hand = &cache->hands[pos / cache->ways];
+    CacheItem *it;
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+    }
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+    for (;;) {
+        it = &set[*hand];
+        *hand = (*hand + 1) & (cache->ways - 1);
+        if (!it->it_ref) {
+            return it;
+        }
+        it->it_ref--;
     }
-    return false;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
@@ -158,17 +227,17 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set_pos(cache, addr));
+        it->it_ref = 0;
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
         if (!it->it_data) {
             DPRINTF("Error allocating page\n");
+            it->it_addr = -1;
             return -1;
         }
         cache->num_items++;
@@ -182,12 +251,22 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     return 0;
 }
 
+/* Order in which items are dropped when they no longer fit */
+static bool cache_item_colder(const CacheItem *a, const CacheItem *b)
+{
+    if (a->it_ref != b->it_ref) {
+        return a->it_ref < b->it_ref;
+    }
+    return a->it_age < b->it_age;
+}
+
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
-    PageCache *new_cache;
+    PageCache old;
     int64_t i;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *new_it, *set;
 
     g_assert(cache);
 
@@ -196,44 +275,56 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
+    if (new_num_pages <= 0) {
+        return -1;
+    }
+
     /* same size */
     if (pow2floor(new_num_pages) == cache->max_num_items) {
         return cache->max_num_items;
     }
 
-    new_cache = cache_init(new_num_pages, cache->page_size);
-    if (!(new_cache)) {
+    old = *cache;
+    if (!cache_alloc_sets(cache, pow2floor(new_num_pages))) {
         DPRINTF("Error creating new cache\n");
+        *cache = old;
         return -1;
     }
 
-    /* move all data from old cache */
-    for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+    /* Move the pages over, the data itself stays where it is.  If a set
+     * overflows, keep its hottest pages */
+    cache->num_items = 0;
+    for (i = 0; i < old.max_num_items; i++) {
+        old_it = &old.page_cache[i];
+        if (!old_it->it_data) {
+            continue;
+        }
+
+        set = &cache->page_cache[cache_get_set_pos(cache, old_it->it_addr)];
+        new_it = &set[0];
+        for (j = 0; j < cache->ways; j++) {
+            if (!set[j].it_data) {
+                new_it = &set[j];
+                break;
+            }
+            if (cache_item_colder(&set[j], new_it)) {
+                new_it = &set[j];
             }
         }
-    }
 
-    g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+        if (!new_it->it_data) {
+            cache->num_items++;
+        } else if (cache_item_colder(old_it, new_it)) {
+            g_free(old_it->it_data);
+            continue;
+        } else {
+            g_free(new_it->it_data);
+        }
+        *new_it = *old_it;
+    }
 
-    g_free(new_cache);
+    g_free(old.page_cache);
+    g_free(old.hands);
 
     return cache->max_num_items;
 }
@@ -732,6 +732,74 @@ Example:
 -> { "execute": "migrate-start-postcopy" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring how fast the guest dirties its RAM.  The result is read
+with query-dirty-rate.
+
+Arguments:
+
+- "calc-time": duration of the measurement in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the status and the result of the last dirty page rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "start-time": realtime clock in seconds when the measurement started
+  (json-int)
+- "calc-time": duration of the measurement in seconds (json-int)
+- "dirty-rate": estimated dirty rate of all guest RAM in MB/s, only present
+  once measured (json-int)
+- "blocks": the estimate of each RAM block, only present once measured
+  (json-array of json-object)
+     - "id": RAM block name (json-string)
+     - "sample-pages": number of sampled pages (json-int)
+     - "dirty-pages": number of sampled pages that changed (json-int)
+     - "dirty-rate": estimated dirty rate of the block in MB/s (json-int)
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "start-time": 1467710843,
+        "calc-time": 1,
+        "dirty-rate": 120,
+        "blocks": [
+           { "id": "pc.ram", "sample-pages": 512,
+             "dirty-pages": 60, "dirty-rate": 120 }
+        ]
+     }
+   }
+
 EQMP
 
     {
@@ -1400,7 +1468,7 @@ EQMP
 
     {
         .name       = "block-dirty-bitmap-add",
-        .args_type  = "node:B,name:s,granularity:i?",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
         .mhandler.cmd_new = qmp_marshal_block_dirty_bitmap_add,
     },
 
@@ -1417,6 +1485,8 @@ Arguments:
 - "node": device/node on which to create dirty bitmap (json-string)
 - "name": name of the new dirty bitmap (json-string)
 - "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image file, so that it is loaded
+                again the next time the image is opened (json-bool, optional)
 
 Example:
 
@@ -2902,6 +2972,11 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum busy-polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 to stop polling (json-int)
+- "poll-hits": busy-poll phases that found an event (json-int)
+- "poll-misses": busy-poll phases that had to block (json-int)
 
 Example:
 
@@ -2910,11 +2985,21 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":127340,
+            "poll-misses":2211
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -3553,6 +3638,9 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "blocks": json-array with the same statistics for each RAM
+           block that went through the cache (json-object), with "id",
+           "pages", "cache-miss", "cache-miss-rate" and "overflow"
 
 Examples:
 
@@ -3658,7 +3746,16 @@ Examples:
             "pages":2444343,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
-            "overflow":34434
+            "overflow":34434,
+            "blocks":[
+               {
+                  "id":"pc.ram",
+                  "pages":2444343,
+                  "cache-miss":2244,
+                  "cache-miss-rate":0.001,
+                  "overflow":34434
+               }
+            ]
          }
       }
    }
@@ -3684,6 +3781,8 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM pages over several parallel connections
+- "x-auto-tune": pick the RAM migration strategy from the dirty page rate
 
 Arguments:
 
@@ -3714,6 +3813,8 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple RAM channels state (json-bool)
+         - "x-auto-tune": automatic strategy state (json-bool)
 
 Arguments:
 
@@ -3727,7 +3828,9 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-auto-tune"}
    ]}
 
 EQMP
@@ -3751,6 +3854,9 @@ Set migration parameters
                            throttled for auto-converge (json-int)
 - "x-cpu-throttle-increment": set throttle increasing percentage for
                              auto-converge (json-int)
+- "x-multifd-channels": set the number of parallel RAM channels (json-int)
+- "compress-method": set the compression codec, "zlib", "zstd" or "lz4"
+                     (json-string)
 
 Arguments:
 
@@ -3764,7 +3870,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,x-multifd-channels:i?,compress-method:s?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3781,6 +3887,8 @@ Query current migration parameters
                                       throttled (json-int)
          - "x-cpu-throttle-increment" : throttle increasing percentage for
                                         auto-converge (json-int)
+         - "x-multifd-channels" : number of parallel RAM channels (json-int)
+         - "compress-method" : compression codec (json-string)
 
 Arguments:
 
@@ -3793,7 +3901,9 @@ Example:
          "x-cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "x-cpu-throttle-initial": 20
+         "x-cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "compress-method": "zlib"
       }
    }
 
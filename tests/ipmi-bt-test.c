@@ -33,6 +33,7 @@
 
 #include "libqtest.h"
 #include "qemu-common.h"
+#include "qapi/qmp/qdict.h"
 
 #define IPMI_IRQ        5
 
@@ -221,43 +222,66 @@ static uint8_t set_bmc_globals_cmd[] = { 0x18, 0x2e, 0x0f };
 static uint8_t set_bmc_globals_rsp[] = { 0x1c, 0x2e, 0x00 };
 static uint8_t enable_irq_cmd[] = { 0x05, 0xa1 };
 
+/*
+ * Read a message from the socket, check it and strip the checksum and
+ * the end marker.  msg[0] is the message ID.
+ */
+static void get_emu_cmd(uint8_t *msg, unsigned int *msg_len)
+{
+    get_emu_msg(msg, msg_len);
+    g_assert(*msg_len >= 5);
+    g_assert(msg[*msg_len - 1] == 0xa0);
+    (*msg_len)--;
+    g_assert(ipmb_checksum(msg, *msg_len, 0) == 0);
+    (*msg_len)--;
+}
+
+/* Answer message msg_id */
+static void write_emu_rsp(uint8_t msg_id, uint8_t *rsp, unsigned int rsp_len)
+{
+    uint8_t msg[50], out[100];
+    unsigned int i, msg_len, out_len = 0;
+
+    msg[0] = msg_id;
+    memcpy(msg + 1, rsp, rsp_len);
+    msg_len = rsp_len + 1;
+    msg[msg_len] = -ipmb_checksum(msg, msg_len, 0);
+    msg_len++;
+    for (i = 0; i < msg_len; i++) {
+        if (msg[i] == 0xa0 || msg[i] == 0xa1 || msg[i] == 0xaa) {
+            out[out_len++] = 0xaa;
+            out[out_len++] = msg[i] | 0x10;
+        } else {
+            out[out_len++] = msg[i];
+        }
+    }
+    out[out_len++] = 0xa0;
+    write_emu_msg(out, out_len);
+}
+
 static void emu_msg_handler(void)
 {
     uint8_t msg[100];
     unsigned int msg_len = sizeof(msg);
 
-    get_emu_msg(msg, &msg_len);
-    g_assert(msg_len >= 5);
-    g_assert(msg[msg_len - 1] == 0xa0);
-    msg_len--;
-    g_assert(ipmb_checksum(msg, msg_len, 0) == 0);
-    msg_len--;
+    get_emu_cmd(msg, &msg_len);
     if ((msg[1] == get_dev_id_cmd[0]) && (msg[2] == get_dev_id_cmd[1])) {
-        memcpy(msg + 1, get_dev_id_rsp, sizeof(get_dev_id_rsp));
-        msg_len = sizeof(get_dev_id_rsp) + 1;
-        msg[msg_len] = -ipmb_checksum(msg, msg_len, 0);
-        msg_len++;
-        msg[msg_len++] = 0xa0;
-        write_emu_msg(msg, msg_len);
+        write_emu_rsp(msg[0], get_dev_id_rsp, sizeof(get_dev_id_rsp));
     } else if ((msg[1] == set_bmc_globals_cmd[0]) &&
                (msg[2] == set_bmc_globals_cmd[1])) {
-        memcpy(msg + 1, set_bmc_globals_rsp, sizeof(set_bmc_globals_rsp));
-        msg_len = sizeof(set_bmc_globals_rsp) + 1;
-        msg[msg_len] = -ipmb_checksum(msg, msg_len, 0);
-        msg_len++;
-        msg[msg_len++] = 0xa0;
-        write_emu_msg(msg, msg_len);
+        write_emu_rsp(msg[0], set_bmc_globals_rsp,
+                      sizeof(set_bmc_globals_rsp));
         write_emu_msg(enable_irq_cmd, sizeof(enable_irq_cmd));
     } else {
         g_assert(0);
     }
 }
 
-static void bt_cmd(uint8_t *cmd, unsigned int cmd_len,
-                    uint8_t *rsp, unsigned int *rsp_len)
+#define BT_SEQ 5
+
+static void bt_write_cmd(uint8_t *cmd, unsigned int cmd_len)
 {
-    unsigned int i, len, j = 0;
-    uint8_t seq = 5;
+    unsigned int i;
 
     /* Should be idle */
     g_assert(bt_get_ctrlreg() == 0);
@@ -266,13 +290,16 @@ static void bt_cmd(uint8_t *cmd, unsigned int cmd_len,
     IPMI_BT_CTLREG_SET_CLR_WR_PTR();
     bt_write_buf(cmd_len + 1);
     bt_write_buf(cmd[0]);
-    bt_write_buf(seq);
+    bt_write_buf(BT_SEQ);
     for (i = 1; i < cmd_len; i++) {
         bt_write_buf(cmd[i]);
     }
     IPMI_BT_CTLREG_SET_H2B_ATN();
+}
 
-    emu_msg_handler(); /* We should get a message on the socket here. */
+static void bt_read_rsp(uint8_t *rsp, unsigned int *rsp_len)
+{
+    unsigned int len, j = 0;
 
     bt_wait_b2h_atn();
     if (bt_ints_enabled) {
@@ -288,7 +315,7 @@ static void bt_cmd(uint8_t *cmd, unsigned int cmd_len,
     len = bt_get_buf();
     g_assert(len >= 4);
     rsp[0] = bt_get_buf();
-    assert(bt_get_buf() == seq);
+    assert(bt_get_buf() == BT_SEQ);
     len--;
     for (j = 1; j < len; j++) {
         rsp[j] = bt_get_buf();
@@ -297,6 +324,14 @@ static void bt_cmd(uint8_t *cmd, unsigned int cmd_len,
     *rsp_len = j;
 }
 
+static void bt_cmd(uint8_t *cmd, unsigned int cmd_len,
+                    uint8_t *rsp, unsigned int *rsp_len)
+{
+    bt_write_cmd(cmd, cmd_len);
+    emu_msg_handler(); /* We should get a message on the socket here. */
+    bt_read_rsp(rsp, rsp_len);
+}
+
 
 /*
  * We should get a connect request and a short message with capabilities.
@@ -370,6 +405,151 @@ static void test_enable_irq(void)
     bt_ints_enabled = 1;
 }
 
+/* ipmi-bmc-extern gives the external BMC 4 seconds to answer */
+#define EXTERN_RSP_TIMEOUT_NS 4000000000LL
+
+static uint8_t get_dev_id_timeout_rsp[] = { 0x1c, 0x01, 0xc3 };
+
+/*
+ * Send a command the BMC never answers, it must fail with a timeout once
+ * its own deadline has passed, and not before.
+ */
+static void test_bt_timeout(void)
+{
+    uint8_t msg[100], rsp[20];
+    unsigned int msg_len = sizeof(msg), rsplen = sizeof(rsp);
+
+    bt_write_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd));
+    get_emu_cmd(msg, &msg_len);
+
+    clock_step(EXTERN_RSP_TIMEOUT_NS - 1000000);
+    g_assert(!IPMI_BT_CTLREG_GET_B2H_ATN());
+    clock_step(2000000);
+
+    bt_read_rsp(rsp, &rsplen);
+    g_assert(rsplen == sizeof(get_dev_id_timeout_rsp));
+    g_assert(memcmp(get_dev_id_timeout_rsp, rsp, rsplen) == 0);
+}
+
+/*
+ * Responses are matched by message ID, not by arrival order: a late
+ * response to a message that already timed out is dropped even when it
+ * arrives ahead of the response the interface is waiting for.
+ */
+static void test_bt_out_of_order(void)
+{
+    uint8_t stale[100], msg[100], rsp[20];
+    unsigned int stale_len = sizeof(stale), msg_len = sizeof(msg);
+    unsigned int rsplen = sizeof(rsp);
+    static uint8_t stale_rsp[] = { 0x1c, 0x01, 0xff };
+
+    bt_write_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd));
+    get_emu_cmd(stale, &stale_len);
+    clock_step(EXTERN_RSP_TIMEOUT_NS + 1000000);
+    bt_read_rsp(rsp, &rsplen);
+    g_assert(memcmp(get_dev_id_timeout_rsp, rsp, rsplen) == 0);
+
+    bt_write_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd));
+    get_emu_cmd(msg, &msg_len);
+    g_assert(msg[0] != stale[0]);
+
+    write_emu_rsp(stale[0], stale_rsp, sizeof(stale_rsp));
+    write_emu_rsp(msg[0], get_dev_id_rsp, sizeof(get_dev_id_rsp));
+
+    rsplen = sizeof(rsp);
+    bt_read_rsp(rsp, &rsplen);
+    g_assert(rsplen == sizeof(get_dev_id_rsp));
+    g_assert(memcmp(get_dev_id_rsp, rsp, rsplen) == 0);
+
+    /* Nothing else may show up, the next command must find BT idle */
+    test_bt_base();
+}
+
+static bool migration_completed(QTestState *s)
+{
+    QDict *rsp, *ret;
+    const char *status;
+    bool completed;
+
+    rsp = qtest_qmp(s, "{ 'execute': 'query-migrate' }");
+    g_assert(!qdict_haskey(rsp, "error"));
+    ret = qdict_get_qdict(rsp, "return");
+    status = qdict_get_try_str(ret, "status");
+    g_assert_cmpstr(status, !=, "failed");
+    completed = status && !strcmp(status, "completed");
+    QDECREF(rsp);
+    return completed;
+}
+
+static char *qemu_cmdline;
+
+/*
+ * Migrate while a message is waiting for the external BMC.  The
+ * destination must fail that very message, so the interface on the
+ * other side takes the error instead of waiting forever.
+ */
+static void test_bt_migrate(void)
+{
+    QTestState *from = global_qtest, *to;
+    uint8_t msg[100], rsp[20];
+    unsigned int msg_len = sizeof(msg), rsplen = sizeof(rsp);
+    unsigned int count = 1000;
+    char *args, *uri;
+    /* IPMI_CC_BMC_INIT_IN_PROGRESS */
+    static uint8_t get_dev_id_mig_rsp[] = { 0x1c, 0x01, 0xd2 };
+
+    bt_write_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd));
+    get_emu_cmd(msg, &msg_len);
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", 40000 + getpid() % 10000);
+    args = g_strdup_printf("%s -incoming defer", qemu_cmdline);
+    to = qtest_init(args);
+    g_free(args);
+    qtest_irq_intercept_in(to, "ioapic");
+    QDECREF(qtest_qmp(to, "{ 'execute': 'migrate-incoming',"
+                          "  'arguments': { 'uri': %s } }", uri));
+    QDECREF(qtest_qmp(from, "{ 'execute': 'migrate',"
+                            "  'arguments': { 'uri': %s } }", uri));
+    while (!migration_completed(from)) {
+        g_usleep(1000);
+    }
+    g_free(uri);
+    qtest_quit(from);
+
+    /* The error is sent once the destination runs */
+    global_qtest = to;
+    while (IPMI_BT_CTLREG_GET_B2H_ATN() == 0) {
+        g_assert(--count != 0);
+        clock_step(1000000);
+    }
+    bt_read_rsp(rsp, &rsplen);
+    g_assert(rsplen == sizeof(get_dev_id_mig_rsp));
+    g_assert(memcmp(get_dev_id_mig_rsp, rsp, rsplen) == 0);
+}
+
+/*
+ * Measure how many commands per second make it through the interface
+ * and the external BMC transport, with this test acting as the BMC.
+ */
+static void test_bt_perf(void)
+{
+    uint8_t rsp[20];
+    unsigned int rsplen;
+    unsigned int i, count = 5000;
+    double elapsed;
+
+    g_test_timer_start();
+    for (i = 0; i < count; i++) {
+        rsplen = sizeof(rsp);
+        bt_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd), rsp, &rsplen);
+        g_assert(rsplen == sizeof(get_dev_id_rsp));
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("bt/extern: %u commands in %.3f s, %.0f commands/s",
+                   count, elapsed, count / elapsed);
+}
+
 /*
  * Create a local TCP socket with any port, then save off the port we got.
  */
@@ -402,7 +582,6 @@ static void open_socket(void)
 int main(int argc, char **argv)
 {
     const char *arch = qtest_get_arch();
-    char *cmdline;
     int ret;
 
     /* Check architecture */
@@ -416,18 +595,26 @@ int main(int argc, char **argv)
     /* Run the tests */
     g_test_init(&argc, &argv, NULL);
 
-    cmdline = g_strdup_printf("-vnc none"
+    qemu_cmdline = g_strdup_printf("-vnc none"
           " -chardev socket,id=ipmi0,host=localhost,port=%d,reconnect=10"
           " -device ipmi-bmc-extern,chardev=ipmi0,id=bmc0"
           " -device isa-ipmi-bt,bmc=bmc0", emu_port);
-    qtest_start(cmdline);
+    qtest_start(qemu_cmdline);
     qtest_irq_intercept_in(global_qtest, "ioapic");
     qtest_add_func("/ipmi/extern/connect", test_connect);
     qtest_add_func("/ipmi/extern/bt_base", test_bt_base);
     qtest_add_func("/ipmi/extern/bt_enable_irq", test_enable_irq);
     qtest_add_func("/ipmi/extern/bt_base_irq", test_bt_base);
+    qtest_add_func("/ipmi/extern/bt_timeout", test_bt_timeout);
+    qtest_add_func("/ipmi/extern/bt_out_of_order", test_bt_out_of_order);
+    if (g_test_perf()) {
+        qtest_add_func("/ipmi/extern/bt_perf", test_bt_perf);
+    }
+    /* Leaves the destination as global_qtest, keep it last */
+    qtest_add_func("/ipmi/extern/bt_migrate", test_bt_migrate);
     ret = g_test_run();
     qtest_quit(global_qtest);
+    g_free(qemu_cmdline);
 
     return ret;
 }
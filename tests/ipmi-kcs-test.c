@@ -245,6 +245,47 @@ static void test_kcs_abort(void)
     g_assert(rsp[0] == IPMI_KCS_ABORTED_BY_CMD);
 }
 
+static uint8_t get_sdr_cmd[] = { 0x28, 0x23, 0x00, 0x00, 0xff, 0xff,
+                                 0x00, 0xff };
+static uint8_t add_sel_cmd[] = { 0x28, 0x44, 0x00, 0x00, 0x02, 0x00, 0x00,
+                                 0x00, 0x00, 0x20, 0x00, 0x04, 0x01, 0x02,
+                                 0x6f, 0xa1, 0xa2, 0xa3 };
+static uint8_t get_sel_cmd[] = { 0x28, 0x43, 0x00, 0x00, 0x00, 0x00,
+                                 0x00, 0xff };
+
+/*
+ * Fetch the last (and only) SDR, then add a SEL entry and read it back.
+ */
+static void test_kcs_sdr_sel(void)
+{
+    uint8_t rsp[64];
+    unsigned int rsplen = sizeof(rsp);
+
+    kcs_cmd(get_sdr_cmd, sizeof(get_sdr_cmd), rsp, &rsplen);
+    g_assert(rsplen > 9);
+    g_assert(rsp[2] == 0x00);
+    /* No next record, this is the watchdog sensor with record ID 0 */
+    g_assert(rsp[3] == 0xff && rsp[4] == 0xff);
+    g_assert(rsp[5] == 0x00 && rsp[6] == 0x00);
+    g_assert(rsp[7] == 0x51 && rsp[8] == 0x02);
+    g_assert(rsplen == 5 + 5 + rsp[9]);
+
+    rsplen = sizeof(rsp);
+    kcs_cmd(add_sel_cmd, sizeof(add_sel_cmd), rsp, &rsplen);
+    g_assert(rsplen == 5);
+    g_assert(rsp[2] == 0x00);
+
+    get_sel_cmd[4] = rsp[3];
+    get_sel_cmd[5] = rsp[4];
+    rsplen = sizeof(rsp);
+    kcs_cmd(get_sel_cmd, sizeof(get_sel_cmd), rsp, &rsplen);
+    g_assert(rsplen == 5 + 16);
+    g_assert(rsp[2] == 0x00);
+    g_assert(rsp[5] == get_sel_cmd[4] && rsp[6] == get_sel_cmd[5]);
+    /* Everything after the timestamp comes back as written */
+    g_assert(memcmp(rsp + 5 + 7, add_sel_cmd + 2 + 7, 9) == 0);
+}
+
 static uint8_t set_bmc_globals_cmd[] = { 0x18, 0x2e, 0x0f };
 static uint8_t set_bmc_globals_rsp[] = { 0x1c, 0x2e, 0x00 };
 
@@ -262,6 +303,30 @@ static void test_enable_irq(void)
     kcs_ints_enabled = 1;
 }
 
+/*
+ * Measure how many commands per second a guest can push through the
+ * KCS interface.  Every command here is a full handshake: one port access
+ * per data byte, plus the status polling in between.
+ */
+static void test_kcs_perf(void)
+{
+    uint8_t rsp[20];
+    unsigned int rsplen;
+    unsigned int i, count = 20000;
+    double elapsed;
+
+    g_test_timer_start();
+    for (i = 0; i < count; i++) {
+        rsplen = sizeof(rsp);
+        kcs_cmd(get_dev_id_cmd, sizeof(get_dev_id_cmd), rsp, &rsplen);
+        g_assert(rsplen == sizeof(get_dev_id_rsp));
+    }
+    elapsed = g_test_timer_elapsed();
+
+    g_test_message("kcs: %u commands in %.3f s, %.0f commands/s",
+                   count, elapsed, count / elapsed);
+}
+
 int main(int argc, char **argv)
 {
     const char *arch = qtest_get_arch();
@@ -283,9 +348,13 @@ int main(int argc, char **argv)
     qtest_irq_intercept_in(global_qtest, "ioapic");
     qtest_add_func("/ipmi/local/kcs_base", test_kcs_base);
     qtest_add_func("/ipmi/local/kcs_abort", test_kcs_abort);
+    qtest_add_func("/ipmi/local/kcs_sdr_sel", test_kcs_sdr_sel);
     qtest_add_func("/ipmi/local/kcs_enable_irq", test_enable_irq);
     qtest_add_func("/ipmi/local/kcs_base_irq", test_kcs_base);
     qtest_add_func("/ipmi/local/kcs_abort_irq", test_kcs_abort);
+    if (g_test_perf()) {
+        qtest_add_func("/ipmi/local/kcs_perf", test_kcs_perf);
+    }
     ret = g_test_run();
     qtest_quit(global_qtest);
 
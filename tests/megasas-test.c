@@ -0,0 +1,422 @@
+/*
+ * QTest testcase for LSI MegaRAID
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+
+#define TEST_IMAGE_SIZE             (64 * 1024 * 1024)
+#define MEGASAS_TEST_TIMEOUT_US     (30 * 1000 * 1000)
+#define MEGASAS_TEST_CMDS           512
+#define MEGASAS_TEST_PERF_IOS       8192
+#define MEGASAS_SECTOR_LEN          512
+
+/* Frames are mapped in 1k chunks by the device, keep them apart */
+#define MEGASAS_FRAME_STRIDE        1024
+
+#define MFI_IQP                     0x40
+#define MFI_OSTS                    0x30
+#define MFI_OMSK                    0x34
+#define MFI_ODCR0                   0xa0
+
+#define MFI_CMD_INIT                0x00
+#define MFI_CMD_LD_READ             0x01
+#define MFI_CMD_LD_WRITE            0x02
+#define MFI_STAT_OK                 0x00
+#define MFI_STAT_PENDING            0xff
+
+typedef struct MegasasTestState {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    void *bar;
+    QGuestAllocator *alloc;
+    uint64_t frames;
+    uint64_t data;
+    uint64_t reply_queue;
+    uint64_t producer;
+    uint64_t consumer;
+    uint32_t consumer_idx;
+} MegasasTestState;
+
+static char *drive_create(void)
+{
+    int fd, ret;
+    char *tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return tmp_path;
+}
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
+}
+
+static uint64_t megasas_frame_addr(MegasasTestState *s, uint32_t slot)
+{
+    return s->frames + slot * MEGASAS_FRAME_STRIDE;
+}
+
+static uint64_t megasas_data_addr(MegasasTestState *s, uint32_t slot)
+{
+    return s->data + slot * MEGASAS_SECTOR_LEN;
+}
+
+static uint8_t megasas_frame_status(MegasasTestState *s, uint32_t slot)
+{
+    return readb(megasas_frame_addr(s, slot) + 2);
+}
+
+/* Wait for a frame that completes without posting a reply */
+static uint8_t megasas_poll_status(MegasasTestState *s, uint32_t slot)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint8_t status;
+
+    while ((status = megasas_frame_status(s, slot)) == MFI_STAT_PENDING) {
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <=
+                 MEGASAS_TEST_TIMEOUT_US);
+    }
+    return status;
+}
+
+/* Write a frame with a 32-bit context into @slot and post it */
+static void megasas_submit(MegasasTestState *s, uint32_t slot, uint32_t *frame)
+{
+    uint64_t addr = megasas_frame_addr(s, slot);
+
+    frame[0] |= MFI_STAT_PENDING << 16;
+    frame[2] = slot;
+    frame[3] = 0;
+    memwrite(addr, frame, 64);
+    qpci_io_writel(s->dev, s->bar + MFI_IQP, addr);
+}
+
+/* Wait for the next reply and return the slot of the completed frame */
+static uint32_t megasas_wait(MegasasTestState *s)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t slot;
+
+    while (readl(s->producer) == s->consumer_idx) {
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <=
+                 MEGASAS_TEST_TIMEOUT_US);
+    }
+
+    slot = readl(s->reply_queue + s->consumer_idx * 4);
+    s->consumer_idx = (s->consumer_idx + 1) % MEGASAS_TEST_CMDS;
+    writel(s->consumer, s->consumer_idx);
+    g_assert_cmpuint(slot, <, MEGASAS_TEST_CMDS);
+
+    return slot;
+}
+
+static void megasas_submit_io(MegasasTestState *s, uint32_t slot,
+                              uint8_t opcode, uint32_t lba)
+{
+    uint32_t frame[16] = { 0 };
+
+    frame[0] = opcode;
+    frame[1] = 10 << 16 | 1 << 24;     /* cdb_len, sge_count */
+    frame[5] = 1;                       /* data_len in blocks */
+    frame[8] = lba;
+    frame[10] = megasas_data_addr(s, slot);
+    frame[11] = MEGASAS_SECTOR_LEN;
+    megasas_submit(s, slot, frame);
+}
+
+static uint8_t megasas_io(MegasasTestState *s, uint8_t opcode, uint32_t lba)
+{
+    megasas_submit_io(s, 0, opcode, lba);
+    g_assert_cmpuint(megasas_wait(s), ==, 0);
+    return megasas_frame_status(s, 0);
+}
+
+static MegasasTestState *megasas_test_start(const char *drive,
+                                            const char *props)
+{
+    MegasasTestState *s = g_new0(MegasasTestState, 1);
+    uint32_t frame[16] = { 0 };
+    uint32_t qinfo[8] = { 0 };
+    uint64_t qinfo_addr;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device megasas,id=scsi0,max_cmds=%d%s "
+                              "-device scsi-hd,drive=drv0,bus=scsi0.0",
+                              drive, MEGASAS_TEST_CMDS, props);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    s->bus = qpci_init_pc();
+    qpci_device_foreach(s->bus, 0x1000, 0x0060, save_fn, &s->dev);
+    g_assert(s->dev != NULL);
+    s->bar = qpci_iomap(s->dev, 2, NULL);
+    qpci_device_enable(s->dev);
+    s->alloc = pc_alloc_init();
+
+    s->frames = guest_alloc(s->alloc,
+                            MEGASAS_TEST_CMDS * MEGASAS_FRAME_STRIDE);
+    s->data = guest_alloc(s->alloc, MEGASAS_TEST_CMDS * MEGASAS_SECTOR_LEN);
+    s->reply_queue = guest_alloc(s->alloc, MEGASAS_TEST_CMDS * 4);
+    s->producer = guest_alloc(s->alloc, 4);
+    s->consumer = guest_alloc(s->alloc, 4);
+    writel(s->producer, 0);
+    writel(s->consumer, 0);
+
+    qinfo[1] = MEGASAS_TEST_CMDS;
+    qinfo[2] = s->reply_queue;
+    qinfo[3] = s->reply_queue >> 32;
+    qinfo[4] = s->producer;
+    qinfo[5] = s->producer >> 32;
+    qinfo[6] = s->consumer;
+    qinfo[7] = s->consumer >> 32;
+    qinfo_addr = guest_alloc(s->alloc, sizeof(qinfo));
+    memwrite(qinfo_addr, qinfo, sizeof(qinfo));
+
+    /* Interrupts are still masked, so this completes without a reply */
+    frame[0] = MFI_CMD_INIT;
+    frame[6] = qinfo_addr;
+    frame[7] = qinfo_addr >> 32;
+    megasas_submit(s, 0, frame);
+    g_assert_cmphex(megasas_poll_status(s, 0), ==, MFI_STAT_OK);
+
+    qpci_io_writel(s->dev, s->bar + MFI_OMSK, 0);
+
+    return s;
+}
+
+static void megasas_test_end(MegasasTestState *s)
+{
+    pc_alloc_uninit(s->alloc);
+    qpci_iounmap(s->dev, s->bar);
+    g_free(s->dev);
+    qpci_free_pc(s->bus);
+    qtest_end();
+    g_free(s);
+}
+
+static void test_rw(gconstpointer data)
+{
+    char *tmp_path = drive_create();
+    MegasasTestState *s = megasas_test_start(tmp_path, data);
+    uint8_t *buf = g_malloc(MEGASAS_SECTOR_LEN);
+    uint8_t *ref = g_malloc(MEGASAS_SECTOR_LEN);
+    uint64_t addr = megasas_data_addr(s, 0);
+
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    memset(ref, 0xa5, MEGASAS_SECTOR_LEN);
+    memwrite(addr, ref, MEGASAS_SECTOR_LEN);
+    g_assert_cmphex(megasas_io(s, MFI_CMD_LD_WRITE, 7), ==, MFI_STAT_OK);
+
+    qmemset(addr, 0, MEGASAS_SECTOR_LEN);
+    g_assert_cmphex(megasas_io(s, MFI_CMD_LD_READ, 7), ==, MFI_STAT_OK);
+    memread(addr, buf, MEGASAS_SECTOR_LEN);
+    g_assert(memcmp(buf, ref, MEGASAS_SECTOR_LEN) == 0);
+
+    g_free(buf);
+    g_free(ref);
+    megasas_test_end(s);
+}
+
+typedef struct MegasasTestConfig {
+    const char *path;
+    uint32_t depth;
+    const char *props;
+} MegasasTestConfig;
+
+#define MEGASAS_IOTHREAD_PROPS \
+    ",iothread=iothread0 -object iothread,id=iothread0"
+#define MEGASAS_INTC_PROPS ",intr_throttle_cnt=8,intr_throttle_timeout=100"
+
+static const MegasasTestConfig megasas_qd_configs[] = {
+    { "/megasas/qd/32", 32, "" },
+    { "/megasas/qd/256", 256, "" },
+    { "/megasas/qd/iothread/32", 32, MEGASAS_IOTHREAD_PROPS },
+    { "/megasas/intc/qd/5", 5, MEGASAS_INTC_PROPS },
+    { "/megasas/intc/qd/32", 32, MEGASAS_INTC_PROPS },
+    { "/megasas/intc/iothread/qd/32", 32,
+      MEGASAS_INTC_PROPS MEGASAS_IOTHREAD_PROPS },
+};
+
+/*
+ * Keep @depth reads in flight, which all need a frame lookup on completion.
+ * Every context must complete exactly once, so that the frames handed out
+ * after INIT are all distinct.
+ */
+static void test_queue_depth(gconstpointer data)
+{
+    const MegasasTestConfig *cfg = data;
+    char *tmp_path = drive_create();
+    MegasasTestState *s = megasas_test_start(tmp_path, cfg->props);
+    uint32_t depth = cfg->depth;
+    bool *done = g_new0(bool, depth);
+    uint32_t slot;
+    int i;
+
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    for (slot = 0; slot < depth; slot++) {
+        megasas_submit_io(s, slot, MFI_CMD_LD_READ, slot);
+    }
+    for (i = 0; i < depth; i++) {
+        slot = megasas_wait(s);
+        g_assert_cmpuint(slot, <, depth);
+        g_assert(!done[slot]);
+        done[slot] = true;
+        g_assert_cmphex(megasas_frame_status(s, slot), ==, MFI_STAT_OK);
+    }
+
+    /* Nothing else may be posted, not even by a coalescing timer */
+    clock_step(10 * 1000 * 1000);
+    g_assert_cmpuint(readl(s->producer), ==, s->consumer_idx);
+
+    g_free(done);
+    megasas_test_end(s);
+}
+
+/*
+ * Replies that complete while the reply interrupt is masked, with or without
+ * coalescing, must be signalled as soon as the guest unmasks it.
+ */
+static void test_intr_mask(gconstpointer data)
+{
+    char *tmp_path = drive_create();
+    MegasasTestState *s = megasas_test_start(tmp_path, data);
+    gint64 start_time;
+    uint32_t osts, slot;
+    int i;
+
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    /*
+     * Learn which status bits the controller raises for a reply; with an
+     * IOThread the interrupt may trail the reply.
+     */
+    g_assert_cmphex(megasas_io(s, MFI_CMD_LD_READ, 0), ==, MFI_STAT_OK);
+    start_time = g_get_monotonic_time();
+    while (!(osts = qpci_io_readl(s->dev, s->bar + MFI_OSTS))) {
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <=
+                 MEGASAS_TEST_TIMEOUT_US);
+    }
+    qpci_io_writel(s->dev, s->bar + MFI_ODCR0, 0);
+    g_assert_cmphex(qpci_io_readl(s->dev, s->bar + MFI_OSTS), ==, 0);
+
+    qpci_io_writel(s->dev, s->bar + MFI_OMSK, osts);
+    for (slot = 0; slot < 2; slot++) {
+        megasas_submit_io(s, slot, MFI_CMD_LD_READ, slot);
+    }
+
+    /* Both replies get posted, but leave them in the queue */
+    start_time = g_get_monotonic_time();
+    while (readl(s->producer) != s->consumer_idx + 2) {
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <=
+                 MEGASAS_TEST_TIMEOUT_US);
+    }
+    clock_step(10 * 1000 * 1000);
+    g_assert_cmphex(qpci_io_readl(s->dev, s->bar + MFI_OSTS), ==, 0);
+
+    qpci_io_writel(s->dev, s->bar + MFI_OMSK, 0);
+    g_assert_cmphex(qpci_io_readl(s->dev, s->bar + MFI_OSTS), ==, osts);
+
+    for (i = 0; i < 2; i++) {
+        slot = megasas_wait(s);
+        g_assert_cmpuint(slot, <, 2);
+        g_assert_cmphex(megasas_frame_status(s, slot), ==, MFI_STAT_OK);
+    }
+
+    megasas_test_end(s);
+}
+
+static const MegasasTestConfig megasas_perf_configs[] = {
+    { "/megasas/perf/qd1", 1, "" },
+    { "/megasas/perf/qd32", 32, "" },
+    { "/megasas/perf/qd256", 256, "" },
+    { "/megasas/perf/iothread/qd1", 1, MEGASAS_IOTHREAD_PROPS },
+    { "/megasas/perf/iothread/qd32", 32, MEGASAS_IOTHREAD_PROPS },
+    { "/megasas/perf/iothread/qd256", 256, MEGASAS_IOTHREAD_PROPS },
+    { "/megasas/perf/intc/qd32", 32, MEGASAS_INTC_PROPS },
+    { "/megasas/perf/intc/qd256", 256, MEGASAS_INTC_PROPS },
+};
+
+static void perf_read(gconstpointer data)
+{
+    const MegasasTestConfig *cfg = data;
+    MegasasTestState *s = megasas_test_start("null-co://", cfg->props);
+    uint32_t depth = cfg->depth;
+    uint32_t slot;
+    double duration;
+    int submitted, completed;
+
+    g_test_timer_start();
+    for (submitted = 0; submitted < depth; submitted++) {
+        megasas_submit_io(s, submitted, MFI_CMD_LD_READ, submitted);
+    }
+    for (completed = 0; completed < MEGASAS_TEST_PERF_IOS; completed++) {
+        slot = megasas_wait(s);
+        g_assert_cmphex(megasas_frame_status(s, slot), ==, MFI_STAT_OK);
+        if (submitted < MEGASAS_TEST_PERF_IOS) {
+            megasas_submit_io(s, slot, MFI_CMD_LD_READ, submitted++);
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%s: %d reads in %f s, %.0f IOPS, %.2f us/cmd",
+                   cfg->path, MEGASAS_TEST_PERF_IOS, duration,
+                   MEGASAS_TEST_PERF_IOS / duration,
+                   duration * 1e6 / MEGASAS_TEST_PERF_IOS);
+
+    megasas_test_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_data_func("/megasas/rw", "", test_rw);
+    qtest_add_data_func("/megasas/rw/iothread", MEGASAS_IOTHREAD_PROPS,
+                        test_rw);
+    qtest_add_data_func("/megasas/intr_mask", "", test_intr_mask);
+    qtest_add_data_func("/megasas/intc/intr_mask", MEGASAS_INTC_PROPS,
+                        test_intr_mask);
+    qtest_add_data_func("/megasas/intc/iothread/intr_mask",
+                        MEGASAS_INTC_PROPS MEGASAS_IOTHREAD_PROPS,
+                        test_intr_mask);
+    for (i = 0; i < ARRAY_SIZE(megasas_qd_configs); i++) {
+        qtest_add_data_func(megasas_qd_configs[i].path,
+                            &megasas_qd_configs[i], test_queue_depth);
+    }
+    if (g_test_perf()) {
+        for (i = 0; i < ARRAY_SIZE(megasas_perf_configs); i++) {
+            qtest_add_data_func(megasas_perf_configs[i].path,
+                                &megasas_perf_configs[i], perf_read);
+        }
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,385 @@
+/*
+ * QTest testcase for RAM migration over multiple channels (multifd), with
+ * compression and with automatic tuning, and for dirty rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include <glib.h>
+
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
+
+/* Guest RAM below this address is not all plain RAM on a PC */
+#define RAM_START       (1 << 20)
+#define CHUNK_SIZE      (1 << 20)
+/* Bandwidth while the guest keeps dirtying its RAM, in bytes per second */
+#define DIRTY_SPEED     (32 << 20)
+
+static int mig_port;
+
+static void qmp_ok(QDict *rsp)
+{
+    g_assert(rsp);
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+}
+
+static void set_multifd(QTestState *s, int channels)
+{
+    if (!channels) {
+        return;
+    }
+    qmp_ok(qtest_qmp(s, "{ 'execute': 'migrate-set-capabilities',"
+                        "  'arguments': { 'capabilities': ["
+                        "    { 'capability': 'x-multifd',"
+                        "      'state': true } ] } }"));
+    qmp_ok(qtest_qmp(s, "{ 'execute': 'migrate-set-parameters',"
+                        "  'arguments': { 'x-multifd-channels': %d } }",
+                     channels));
+}
+
+static void set_capability(QTestState *s, const char *cap)
+{
+    qmp_ok(qtest_qmp(s, "{ 'execute': 'migrate-set-capabilities',"
+                        "  'arguments': { 'capabilities': ["
+                        "    { 'capability': %s,"
+                        "      'state': true } ] } }", cap));
+}
+
+/* Returns false if the build does not support @method */
+static bool set_compress(QTestState *from, QTestState *to, const char *method)
+{
+    QDict *rsp;
+    bool supported;
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-parameters',"
+                          "  'arguments': { 'compress-method': %s } }",
+                    method);
+    g_assert(rsp);
+    supported = !qdict_haskey(rsp, "error");
+    QDECREF(rsp);
+    if (!supported) {
+        return false;
+    }
+
+    qmp_ok(qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                           "  'arguments': { 'capabilities': ["
+                           "    { 'capability': 'compress',"
+                           "      'state': true } ] } }"));
+    qmp_ok(qtest_qmp(to, "{ 'execute': 'migrate-set-capabilities',"
+                         "  'arguments': { 'capabilities': ["
+                         "    { 'capability': 'compress',"
+                         "      'state': true } ] } }"));
+    return true;
+}
+
+static bool query_status_is(QTestState *s, const char *cmd, const char *status)
+{
+    QDict *rsp, *ret;
+    bool found;
+
+    rsp = qtest_qmp(s, "{ 'execute': %s }", cmd);
+    g_assert(rsp);
+    g_assert(!qdict_haskey(rsp, "error"));
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(ret);
+    if (qdict_haskey(ret, "status")) {
+        g_assert_cmpstr(qdict_get_str(ret, "status"), !=, "failed");
+        found = !strcmp(qdict_get_str(ret, "status"), status);
+    } else {
+        found = false;
+    }
+    QDECREF(rsp);
+    return found;
+}
+
+static int64_t dirty_sync_count(QTestState *s)
+{
+    QDict *rsp, *ret;
+    int64_t count = 0;
+
+    rsp = qtest_qmp(s, "{ 'execute': 'query-migrate' }");
+    g_assert(rsp);
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(ret);
+    if (qdict_haskey(ret, "ram")) {
+        count = qdict_get_int(qdict_get_qdict(ret, "ram"), "dirty-sync-count");
+    }
+    QDECREF(rsp);
+    return count;
+}
+
+/* Whether the source reports XBZRLE statistics, i.e. XBZRLE is in use */
+static bool has_xbzrle_cache(QTestState *s)
+{
+    QDict *rsp, *ret;
+    bool found;
+
+    rsp = qtest_qmp(s, "{ 'execute': 'query-migrate' }");
+    g_assert(rsp);
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert(ret);
+    found = qdict_haskey(ret, "xbzrle-cache");
+    QDECREF(rsp);
+    return found;
+}
+
+static void set_speed(QTestState *s, int64_t speed)
+{
+    qmp_ok(qtest_qmp(s, "{ 'execute': 'migrate_set_speed',"
+                        "  'arguments': { 'value': %" PRId64 " } }",
+                     speed));
+}
+
+static uint8_t chunk_pattern(uint64_t addr)
+{
+    /* Never zero, so that every page goes through the channels */
+    return ((addr / CHUNK_SIZE) % 255) + 1;
+}
+
+/* Writing the same contents again still dirties every page */
+static void fill_ram(QTestState *s, uint64_t ram_end)
+{
+    uint64_t addr;
+
+    for (addr = RAM_START; addr < ram_end; addr += CHUNK_SIZE) {
+        qtest_memset(s, addr, chunk_pattern(addr), CHUNK_SIZE);
+        qtest_writeq(s, addr + CHUNK_SIZE / 2, addr);
+    }
+}
+
+/*
+ * Migrate a guest with @ram_mb of RAM from one QEMU to another over
+ * loopback TCP using @channels multifd channels (0 for the plain
+ * single stream) or compression with @compress (NULL for none), and
+ * return the time the migration took in seconds, or a negative value
+ * if the compression method is not supported.  @auto_tune sets the
+ * x-auto-tune capability on the source.  With @dirty_syncs, the guest
+ * RAM is dirtied over and over at limited bandwidth until the source
+ * synchronized its dirty bitmap that many times and, with @auto_tune,
+ * until auto-tuning switched XBZRLE on.
+ */
+static double migrate(int channels, const char *compress, bool auto_tune,
+                      int ram_mb, bool check, int dirty_syncs)
+{
+    QTestState *from, *to;
+    char *args, *uri;
+    uint64_t addr, ram_end = (uint64_t)ram_mb << 20;
+    double elapsed;
+
+    uri = g_strdup_printf("tcp:127.0.0.1:%d", mig_port++);
+    args = g_strdup_printf("-m %dM -nodefaults", ram_mb);
+    from = qtest_init(args);
+    g_free(args);
+    args = g_strdup_printf("-m %dM -nodefaults -incoming defer", ram_mb);
+    to = qtest_init(args);
+    g_free(args);
+
+    set_multifd(from, channels);
+    set_multifd(to, channels);
+    if (compress && !set_compress(from, to, compress)) {
+        qtest_quit(to);
+        qtest_quit(from);
+        g_free(uri);
+        return -1;
+    }
+    if (auto_tune) {
+        set_capability(from, "x-auto-tune");
+    }
+    qmp_ok(qtest_qmp(to, "{ 'execute': 'migrate-incoming',"
+                         "  'arguments': { 'uri': %s } }", uri));
+    set_speed(from, dirty_syncs ? DIRTY_SPEED : INT64_MAX);
+
+    fill_ram(from, ram_end);
+
+    g_test_timer_start();
+    qmp_ok(qtest_qmp(from, "{ 'execute': 'migrate',"
+                           "  'arguments': { 'uri': %s } }", uri));
+    while (!query_status_is(from, "query-migrate", "completed")) {
+        if (dirty_syncs) {
+            if (dirty_sync_count(from) >= dirty_syncs &&
+                (!auto_tune || has_xbzrle_cache(from))) {
+                /* Let it converge */
+                set_speed(from, INT64_MAX);
+                dirty_syncs = 0;
+            } else {
+                fill_ram(from, ram_end);
+            }
+        }
+        g_usleep(1000);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_assert_cmpint(dirty_syncs, ==, 0);
+
+    while (!query_status_is(to, "query-status", "running")) {
+        g_usleep(1000);
+    }
+
+    if (check) {
+        for (addr = RAM_START; addr < ram_end; addr += CHUNK_SIZE) {
+            g_assert_cmpint(qtest_readb(to, addr), ==, chunk_pattern(addr));
+            g_assert_cmpint(qtest_readb(to, addr + CHUNK_SIZE - 1), ==,
+                            chunk_pattern(addr));
+            g_assert_cmpint(qtest_readq(to, addr + CHUNK_SIZE / 2), ==, addr);
+        }
+    }
+
+    qtest_quit(to);
+    qtest_quit(from);
+    g_free(uri);
+    return elapsed;
+}
+
+static void test_multifd(void)
+{
+    migrate(2, NULL, false, 128, true, 0);
+}
+
+static void test_multifd_many_channels(void)
+{
+    migrate(8, NULL, false, 64, true, 0);
+}
+
+/* Every iteration ends with a sync of the channels */
+static void test_multifd_iterations(void)
+{
+    migrate(2, NULL, false, 32, true, 5);
+}
+
+static void test_compress(gconstpointer opaque)
+{
+    const char *method = opaque;
+
+    if (migrate(0, method, false, 64, true, 0) < 0) {
+        g_test_message("compression method %s not supported", method);
+    }
+}
+
+/*
+ * The guest outpaces the migration, so auto-tuning must take its first
+ * step, which is XBZRLE.  migrate() waits for it before letting the
+ * migration converge.
+ */
+static void test_auto_tune(void)
+{
+    migrate(0, "zlib", true, 32, true, 2);
+}
+
+/*
+ * Dirty the guest RAM while its dirty rate is being measured, and check
+ * that the sampled pages noticed.
+ */
+static void test_dirty_rate(void)
+{
+    QTestState *s;
+    QDict *rsp, *ret, *block;
+    QList *blocks;
+    QListEntry *entry;
+    bool found = false;
+    uint8_t pattern = 0;
+
+    s = qtest_init("-m 64M -nodefaults");
+
+    rsp = qtest_qmp(s, "{ 'execute': 'query-dirty-rate' }");
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert_cmpstr(qdict_get_str(ret, "status"), ==, "unstarted");
+    QDECREF(rsp);
+
+    qmp_ok(qtest_qmp(s, "{ 'execute': 'calc-dirty-rate',"
+                        "  'arguments': { 'calc-time': 1 } }"));
+    rsp = qtest_qmp(s, "{ 'execute': 'calc-dirty-rate',"
+                       "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+
+    /* The first hashing pass may still be running, so keep dirtying the
+     * RAM until the end of the measurement.  The contents must differ on
+     * every pass, otherwise the sampled pages hash the same as before. */
+    while (!query_status_is(s, "query-dirty-rate", "measured")) {
+        qtest_memset(s, RAM_START, ++pattern, (64 << 20) - RAM_START);
+        g_usleep(10 * 1000);
+    }
+
+    rsp = qtest_qmp(s, "{ 'execute': 'query-dirty-rate' }");
+    ret = qdict_get_qdict(rsp, "return");
+    g_assert_cmpint(qdict_get_int(ret, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(ret, "dirty-rate"), >, 0);
+    blocks = qdict_get_qlist(ret, "blocks");
+    QLIST_FOREACH_ENTRY(blocks, entry) {
+        block = qobject_to_qdict(qlist_entry_obj(entry));
+        if (!strcmp(qdict_get_str(block, "id"), "pc.ram")) {
+            g_assert_cmpint(qdict_get_int(block, "dirty-pages"), >, 0);
+            g_assert_cmpint(qdict_get_int(block, "dirty-pages"), <=,
+                            qdict_get_int(block, "sample-pages"));
+            found = true;
+        }
+    }
+    g_assert(found);
+    QDECREF(rsp);
+
+    qtest_quit(s);
+}
+
+/*
+ * Loopback throughput for the plain stream and for an increasing number
+ * of channels.
+ */
+static void test_multifd_perf(void)
+{
+    static const int channels[] = { 0, 1, 2, 4, 8 };
+    int ram_mb = 2048;
+    double elapsed;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(channels); i++) {
+        elapsed = migrate(channels[i], NULL, false, ram_mb, false, 0);
+        g_test_message("multifd: %d channels, %d MB in %.3f s, %.0f MB/s",
+                       channels[i], ram_mb, elapsed, ram_mb / elapsed);
+    }
+}
+
+/* Loopback throughput for each compression method */
+static void test_compress_perf(void)
+{
+    static const char *methods[] = { "zlib", "zstd", "lz4" };
+    int ram_mb = 2048;
+    double elapsed;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(methods); i++) {
+        elapsed = migrate(0, methods[i], false, ram_mb, false, 0);
+        if (elapsed < 0) {
+            continue;
+        }
+        g_test_message("compress: %s, %d MB in %.3f s, %.0f MB/s",
+                       methods[i], ram_mb, elapsed, ram_mb / elapsed);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    mig_port = 40000 + getpid() % 10000;
+
+    qtest_add_func("/migration/multifd/basic", test_multifd);
+    qtest_add_func("/migration/multifd/many_channels",
+                   test_multifd_many_channels);
+    qtest_add_func("/migration/multifd/iterations", test_multifd_iterations);
+    qtest_add_data_func("/migration/compress/zlib", "zlib", test_compress);
+    qtest_add_data_func("/migration/compress/zstd", "zstd", test_compress);
+    qtest_add_data_func("/migration/compress/lz4", "lz4", test_compress);
+    qtest_add_func("/migration/auto_tune", test_auto_tune);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
+    if (g_test_perf()) {
+        qtest_add_func("/migration/multifd/perf", test_multifd_perf);
+        qtest_add_func("/migration/compress/perf", test_compress_perf);
+    }
+
+    return g_test_run();
+}
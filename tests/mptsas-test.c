@@ -0,0 +1,244 @@
+/*
+ * QTest testcase for LSI SAS1068
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "hw/scsi/mpi.h"
+
+#define TEST_IMAGE_SIZE             (64 * 1024 * 1024)
+#define MPTSAS_TEST_TIMEOUT_US      (30 * 1000 * 1000)
+#define MPTSAS_SECTOR_LEN           512
+#define MPTSAS_REPLY_FRAME_SIZE     128
+#define MPTSAS_REPLY_FRAMES         4
+#define MPTSAS_IOC_STATE_MASK       0xf0000000
+
+/* A SCSI IO request followed by a single simple 32-bit SGE */
+typedef struct MptsasTestIO {
+    MPIMsgSCSIIORequest req;
+    uint32_t sge_flags_length;
+    uint32_t sge_addr;
+} QEMU_PACKED MptsasTestIO;
+
+typedef struct MptsasTestState {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    void *bar;
+    QGuestAllocator *alloc;
+    uint64_t request;
+    uint64_t data;
+    uint32_t msg_context;
+} MptsasTestState;
+
+static char *drive_create(void)
+{
+    int fd, ret;
+    char *tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return tmp_path;
+}
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
+}
+
+static uint32_t mptsas_readl(MptsasTestState *s, uint32_t reg)
+{
+    return qpci_io_readl(s->dev, s->bar + reg);
+}
+
+static void mptsas_writel(MptsasTestState *s, uint32_t reg, uint32_t val)
+{
+    qpci_io_writel(s->dev, s->bar + reg, val);
+}
+
+static uint32_t mptsas_state(MptsasTestState *s)
+{
+    return mptsas_readl(s, MPI_DOORBELL_OFFSET) & MPTSAS_IOC_STATE_MASK;
+}
+
+/*
+ * Send @msg through the doorbell handshake and return the function code
+ * of the reply, which is read back 16 bits at a time.
+ */
+static uint8_t mptsas_handshake(MptsasTestState *s, const void *msg,
+                                size_t size)
+{
+    const uint32_t *dwords = msg;
+    uint16_t reply[32];
+    int i, len;
+
+    g_assert_cmpuint(size % 4, ==, 0);
+    mptsas_writel(s, MPI_DOORBELL_OFFSET,
+                  (MPI_FUNCTION_HANDSHAKE << MPI_DOORBELL_FUNCTION_SHIFT) |
+                  ((size / 4) << MPI_DOORBELL_ADD_DWORDS_SHIFT));
+    g_assert(mptsas_readl(s, MPI_DOORBELL_OFFSET) & MPI_DOORBELL_ACTIVE);
+    mptsas_writel(s, MPI_HOST_INTERRUPT_STATUS_OFFSET, 0);
+
+    for (i = 0; i < size / 4; i++) {
+        mptsas_writel(s, MPI_DOORBELL_OFFSET, le32_to_cpu(dwords[i]));
+    }
+
+    g_assert(mptsas_readl(s, MPI_HOST_INTERRUPT_STATUS_OFFSET) &
+             MPI_HIS_DOORBELL_INTERRUPT);
+    reply[0] = mptsas_readl(s, MPI_DOORBELL_OFFSET);
+    reply[1] = mptsas_readl(s, MPI_DOORBELL_OFFSET);
+
+    /* MsgLength counts dwords */
+    len = (reply[1] & 0xff) * 2;
+    g_assert_cmpint(len, <=, ARRAY_SIZE(reply));
+    for (i = 2; i < len; i++) {
+        reply[i] = mptsas_readl(s, MPI_DOORBELL_OFFSET);
+    }
+    mptsas_writel(s, MPI_HOST_INTERRUPT_STATUS_OFFSET, 0);
+    g_assert(!(mptsas_readl(s, MPI_DOORBELL_OFFSET) & MPI_DOORBELL_ACTIVE));
+
+    return reply[1] >> 8;
+}
+
+static MptsasTestState *mptsas_test_start(const char *drive,
+                                          const char *props)
+{
+    MptsasTestState *s = g_new0(MptsasTestState, 1);
+    MPIMsgIOCInit init = { 0 };
+    uint64_t replies;
+    char *cmdline;
+    int i;
+
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device mptsas1068,id=scsi0%s "
+                              "-device scsi-hd,drive=drv0,bus=scsi0.0",
+                              drive, props);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    s->bus = qpci_init_pc();
+    qpci_device_foreach(s->bus, 0x1000, 0x0054, save_fn, &s->dev);
+    g_assert(s->dev != NULL);
+    s->bar = qpci_iomap(s->dev, 1, NULL);
+    qpci_device_enable(s->dev);
+    s->alloc = pc_alloc_init();
+
+    s->request = guest_alloc(s->alloc, sizeof(MptsasTestIO));
+    s->data = guest_alloc(s->alloc, MPTSAS_SECTOR_LEN);
+    g_assert_cmphex(mptsas_state(s), ==, MPI_IOC_STATE_READY);
+
+    init.Function = MPI_FUNCTION_IOC_INIT;
+    init.WhoInit = MPI_WHOINIT_HOST_DRIVER;
+    init.ReplyFrameSize = cpu_to_le16(MPTSAS_REPLY_FRAME_SIZE);
+    g_assert_cmphex(mptsas_handshake(s, &init, sizeof(init)), ==,
+                    MPI_FUNCTION_IOC_INIT);
+    g_assert_cmphex(mptsas_state(s), ==, MPI_IOC_STATE_OPERATIONAL);
+
+    /* Successful I/O uses turbo replies, these only catch errors */
+    replies = guest_alloc(s->alloc,
+                          MPTSAS_REPLY_FRAMES * MPTSAS_REPLY_FRAME_SIZE);
+    for (i = 0; i < MPTSAS_REPLY_FRAMES; i++) {
+        mptsas_writel(s, MPI_REPLY_FREE_FIFO_OFFSET,
+                      replies + i * MPTSAS_REPLY_FRAME_SIZE);
+    }
+
+    return s;
+}
+
+static void mptsas_test_end(MptsasTestState *s)
+{
+    pc_alloc_uninit(s->alloc);
+    qpci_iounmap(s->dev, s->bar);
+    g_free(s->dev);
+    qpci_free_pc(s->bus);
+    qtest_end();
+    g_free(s);
+}
+
+/* Run a one-sector READ(10)/WRITE(10) and return the reply descriptor */
+static uint32_t mptsas_io(MptsasTestState *s, uint8_t opcode, uint32_t lba)
+{
+    gint64 start_time = g_get_monotonic_time();
+    MptsasTestIO io = { { 0 } };
+    uint32_t flags, reply;
+
+    flags = MPI_SGE_FLAGS_SIMPLE_ELEMENT | MPI_SGE_FLAGS_LAST_ELEMENT |
+            MPI_SGE_FLAGS_END_OF_BUFFER | MPI_SGE_FLAGS_END_OF_LIST;
+    io.req.Function = MPI_FUNCTION_SCSI_IO_REQUEST;
+    io.req.CDBLength = 10;
+    io.req.MsgContext = cpu_to_le32(++s->msg_context);
+    io.req.DataLength = cpu_to_le32(MPTSAS_SECTOR_LEN);
+    io.req.CDB[0] = opcode;
+    stl_be_p(&io.req.CDB[2], lba);
+    io.req.CDB[8] = 1;
+    if (opcode == 0x2a) {
+        io.req.Control = cpu_to_le32(MPI_SCSIIO_CONTROL_WRITE);
+        flags |= MPI_SGE_FLAGS_HOST_TO_IOC;
+    } else {
+        io.req.Control = cpu_to_le32(MPI_SCSIIO_CONTROL_READ);
+    }
+    io.sge_flags_length = cpu_to_le32(flags | MPTSAS_SECTOR_LEN);
+    io.sge_addr = cpu_to_le32(s->data);
+    memwrite(s->request, &io, sizeof(io));
+
+    mptsas_writel(s, MPI_REQUEST_POST_FIFO_OFFSET, s->request);
+    while ((reply = mptsas_readl(s, MPI_REPLY_POST_FIFO_OFFSET)) == -1) {
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <=
+                 MPTSAS_TEST_TIMEOUT_US);
+    }
+    g_assert_cmphex(mptsas_state(s), ==, MPI_IOC_STATE_OPERATIONAL);
+
+    return reply;
+}
+
+static void test_rw(gconstpointer data)
+{
+    char *tmp_path = drive_create();
+    MptsasTestState *s = mptsas_test_start(tmp_path, data);
+    uint8_t *buf = g_malloc(MPTSAS_SECTOR_LEN);
+    uint8_t *ref = g_malloc(MPTSAS_SECTOR_LEN);
+
+    unlink(tmp_path);
+    g_free(tmp_path);
+
+    /* A turbo reply is the bare message context */
+    memset(ref, 0xa5, MPTSAS_SECTOR_LEN);
+    memwrite(s->data, ref, MPTSAS_SECTOR_LEN);
+    g_assert_cmphex(mptsas_io(s, 0x2a, 7), ==, s->msg_context);
+
+    qmemset(s->data, 0, MPTSAS_SECTOR_LEN);
+    g_assert_cmphex(mptsas_io(s, 0x28, 7), ==, s->msg_context);
+    memread(s->data, buf, MPTSAS_SECTOR_LEN);
+    g_assert(memcmp(buf, ref, MPTSAS_SECTOR_LEN) == 0);
+
+    g_free(buf);
+    g_free(ref);
+    mptsas_test_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_data_func("/mptsas/rw", "", test_rw);
+    qtest_add_data_func("/mptsas/rw/iothread",
+                        ",iothread=iothread0 -object iothread,id=iothread0",
+                        test_rw);
+
+    return g_test_run();
+}
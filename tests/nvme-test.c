@@ -10,24 +10,580 @@
 #include "qemu/osdep.h"
 #include <glib.h>
 #include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+#include "hw/pci/pci_regs.h"
 
-/* Tests only initialization so far. TODO: Replace with functional tests */
-static void nop(void)
+#define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
+#define NVME_TEST_TIMEOUT_US    (30 * 1000 * 1000)
+#define NVME_TEST_QUEUE_ENTRIES 64
+#define NVME_TEST_PERF_IOS      4096
+#define NVME_LBA_SIZE           512
+/* Interrupt coalescing: entries per interrupt, and time in 100us units */
+#define NVME_TEST_INTC_THR      8
+#define NVME_TEST_INTC_TIME     255
+
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1c
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28
+#define NVME_REG_ACQ            0x30
+#define NVME_REG_DBS            0x1000
+
+#define NVME_CC_EN              (1 << 0)
+#define NVME_CC_IOSQES          (6 << 16)
+#define NVME_CC_IOCQES          (4 << 20)
+#define NVME_CSTS_RDY           (1 << 0)
+
+#define NVME_ADM_CREATE_SQ      0x01
+#define NVME_ADM_CREATE_CQ      0x05
+#define NVME_ADM_SET_FEATURES   0x09
+#define NVME_ADM_DBBUF_CONFIG   0x7c
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+#define NVME_FEAT_INTC          0x08
+
+#define NVME_CMD_FLAGS_SGL      (1 << 14)
+#define NVME_SGL_DATA_BLOCK     (0x0 << 28)
+#define NVME_SGL_LAST_SEGMENT   (0x3 << 28)
+
+typedef struct NvmeTestQueue {
+    uint64_t addr;
+    uint16_t qid;
+    uint16_t idx;
+    uint8_t  phase;
+} NvmeTestQueue;
+
+typedef struct NvmeTestState {
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    void *bar;
+    QGuestAllocator *alloc;
+    NvmeTestQueue asq;
+    NvmeTestQueue acq;
+    NvmeTestQueue sq;
+    NvmeTestQueue cq;
+    uint16_t cid;
+    uint64_t dbbuf_dbs;
+    uint64_t dbbuf_eis;
+    unsigned db_writes;
+    uint64_t msix_addr;
+} NvmeTestState;
+
+static char *drive_create(void)
+{
+    int fd, ret;
+    char *tmp_path = g_strdup("/tmp/qtest.XXXXXX");
+
+    /* Create a temporary raw image */
+    fd = mkstemp(tmp_path);
+    g_assert_cmpint(fd, >=, 0);
+    ret = ftruncate(fd, TEST_IMAGE_SIZE);
+    g_assert_cmpint(ret, ==, 0);
+    close(fd);
+
+    return tmp_path;
+}
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
 {
+    QPCIDevice **pdev = (QPCIDevice **) data;
+
+    *pdev = dev;
 }
 
-int main(int argc, char **argv)
+static void nvme_reg_writel(NvmeTestState *s, uint32_t reg, uint32_t val)
 {
-    int ret;
+    qpci_io_writel(s->dev, s->bar + reg, val);
+}
 
-    g_test_init(&argc, &argv, NULL);
-    qtest_add_func("/nvme/nop", nop);
+static uint32_t nvme_reg_readl(NvmeTestState *s, uint32_t reg)
+{
+    return qpci_io_readl(s->dev, s->bar + reg);
+}
+
+static void nvme_queue_init(NvmeTestState *s, NvmeTestQueue *q, uint16_t qid,
+                            size_t entry_size)
+{
+    q->addr = guest_alloc(s->alloc, NVME_TEST_QUEUE_ENTRIES * entry_size);
+    q->qid = qid;
+    q->idx = 0;
+    q->phase = 1;
+    qmemset(q->addr, 0, NVME_TEST_QUEUE_ENTRIES * entry_size);
+}
+
+static bool nvme_need_event(uint16_t event_idx, uint16_t new_idx,
+                            uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/* Ring a doorbell, going through the shadow doorbell buffer if enabled */
+static void nvme_ring_db(NvmeTestState *s, uint16_t qid, uint32_t db,
+                         uint16_t old_idx, uint16_t new_idx)
+{
+    uint32_t offset = (2 * qid + db) * 4;
+
+    if (qid && s->dbbuf_dbs) {
+        writel(s->dbbuf_dbs + offset, new_idx);
+        if (!nvme_need_event(readl(s->dbbuf_eis + offset), new_idx,
+                             old_idx)) {
+            return;
+        }
+    }
+    nvme_reg_writel(s, NVME_REG_DBS + offset, new_idx);
+    s->db_writes++;
+}
+
+static void nvme_submit(NvmeTestState *s, NvmeTestQueue *sq, uint32_t *cmd)
+{
+    uint16_t old_idx = sq->idx;
+
+    cmd[0] |= (uint32_t)s->cid++ << 16;
+    memwrite(sq->addr + sq->idx * 64, cmd, 64);
+    sq->idx = (sq->idx + 1) % NVME_TEST_QUEUE_ENTRIES;
+    nvme_ring_db(s, sq->qid, 0, old_idx, sq->idx);
+}
+
+static uint16_t nvme_wait(NvmeTestState *s, NvmeTestQueue *cq)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint16_t old_idx = cq->idx;
+    uint32_t dw3;
 
+    for (;;) {
+        dw3 = readl(cq->addr + cq->idx * 16 + 12);
+        if (((dw3 >> 16) & 1) == cq->phase) {
+            break;
+        }
+        clock_step_next();
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+    }
+
+    cq->idx++;
+    if (cq->idx == NVME_TEST_QUEUE_ENTRIES) {
+        cq->idx = 0;
+        cq->phase = !cq->phase;
+    }
+    nvme_ring_db(s, cq->qid, 1, old_idx, cq->idx);
+
+    return dw3 >> 17;
+}
+
+static uint16_t nvme_exec(NvmeTestState *s, NvmeTestQueue *sq,
+                          NvmeTestQueue *cq, uint32_t *cmd)
+{
+    nvme_submit(s, sq, cmd);
+    return nvme_wait(s, cq);
+}
+
+static uint16_t nvme_rw(NvmeTestState *s, uint8_t opcode, uint64_t slba,
+                        uint64_t buf)
+{
+    uint32_t cmd[16] = { 0 };
+
+    cmd[0] = opcode;
+    cmd[1] = 1;
+    cmd[6] = buf;
+    cmd[7] = buf >> 32;
+    cmd[10] = slba;
+    cmd[11] = slba >> 32;
+    return nvme_exec(s, &s->sq, &s->cq, cmd);
+}
+
+static NvmeTestState *nvme_test_start(const char *props)
+{
+    NvmeTestState *s = g_new0(NvmeTestState, 1);
+    uint32_t cmd[16] = { 0 };
+    uint64_t barsize;
+    char *tmp_path;
+    char *cmdline;
+
+    tmp_path = drive_create();
+    cmdline = g_strdup_printf("-drive id=drv0,if=none,file=%s,format=raw "
+                              "-device nvme,drive=drv0,serial=foo%s",
+                              tmp_path, props);
+    qtest_start(cmdline);
+    unlink(tmp_path);
+    g_free(tmp_path);
+    g_free(cmdline);
+
+    s->bus = qpci_init_pc();
+    qpci_device_foreach(s->bus, 0x8086, 0x5845, save_fn, &s->dev);
+    g_assert(s->dev != NULL);
+    s->bar = qpci_iomap(s->dev, 0, &barsize);
+    qpci_device_enable(s->dev);
+    s->alloc = pc_alloc_init();
+
+    nvme_queue_init(s, &s->asq, 0, 64);
+    nvme_queue_init(s, &s->acq, 0, 16);
+    nvme_queue_init(s, &s->sq, 1, 64);
+    nvme_queue_init(s, &s->cq, 1, 16);
+
+    nvme_reg_writel(s, NVME_REG_AQA, (NVME_TEST_QUEUE_ENTRIES - 1) |
+                    ((NVME_TEST_QUEUE_ENTRIES - 1) << 16));
+    nvme_reg_writel(s, NVME_REG_ASQ, s->asq.addr);
+    nvme_reg_writel(s, NVME_REG_ASQ + 4, s->asq.addr >> 32);
+    nvme_reg_writel(s, NVME_REG_ACQ, s->acq.addr);
+    nvme_reg_writel(s, NVME_REG_ACQ + 4, s->acq.addr >> 32);
+    nvme_reg_writel(s, NVME_REG_CC,
+                    NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+    g_assert(nvme_reg_readl(s, NVME_REG_CSTS) & NVME_CSTS_RDY);
+
+    cmd[0] = NVME_ADM_CREATE_CQ;
+    cmd[6] = s->cq.addr;
+    cmd[7] = s->cq.addr >> 32;
+    cmd[10] = s->cq.qid | ((NVME_TEST_QUEUE_ENTRIES - 1) << 16);
+    cmd[11] = 0x3;
+    g_assert_cmphex(nvme_exec(s, &s->asq, &s->acq, cmd), ==, 0);
+
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = NVME_ADM_CREATE_SQ;
+    cmd[6] = s->sq.addr;
+    cmd[7] = s->sq.addr >> 32;
+    cmd[10] = s->sq.qid | ((NVME_TEST_QUEUE_ENTRIES - 1) << 16);
+    cmd[11] = 0x1 | (s->cq.qid << 16);
+    g_assert_cmphex(nvme_exec(s, &s->asq, &s->acq, cmd), ==, 0);
+
+    return s;
+}
+
+static void nvme_test_end(NvmeTestState *s)
+{
+    pc_alloc_uninit(s->alloc);
+    qpci_iounmap(s->dev, s->bar);
+    g_free(s->dev);
+    qpci_free_pc(s->bus);
+    qtest_end();
+    g_free(s);
+}
+
+static void nop(void)
+{
     qtest_start("-drive id=drv0,if=none,file=/dev/null,format=raw "
                 "-device nvme,drive=drv0,serial=foo");
-    ret = g_test_run();
-
     qtest_end();
+}
+
+static void test_rw(gconstpointer data)
+{
+    NvmeTestState *s = nvme_test_start(data);
+    uint64_t buf = guest_alloc(s->alloc, NVME_LBA_SIZE);
+    char pattern[NVME_LBA_SIZE], result[NVME_LBA_SIZE];
+    int i;
+
+    for (i = 0; i < 2 * NVME_TEST_QUEUE_ENTRIES; i++) {
+        memset(pattern, i, sizeof(pattern));
+        memwrite(buf, pattern, sizeof(pattern));
+        g_assert_cmphex(nvme_rw(s, NVME_CMD_WRITE, i, buf), ==, 0);
+
+        qmemset(buf, 0xff, NVME_LBA_SIZE);
+        g_assert_cmphex(nvme_rw(s, NVME_CMD_READ, i, buf), ==, 0);
+        memread(buf, result, sizeof(result));
+        g_assert(memcmp(pattern, result, sizeof(result)) == 0);
+    }
+
+    nvme_test_end(s);
+}
+
+static void nvme_sgl_set(uint32_t *dw, uint64_t addr, uint32_t len,
+                         uint32_t type)
+{
+    dw[0] = addr;
+    dw[1] = addr >> 32;
+    dw[2] = len;
+    dw[3] = type;
+}
+
+static void test_sgl(void)
+{
+    NvmeTestState *s = nvme_test_start("");
+    uint64_t buf = guest_alloc(s->alloc, 2 * NVME_LBA_SIZE);
+    uint64_t seg = guest_alloc(s->alloc, 4096);
+    char pattern[NVME_LBA_SIZE], result[NVME_LBA_SIZE];
+    uint32_t cmd[16] = { 0 }, desc[8];
+
+    /* Write one LBA from a single data block descriptor */
+    memset(pattern, 0xa5, sizeof(pattern));
+    memwrite(buf, pattern, sizeof(pattern));
+    cmd[0] = NVME_CMD_WRITE | NVME_CMD_FLAGS_SGL;
+    cmd[1] = 1;
+    nvme_sgl_set(&cmd[6], buf, NVME_LBA_SIZE, NVME_SGL_DATA_BLOCK);
+    g_assert_cmphex(nvme_exec(s, &s->sq, &s->cq, cmd), ==, 0);
+
+    /* Read it back through a segment list with the two halves swapped */
+    qmemset(buf, 0, 2 * NVME_LBA_SIZE);
+    nvme_sgl_set(&desc[0], buf + NVME_LBA_SIZE, NVME_LBA_SIZE / 2,
+                 NVME_SGL_DATA_BLOCK);
+    nvme_sgl_set(&desc[4], buf, NVME_LBA_SIZE / 2, NVME_SGL_DATA_BLOCK);
+    memwrite(seg, desc, sizeof(desc));
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = NVME_CMD_READ | NVME_CMD_FLAGS_SGL;
+    cmd[1] = 1;
+    nvme_sgl_set(&cmd[6], seg, sizeof(desc), NVME_SGL_LAST_SEGMENT);
+    g_assert_cmphex(nvme_exec(s, &s->sq, &s->cq, cmd), ==, 0);
+    memread(buf + NVME_LBA_SIZE, result, NVME_LBA_SIZE / 2);
+    memread(buf, result + NVME_LBA_SIZE / 2, NVME_LBA_SIZE / 2);
+    g_assert(memcmp(pattern, result, sizeof(result)) == 0);
+
+    /* A data block shorter than the transfer must be rejected */
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = NVME_CMD_READ | NVME_CMD_FLAGS_SGL;
+    cmd[1] = 1;
+    nvme_sgl_set(&cmd[6], buf, NVME_LBA_SIZE / 2, NVME_SGL_DATA_BLOCK);
+    g_assert_cmphex(nvme_exec(s, &s->sq, &s->cq, cmd) & 0xff, ==, 0x0f);
+
+    /* PSDT 3 is reserved and must fail with Invalid Field */
+    memset(cmd, 0, sizeof(cmd));
+    cmd[0] = NVME_CMD_READ | (3 << 14);
+    cmd[1] = 1;
+    nvme_sgl_set(&cmd[6], buf, NVME_LBA_SIZE, NVME_SGL_DATA_BLOCK);
+    g_assert_cmphex(nvme_exec(s, &s->sq, &s->cq, cmd) & 0xff, ==, 0x02);
+
+    nvme_test_end(s);
+}
+
+/* Deliver MSI-X vector 0, which all queues use, as a write to guest RAM */
+static void nvme_msix_setup(NvmeTestState *s)
+{
+    void *entry;
+    uint32_t control;
+
+    qpci_msix_enable(s->dev);
+    s->msix_addr = guest_alloc(s->alloc, 4);
+    writel(s->msix_addr, 0);
+
+    entry = s->dev->msix_table;
+    qpci_io_writel(s->dev, entry + PCI_MSIX_ENTRY_LOWER_ADDR, s->msix_addr);
+    qpci_io_writel(s->dev, entry + PCI_MSIX_ENTRY_UPPER_ADDR,
+                   s->msix_addr >> 32);
+    qpci_io_writel(s->dev, entry + PCI_MSIX_ENTRY_DATA, 1);
+    control = qpci_io_readl(s->dev, entry + PCI_MSIX_ENTRY_VECTOR_CTRL);
+    qpci_io_writel(s->dev, entry + PCI_MSIX_ENTRY_VECTOR_CTRL,
+                   control & ~PCI_MSIX_ENTRY_CTRL_MASKBIT);
+}
+
+/* Returns whether an interrupt was delivered since the last call */
+static bool nvme_msix_fired(NvmeTestState *s)
+{
+    if (!readl(s->msix_addr)) {
+        return false;
+    }
+    writel(s->msix_addr, 0);
+    return true;
+}
+
+/* Interrupts may be raised from a bottom half, give them real time */
+static void nvme_msix_wait(NvmeTestState *s)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (!nvme_msix_fired(s)) {
+        g_assert(g_get_monotonic_time() - start_time <= NVME_TEST_TIMEOUT_US);
+        g_usleep(100);
+    }
+}
+
+/*
+ * Wait until @n entries past the head of @cq are posted, without consuming
+ * them, and advance the virtual clock in small steps only so that the
+ * aggregation timer cannot expire meanwhile.
+ */
+static void nvme_cq_poll(NvmeTestState *s, NvmeTestQueue *cq, int n)
+{
+    uint16_t idx = (cq->idx + n - 1) % NVME_TEST_QUEUE_ENTRIES;
+    uint8_t phase = idx < cq->idx ? !cq->phase : cq->phase;
+    int64_t start = clock_step(0), now = start;
+
+    while (((readl(cq->addr + idx * 16 + 12) >> 16) & 1) != phase) {
+        now = clock_step(1000);
+        g_assert_cmpint(now - start, <,
+                        NVME_TEST_INTC_TIME * 100 * 1000 / 2);
+    }
+}
+
+static void nvme_submit_read(NvmeTestState *s, uint64_t slba, uint64_t buf)
+{
+    uint32_t cmd[16] = { 0 };
+
+    cmd[0] = NVME_CMD_READ;
+    cmd[1] = 1;
+    cmd[6] = buf;
+    cmd[7] = buf >> 32;
+    cmd[10] = slba;
+    cmd[11] = slba >> 32;
+    nvme_submit(s, &s->sq, cmd);
+}
+
+static void test_intc(gconstpointer data)
+{
+    NvmeTestState *s = nvme_test_start(data);
+    uint64_t buf = guest_alloc(s->alloc, NVME_LBA_SIZE);
+    uint32_t cmd[16] = { 0 };
+    int i, j;
+
+    cmd[0] = NVME_ADM_SET_FEATURES;
+    cmd[10] = NVME_FEAT_INTC;
+    cmd[11] = (NVME_TEST_INTC_THR - 1) | (NVME_TEST_INTC_TIME << 8);
+    g_assert_cmphex(nvme_exec(s, &s->asq, &s->acq, cmd), ==, 0);
+
+    nvme_msix_setup(s);
+
+    /* A single completion is held back until the aggregation time */
+    nvme_submit_read(s, 0, buf);
+    nvme_cq_poll(s, &s->cq, 1);
+    for (i = 0; i < 100; i++) {
+        clock_step(1000);
+    }
+    g_assert(!nvme_msix_fired(s));
+    clock_step(NVME_TEST_INTC_TIME * 100 * 1000);
+    nvme_msix_wait(s);
+    g_assert_cmphex(nvme_wait(s, &s->cq), ==, 0);
+
+    /* Completions below the threshold are held, the last one of a batch
+     * raises the interrupt right away */
+    for (i = 0; i < NVME_TEST_QUEUE_ENTRIES; i += NVME_TEST_INTC_THR) {
+        for (j = 0; j < NVME_TEST_INTC_THR - 1; j++) {
+            nvme_submit_read(s, i + j, buf);
+        }
+        nvme_cq_poll(s, &s->cq, NVME_TEST_INTC_THR - 1);
+        for (j = 0; j < 100; j++) {
+            clock_step(1000);
+        }
+        g_assert(!nvme_msix_fired(s));
+
+        nvme_submit_read(s, i + NVME_TEST_INTC_THR - 1, buf);
+        nvme_cq_poll(s, &s->cq, NVME_TEST_INTC_THR);
+        nvme_msix_wait(s);
+
+        for (j = 0; j < NVME_TEST_INTC_THR; j++) {
+            g_assert_cmphex(nvme_wait(s, &s->cq), ==, 0);
+        }
+        /* Head doorbell writes notify while entries are left, drop those */
+        nvme_msix_fired(s);
+    }
+
+    nvme_test_end(s);
+}
+
+/*
+ * Queue up batches of commands and only ring when the device asks.  Returns
+ * the number of MMIO doorbell writes.
+ */
+static unsigned nvme_run_batches(NvmeTestState *s, uint64_t buf)
+{
+    uint32_t cmd[16];
+    unsigned db_writes = s->db_writes;
+    int i, j;
+
+    for (i = 0; i < NVME_TEST_QUEUE_ENTRIES; i += 8) {
+        for (j = 0; j < 8; j++) {
+            memset(cmd, 0, sizeof(cmd));
+            cmd[0] = NVME_CMD_READ;
+            cmd[1] = 1;
+            cmd[6] = buf;
+            cmd[7] = buf >> 32;
+            cmd[10] = i + j;
+            nvme_submit(s, &s->sq, cmd);
+        }
+        for (j = 0; j < 8; j++) {
+            g_assert_cmphex(nvme_wait(s, &s->cq), ==, 0);
+        }
+    }
+    return s->db_writes - db_writes;
+}
+
+static void test_dbbuf(void)
+{
+    NvmeTestState *s = nvme_test_start("");
+    uint64_t buf = guest_alloc(s->alloc, NVME_LBA_SIZE);
+    uint32_t cmd[16] = { 0 };
+    unsigned mmio_writes, dbbuf_writes;
+
+    /* Without shadow doorbells every submission and completion rings */
+    mmio_writes = nvme_run_batches(s, buf);
+    g_assert_cmpuint(mmio_writes, ==, 2 * NVME_TEST_QUEUE_ENTRIES);
+
+    s->dbbuf_dbs = guest_alloc(s->alloc, 4096);
+    s->dbbuf_eis = guest_alloc(s->alloc, 4096);
+    qmemset(s->dbbuf_dbs, 0, 4096);
+    qmemset(s->dbbuf_eis, 0, 4096);
+
+    cmd[0] = NVME_ADM_DBBUF_CONFIG;
+    cmd[6] = s->dbbuf_dbs;
+    cmd[7] = s->dbbuf_dbs >> 32;
+    cmd[8] = s->dbbuf_eis;
+    cmd[9] = s->dbbuf_eis >> 32;
+    g_assert_cmphex(nvme_exec(s, &s->asq, &s->acq, cmd), ==, 0);
+
+    /* The shadow doorbells must spare some of the MMIO writes */
+    dbbuf_writes = nvme_run_batches(s, buf);
+    g_assert_cmpuint(dbbuf_writes, <, mmio_writes);
+    g_test_message("%d commands, %u doorbell writes, %u without dbbuf",
+                   NVME_TEST_QUEUE_ENTRIES, dbbuf_writes, mmio_writes);
+
+    nvme_test_end(s);
+}
+
+static int cmp_latency(const void *a, const void *b)
+{
+    gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void perf_qd1_read(gconstpointer data)
+{
+    NvmeTestState *s = nvme_test_start(data);
+    uint64_t buf = guest_alloc(s->alloc, NVME_LBA_SIZE);
+    gint64 *lat = g_new(gint64, NVME_TEST_PERF_IOS);
+    double duration;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < NVME_TEST_PERF_IOS; i++) {
+        gint64 start = g_get_monotonic_time();
+
+        g_assert_cmphex(nvme_rw(s, NVME_CMD_READ, i, buf), ==, 0);
+        lat[i] = g_get_monotonic_time() - start;
+    }
+    duration = g_test_timer_elapsed();
+
+    qsort(lat, NVME_TEST_PERF_IOS, sizeof(*lat), cmp_latency);
+    g_test_message("nvme%s: %d reads in %f s, %.0f IOPS, "
+                   "p50 %" PRId64 " us, p99 %" PRId64 " us",
+                   (const char *)data, NVME_TEST_PERF_IOS, duration,
+                   NVME_TEST_PERF_IOS / duration,
+                   lat[NVME_TEST_PERF_IOS / 2],
+                   lat[NVME_TEST_PERF_IOS * 99 / 100]);
+
+    g_free(lat);
+    nvme_test_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/nvme/nop", nop);
+    qtest_add_data_func("/nvme/rw/timer", "", test_rw);
+    qtest_add_data_func("/nvme/rw/timer-free", ",timer-free=on", test_rw);
+    qtest_add_data_func("/nvme/rw/iothread",
+                        ",iothread=iothread0 -object iothread,id=iothread0",
+                        test_rw);
+    qtest_add_func("/nvme/dbbuf", test_dbbuf);
+    qtest_add_func("/nvme/sgl", test_sgl);
+    qtest_add_data_func("/nvme/intc/timer", "", test_intc);
+    qtest_add_data_func("/nvme/intc/timer-free", ",timer-free=on", test_intc);
+    if (g_test_perf()) {
+        qtest_add_data_func("/nvme/perf/timer", "", perf_qd1_read);
+        qtest_add_data_func("/nvme/perf/timer-free", ",timer-free=on",
+                            perf_qd1_read);
+        qtest_add_data_func("/nvme/perf/iothread",
+                            ",iothread=iothread0 -object iothread,id=iothread0",
+                            perf_qd1_read);
+    }
 
-    return ret;
+    return g_test_run();
 }
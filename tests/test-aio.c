@@ -449,6 +449,75 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+#ifndef _WIN32
+typedef struct {
+    EventNotifier e;
+    int reads;      /* number of io_read() calls */
+    int polls;      /* number of io_poll() calls */
+    int ready;      /* io_poll() makes progress from this call on */
+} PollTestData;
+
+static void poll_test_read_cb(EventNotifier *e)
+{
+    PollTestData *data = container_of(e, PollTestData, e);
+    g_assert(event_notifier_test_and_clear(e));
+    data->reads++;
+}
+
+static bool poll_test_poll_cb(void *opaque)
+{
+    PollTestData *data = container_of(opaque, PollTestData, e);
+    return ++data->polls >= data->ready;
+}
+
+static void test_poll(void)
+{
+    PollTestData data = { .reads = 0, .polls = 0, .ready = INT_MAX };
+
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier_poll(ctx, &data.e, false,
+                                poll_test_read_cb, poll_test_poll_cb);
+    aio_context_set_poll_params(ctx, 1000000000LL, 0, 0, &error_abort);
+    g_assert_cmpint(ctx->poll_disable_cnt, ==, 0);
+
+    /* No polling yet, but a short wait starts the polling time */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 1);
+    g_assert_cmpint(data.polls, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, ==, 4000);
+
+    /* Polling times out, the event is then picked up by ppoll/epoll */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 2);
+    g_assert_cmpint(data.polls, >, 0);
+    g_assert_cmpint(ctx->poll_hits, ==, 0);
+    g_assert_cmpint(ctx->poll_misses, ==, 1);
+
+    /* Polling finds progress without any file descriptor activity */
+    data.ready = data.polls + 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 2);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(ctx->poll_misses, ==, 1);
+
+    /* A handler without io_poll disables polling */
+    aio_set_event_notifier(ctx, &data.e, false, poll_test_read_cb);
+    g_assert_cmpint(ctx->poll_disable_cnt, ==, 1);
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.reads, ==, 3);
+    g_assert_cmpint(ctx->poll_hits, ==, 1);
+    g_assert_cmpint(ctx->poll_misses, ==, 1);
+
+    aio_set_event_notifier(ctx, &data.e, false, NULL);
+    g_assert_cmpint(ctx->poll_disable_cnt, ==, 0);
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -858,6 +927,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll",                    test_poll);
+#endif
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
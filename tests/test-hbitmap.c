@@ -635,6 +635,80 @@ static void test_hbitmap_truncate_shrink_large(TestHBitmapData *data,
     hbitmap_test_truncate(data, size, -diff, 0);
 }
 
+static void hbitmap_test_serialize_range(TestHBitmapData *data,
+                                         uint64_t first, uint64_t count)
+{
+    uint64_t size = data->size;
+    uint64_t chunk = hbitmap_serialization_granularity(data->hb) * 4;
+    uint64_t buf_size = hbitmap_serialization_size(data->hb, 0, size);
+    uint8_t *buf = g_malloc0(buf_size);
+    uint64_t start;
+
+    hbitmap_test_set(data, first, count);
+
+    /* Serialize in pieces, then restore into an empty bitmap */
+    for (start = 0; start < size; start += chunk) {
+        uint64_t cur = MIN(chunk, size - start);
+        hbitmap_serialize_part(data->hb, buf +
+                               hbitmap_serialization_size(data->hb, 0, start),
+                               start, cur);
+    }
+
+    hbitmap_free(data->hb);
+    data->hb = hbitmap_alloc(size, data->granularity);
+    for (start = 0; start < size; start += chunk) {
+        uint64_t cur = MIN(chunk, size - start);
+        hbitmap_deserialize_part(data->hb, buf +
+                                 hbitmap_serialization_size(data->hb, 0, start),
+                                 start, cur, false);
+    }
+    hbitmap_deserialize_finish(data->hb);
+    hbitmap_test_check(data, 0);
+
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_basic(TestHBitmapData *data,
+                                         const void *unused)
+{
+    hbitmap_test_init(data, L3 - 7, 0);
+    hbitmap_test_serialize_range(data, 0, 1);
+    hbitmap_test_serialize_range(data, L2 - 1, L1 + 2);
+    hbitmap_test_serialize_range(data, L3 - 8, 1);
+}
+
+static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
+                                          const void *unused)
+{
+    uint64_t gran;
+
+    hbitmap_test_init(data, L2 * 2, 0);
+    gran = hbitmap_serialization_granularity(data->hb);
+    hbitmap_test_set(data, 0, L2 * 2);
+
+    hbitmap_deserialize_zeroes(data->hb, L2, L2, true);
+    hbitmap_test_reset(data, L2, L2);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L2);
+
+    hbitmap_deserialize_zeroes(data->hb, 0, gran, true);
+    hbitmap_test_reset(data, 0, gran);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, L2 - gran);
+}
+
+static void test_hbitmap_serialize_tail(TestHBitmapData *data,
+                                        const void *unused)
+{
+    uint8_t buf[16];
+
+    /* Bits past the end of the bitmap are dropped when deserializing */
+    hbitmap_test_init(data, 65, 0);
+    g_assert_cmpint(hbitmap_serialization_size(data->hb, 0, 65), <=, 16);
+    memset(buf, 0xff, sizeof(buf));
+    hbitmap_deserialize_part(data->hb, buf, 0, 65, true);
+    hbitmap_test_set(data, 0, 65);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 65);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -684,6 +758,13 @@ int main(int argc, char **argv)
                      test_hbitmap_truncate_grow_large);
     hbitmap_test_add("/hbitmap/truncate/shrink/large",
                      test_hbitmap_truncate_shrink_large);
+
+    hbitmap_test_add("/hbitmap/serialize/basic",
+                     test_hbitmap_serialize_basic);
+    hbitmap_test_add("/hbitmap/serialize/zeroes",
+                     test_hbitmap_serialize_zeroes);
+    hbitmap_test_add("/hbitmap/serialize/tail",
+                     test_hbitmap_serialize_tail);
     g_test_run();
 
     return 0;
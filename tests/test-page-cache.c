@@ -0,0 +1,145 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 64
+#define CACHE_PAGES 64
+
+static void fill_page(uint8_t *page, uint64_t addr)
+{
+    memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static bool page_matches(PageCache *cache, uint64_t addr)
+{
+    uint8_t page[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    fill_page(page, addr);
+    return data && memcmp(data, page, PAGE_SIZE) == 0;
+}
+
+static void insert_pages(PageCache *cache, uint64_t first, int n,
+                         uint64_t age)
+{
+    uint8_t page[PAGE_SIZE];
+    uint64_t addr;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        addr = (first + i) * PAGE_SIZE;
+        fill_page(page, addr);
+        g_assert_cmpint(cache_insert(cache, addr, page, age), ==, 0);
+    }
+}
+
+static void hit_pages(PageCache *cache, uint64_t first, int n, uint64_t age)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        g_assert(cache_is_cached(cache, (first + i) * PAGE_SIZE, age));
+    }
+}
+
+static void test_insert(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint8_t page[PAGE_SIZE];
+    int i;
+
+    g_assert(!cache_is_cached(cache, 0, 1));
+    g_assert(get_cached_data(cache, 0) == NULL);
+
+    /* Contiguous pages fill every set evenly, so they all fit */
+    insert_pages(cache, 0, CACHE_PAGES, 1);
+    for (i = 0; i < CACHE_PAGES; i++) {
+        g_assert(cache_is_cached(cache, i * PAGE_SIZE, 1));
+        g_assert(page_matches(cache, i * PAGE_SIZE));
+    }
+    g_assert(!cache_is_cached(cache, CACHE_PAGES * PAGE_SIZE, 1));
+
+    /* Inserting a cached page again updates it in place */
+    memset(page, 0xff, PAGE_SIZE);
+    g_assert_cmpint(cache_insert(cache, 0, page, 2), ==, 0);
+    g_assert(memcmp(get_cached_data(cache, 0), page, PAGE_SIZE) == 0);
+    for (i = 1; i < CACHE_PAGES; i++) {
+        g_assert(page_matches(cache, i * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+}
+
+/*
+ * Pages that are dirtied in every round must survive a stream of pages
+ * that are dirtied only once.
+ */
+static void test_hot_pages(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    uint64_t age, cold = 1024;
+
+    insert_pages(cache, 0, CACHE_PAGES / 2, 0);
+    for (age = 1; age < 32; age++) {
+        hit_pages(cache, 0, CACHE_PAGES / 2, age);
+        insert_pages(cache, cold, CACHE_PAGES / 2, age);
+        cold += CACHE_PAGES / 2;
+    }
+    hit_pages(cache, 0, CACHE_PAGES / 2, age);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(CACHE_PAGES, PAGE_SIZE);
+    int i;
+
+    insert_pages(cache, 0, CACHE_PAGES, 1);
+
+    /* Growing keeps every page */
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES * 2), ==, CACHE_PAGES * 2);
+    for (i = 0; i < CACHE_PAGES; i++) {
+        g_assert(page_matches(cache, i * PAGE_SIZE));
+    }
+    insert_pages(cache, CACHE_PAGES, CACHE_PAGES, 1);
+    for (i = 0; i < CACHE_PAGES * 2; i++) {
+        g_assert(page_matches(cache, i * PAGE_SIZE));
+    }
+
+    /* Shrinking keeps the pages that were hit */
+    hit_pages(cache, 0, CACHE_PAGES, 2);
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES), ==, CACHE_PAGES);
+    for (i = 0; i < CACHE_PAGES; i++) {
+        g_assert(page_matches(cache, i * PAGE_SIZE));
+    }
+    for (i = CACHE_PAGES; i < CACHE_PAGES * 2; i++) {
+        g_assert(!cache_is_cached(cache, i * PAGE_SIZE, 2));
+    }
+
+    /* Sizes are rounded down to a power of two */
+    g_assert_cmpint(cache_resize(cache, CACHE_PAGES + 1), ==, CACHE_PAGES);
+    g_assert_cmpint(cache_resize(cache, 0), ==, -1);
+    g_assert_cmpint(cache_resize(cache, 1), ==, 1);
+    insert_pages(cache, CACHE_PAGES, 1, 3);
+    g_assert(page_matches(cache, CACHE_PAGES * PAGE_SIZE));
+    g_assert(!cache_is_cached(cache, 0, 3));
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert", test_insert);
+    g_test_add_func("/page-cache/hot_pages", test_hot_pages);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,119 @@
+/*
+ * Page compression codec unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_compress.h"
+
+#define PAGE_SIZE 4096
+
+typedef struct TestPage {
+    const char *name;
+    void (*fill)(uint8_t *page);
+} TestPage;
+
+static void fill_zero(uint8_t *page)
+{
+    memset(page, 0, PAGE_SIZE);
+}
+
+static void fill_text(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = "The quick brown fox jumps over the lazy dog. "[i % 45];
+    }
+}
+
+static void fill_random(uint8_t *page)
+{
+    int i;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        page[i] = g_test_rand_int();
+    }
+}
+
+static const TestPage test_pages[] = {
+    { "zero", fill_zero },
+    { "text", fill_text },
+    { "random", fill_random },
+};
+
+static void test_roundtrip(gconstpointer opaque)
+{
+    MigrationCompressMethod method = GPOINTER_TO_INT(opaque);
+    size_t bound = page_compress_bound(method, PAGE_SIZE);
+    PageCompressor *c = page_compressor_new(method, 1);
+    PageDecompressor *d = page_decompressor_new();
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    uint8_t *comp = g_malloc(bound);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    ssize_t len;
+    int i, j;
+
+    g_assert(page_compressor_method(c) == method);
+
+    for (i = 0; i < ARRAY_SIZE(test_pages); i++) {
+        /* The codec state is reused from one page to the next */
+        for (j = 0; j < 2; j++) {
+            test_pages[i].fill(page);
+            memset(out, 0xaa, PAGE_SIZE);
+
+            len = page_compress(c, comp, bound, page, PAGE_SIZE);
+            g_assert_cmpint(len, >, 0);
+            g_assert_cmpint(len, <=, bound);
+            if (test_pages[i].fill != fill_random) {
+                g_assert_cmpint(len, <, PAGE_SIZE / 4);
+            }
+
+            g_assert_cmpint(page_decompress(d, method, out, PAGE_SIZE,
+                                            comp, len), ==, 0);
+            g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+        }
+    }
+
+    /* Truncated data must not decompress */
+    fill_text(page);
+    len = page_compress(c, comp, bound, page, PAGE_SIZE);
+    g_assert_cmpint(page_decompress(d, method, out, PAGE_SIZE,
+                                    comp, len / 2), ==, -1);
+
+    /* ...and the decompressor must still work afterwards */
+    g_assert_cmpint(page_decompress(d, method, out, PAGE_SIZE,
+                                    comp, len), ==, 0);
+    g_assert(memcmp(page, out, PAGE_SIZE) == 0);
+
+    g_free(out);
+    g_free(comp);
+    g_free(page);
+    page_decompressor_free(d);
+    page_compressor_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    int method;
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_assert(page_compress_method_supported(MIGRATION_COMPRESS_METHOD_ZLIB));
+
+    for (method = 0; method < MIGRATION_COMPRESS_METHOD__MAX; method++) {
+        char *path;
+
+        if (!page_compress_method_supported(method)) {
+            continue;
+        }
+        path = g_strdup_printf("/page-compress/%s",
+                               MigrationCompressMethod_lookup[method]);
+        g_test_add_data_func(path, GINT_TO_POINTER(method), test_roundtrip);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
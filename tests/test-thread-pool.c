@@ -222,6 +222,101 @@ static void test_cancel_async(void)
     do_test_cancel(false);
 }
 
+static int running;
+static int max_running;
+
+static int limit_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+    int cur = atomic_fetch_inc(&running) + 1;
+    int old;
+
+    while ((old = atomic_read(&max_running)) < cur &&
+           atomic_cmpxchg(&max_running, old, cur) != old) {
+        /* retry */
+    }
+    g_usleep(10000);
+    atomic_dec(&running);
+    atomic_inc(&data->n);
+    return 0;
+}
+
+static void test_minmax_threads(void)
+{
+    WorkerTestData data[20];
+    AioContext *small_ctx;
+    ThreadPool *small_pool;
+    int i;
+
+    small_ctx = aio_context_new(&error_abort);
+    aio_context_set_thread_pool_params(small_ctx, 2, 2, &error_abort);
+    small_pool = aio_get_thread_pool(small_ctx);
+
+    /* Requests beyond the second one queue up behind busy workers */
+    max_running = 0;
+    for (i = 0; i < 20; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        thread_pool_submit_aio(small_pool, limit_cb, &data[i],
+                               done_cb, &data[i]);
+    }
+
+    active = 20;
+    while (active > 0) {
+        aio_poll(small_ctx, true);
+    }
+    g_assert_cmpint(max_running, >=, 1);
+    g_assert_cmpint(max_running, <=, 2);
+    for (i = 0; i < 20; i++) {
+        g_assert_cmpint(data[i].n, ==, 1);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    aio_context_unref(small_ctx);
+}
+
+static int perf_submitted;
+static int perf_total;
+
+static void perf_done_cb(void *opaque, int ret)
+{
+    WorkerTestData *data = opaque;
+
+    if (perf_submitted < perf_total) {
+        perf_submitted++;
+        thread_pool_submit_aio(pool, worker_cb, data, perf_done_cb, data);
+    } else {
+        active--;
+    }
+}
+
+static void perf_throughput(void)
+{
+    const int depth = 128;
+    WorkerTestData *data = g_new0(WorkerTestData, depth);
+    double duration;
+    int i;
+
+    perf_total = 1000000;
+    perf_submitted = depth;
+    active = depth;
+
+    g_test_timer_start();
+    for (i = 0; i < depth; i++) {
+        thread_pool_submit_aio(pool, worker_cb, &data[i],
+                               perf_done_cb, &data[i]);
+    }
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%d requests, queue depth %d: %f s, %luK requests/s",
+                   perf_total, depth, duration,
+                   (unsigned long)(perf_total / (duration * 1000)));
+    g_free(data);
+}
+
 int main(int argc, char **argv)
 {
     int ret;
@@ -243,6 +338,10 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/minmax-threads", test_minmax_threads);
+    if (g_test_perf()) {
+        g_test_add_func("/thread-pool/perf/throughput", perf_throughput);
+    }
 
     ret = g_test_run();
 
@@ -174,6 +174,142 @@ static void test_encode_decode(void)
     }
 }
 
+/* Byte at a time encoder to check the accelerated ones against */
+static int encode_reference(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                            uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0, start;
+
+    while (i < slen) {
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (i - start == slen) {
+            return 0;
+        }
+        if (i == slen) {
+            return d;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+
+        if (d + 2 > dlen) {
+            return -1;
+        }
+        start = i;
+        while (i < slen && old_buf[i] != new_buf[i]) {
+            i++;
+        }
+        d += uleb128_encode_small(dst + d, i - start);
+        if (d + i - start > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+/* Change @runs runs of bytes, mostly short ones */
+static void dirty_page(uint8_t *old_buf, uint8_t *new_buf, int slen, int runs)
+{
+    int i, j, start, len;
+
+    memcpy(new_buf, old_buf, slen);
+    for (i = 0; i < runs; i++) {
+        start = g_test_rand_int_range(0, slen);
+        if (g_test_rand_int_range(0, 4)) {
+            len = g_test_rand_int_range(1, 9);
+        } else {
+            len = g_test_rand_int_range(1, 600);
+        }
+        for (j = start; j < start + len && j < slen; j++) {
+            new_buf[j] = old_buf[j] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, j, slen, dlen, ret, expected_ret;
+
+    for (i = 0; i < 10000; i++) {
+        slen = g_test_rand_int_range(1, PAGE_SIZE / 8 + 1) * 8;
+        for (j = 0; j < slen; j++) {
+            old_buf[j] = g_test_rand_int();
+        }
+        dirty_page(old_buf, new_buf, slen, g_test_rand_int_range(0, 20));
+        /* Sometimes leave too little space, to check overflow too */
+        if (g_test_rand_int_range(0, 3)) {
+            dlen = slen;
+        } else {
+            dlen = g_test_rand_int_range(0, slen);
+        }
+
+        expected_ret = encode_reference(old_buf, new_buf, slen,
+                                        expected, dlen);
+        do {
+            ret = xbzrle_encode_buffer(old_buf, new_buf, slen,
+                                       compressed, dlen);
+            g_assert_cmpint(ret, ==, expected_ret);
+            if (ret > 0) {
+                g_assert(memcmp(compressed, expected, ret) == 0);
+            }
+        } while (test_xbzrle_encode_next_accel());
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void test_encode_decode_perf(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, dlen = 0, accel = 0, count = 200000;
+    double elapsed;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    /* A handful of small writes, the case XBZRLE is good at */
+    dirty_page(old_buf, new_buf, PAGE_SIZE, 8);
+
+    do {
+        g_test_timer_start();
+        for (i = 0; i < count; i++) {
+            dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE,
+                                        compressed, PAGE_SIZE);
+        }
+        elapsed = g_test_timer_elapsed();
+        g_test_message("encode, accel %d: %.0f MB/s", accel++,
+                       (double)count * PAGE_SIZE / elapsed / 1000000);
+    } while (test_xbzrle_encode_next_accel());
+
+    g_assert_cmpint(dlen, >, 0);
+    g_test_timer_start();
+    for (i = 0; i < count; i++) {
+        xbzrle_decode_buffer(compressed, dlen, old_buf, PAGE_SIZE);
+    }
+    elapsed = g_test_timer_elapsed();
+    g_test_message("decode: %.0f MB/s",
+                   (double)count * PAGE_SIZE / elapsed / 1000000);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +322,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/encode_decode_perf",
+                        test_encode_decode_perf);
+    }
 
     return g_test_run();
 }
@@ -30,6 +30,7 @@
 #define QVIRTIO_BLK_F_WCE           0x00000200
 #define QVIRTIO_BLK_F_TOPOLOGY      0x00000400
 #define QVIRTIO_BLK_F_CONFIG_WCE    0x00000800
+#define QVIRTIO_BLK_F_MQ            0x00001000
 
 #define QVIRTIO_BLK_T_IN            0
 #define QVIRTIO_BLK_T_OUT           1
@@ -39,6 +40,8 @@
 #define QVIRTIO_BLK_T_FLUSH_OUT     5
 #define QVIRTIO_BLK_T_GET_ID        8
 
+#define QVIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
@@ -73,7 +76,7 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QPCIBus *pci_test_start(void)
+static QPCIBus *pci_test_start_opts(const char *extra_opts)
 {
     char *cmdline;
     char *tmp_path;
@@ -83,8 +86,8 @@ static QPCIBus *pci_test_start(void)
     cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw "
                         "-drive if=none,id=drive1,file=/dev/null,format=raw "
                         "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                        "addr=%x.%x",
-                        tmp_path, PCI_SLOT, PCI_FN);
+                        "addr=%x.%x%s",
+                        tmp_path, PCI_SLOT, PCI_FN, extra_opts);
     qtest_start(cmdline);
     unlink(tmp_path);
     g_free(tmp_path);
@@ -93,6 +96,11 @@ static QPCIBus *pci_test_start(void)
     return qpci_init_pc();
 }
 
+static QPCIBus *pci_test_start(void)
+{
+    return pci_test_start_opts("");
+}
+
 static void arm_test_start(void)
 {
     char *cmdline;
@@ -699,6 +707,48 @@ static void pci_idx(void)
     test_end();
 }
 
+static void pci_mq(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[2];
+    QGuestAllocator *alloc;
+    void *addr;
+    int i;
+
+    bus = pci_test_start_opts(",num-queues=2");
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    g_assert(qvirtio_get_features(&qvirtio_pci, &dev->vdev) &
+             QVIRTIO_BLK_F_MQ);
+
+    /* MSI-X is not enabled */
+    addr = dev->addr + QVIRTIO_PCI_DEVICE_SPECIFIC_NO_MSIX;
+    g_assert_cmpint(qvirtio_config_readw(&qvirtio_pci, &dev->vdev,
+                        (uint64_t)(uintptr_t)addr +
+                        QVIRTIO_BLK_CONFIG_NUM_QUEUES), ==, 2);
+
+    alloc = pc_alloc_init();
+    for (i = 0; i < 2; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci,
+                                                     &dev->vdev, alloc, i);
+    }
+
+    /* Requests on the second queue complete on the second queue */
+    test_basic(&qvirtio_pci, &dev->vdev, alloc, &vqpci[1]->vq,
+                                                    (uint64_t)(uintptr_t)addr);
+
+    /* End test */
+    for (i = 0; i < 2; i++) {
+        guest_free(alloc, vqpci[i]->vq.desc);
+    }
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_hotplug(void)
 {
     QPCIBus *bus;
@@ -775,6 +825,7 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+        qtest_add_func("/virtio/blk/pci/mq", pci_mq);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
@@ -26,6 +26,7 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -39,68 +40,277 @@ struct ThreadPoolElement {
     ThreadPoolFunc *func;
     void *arg;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by worker->lock.
+     * After that, only the thread running the request can write to it.
+     * Reads and writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* The worker whose queue the request was put on.  It may be run by
+     * another worker that stole it, but it never moves to another queue.
+     */
+    ThreadPoolWorker *worker;
+
+    /* Access to this list is protected by worker->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
-    /* Access to this list is protected by the global mutex.  */
+    /* Lock-free list of finished requests, see thread_pool_complete_req.  */
+    QSLIST_ENTRY(ThreadPoolElement) done;
+
+    /* Access to these lists is protected by the global mutex.  */
+    QSIMPLEQ_ENTRY(ThreadPoolElement) completed;
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+
+    /* Posted when idle is cleared, i.e. when there is work to do */
+    QemuSemaphore sem;
+
+    /* The following variables are protected by lock.  */
+    QemuMutex lock;
+    QTAILQ_HEAD(, ThreadPoolElement) request_list;
+    int queued;         /* length of request_list, read locklessly */
+    bool idle;          /* waiting on sem, counted in pool->idle_threads */
+    bool exit;          /* removed from the pool while idle */
+
+    /* Protected by pool->lock.  */
+    QSIMPLEQ_ENTRY(ThreadPoolWorker) new_next;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
-    int max_threads;
     QEMUBH *new_thread_bh;
 
+    /* Finished requests, most recent first.  Workers push to it without
+     * taking any lock; the completion BH takes the whole batch at once.
+     */
+    QSLIST_HEAD(, ThreadPoolElement) done_list;
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) completed;
+
+    /* Accessed with atomic ops, so that workers only need pool->lock
+     * when they have to look at other workers.
+     */
+    int idle_threads;   /* workers waiting for requests */
+    int queued;         /* requests not yet picked up by any worker */
 
     /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
-    int cur_threads;
-    int idle_threads;
-    int new_threads;     /* backlog of threads we need to create */
+    ThreadPoolWorker **workers;
+    int workers_size;
+    int cur_threads;    /* entries in workers, started or not */
+    int next_worker;    /* round-robin cursor into workers */
+    int min_threads;
+    int max_threads;
+    QSIMPLEQ_HEAD(, ThreadPoolWorker) new_workers; /* threads to create */
     int pending_threads; /* threads created but not running yet */
+    int retired_threads; /* removed by set_minmax, not exited yet */
     bool stopping;
 };
 
+static void worker_free(ThreadPoolWorker *w)
+{
+    qemu_sem_destroy(&w->sem);
+    qemu_mutex_destroy(&w->lock);
+    g_free(w);
+}
+
+/* Runs with pool->lock taken.  After this, no request can be queued on
+ * @w anymore.
+ */
+static void worker_remove(ThreadPool *pool, ThreadPoolWorker *w)
+{
+    int i;
+
+    for (i = 0; i < pool->cur_threads; i++) {
+        if (pool->workers[i] == w) {
+            break;
+        }
+    }
+    assert(i < pool->cur_threads);
+
+    pool->workers[i] = pool->workers[--pool->cur_threads];
+    if (pool->next_worker >= pool->cur_threads) {
+        pool->next_worker = 0;
+    }
+}
+
+/* Runs with w->lock taken.  */
+static ThreadPoolElement *worker_dequeue(ThreadPoolWorker *w)
+{
+    ThreadPoolElement *req = QTAILQ_FIRST(&w->request_list);
+
+    if (req) {
+        QTAILQ_REMOVE(&w->request_list, req, reqs);
+        atomic_set(&w->queued, w->queued - 1);
+        atomic_dec(&w->pool->queued);
+        req->state = THREAD_ACTIVE;
+    }
+    return req;
+}
+
+/* Take the oldest request of the worker with the longest queue.  This
+ * keeps requests from waiting behind a slow one while other workers
+ * have nothing to do.
+ */
+static ThreadPoolElement *worker_steal(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    ThreadPoolWorker *victim = NULL;
+    ThreadPoolElement *req = NULL;
+    int i, max_queued = 0;
+
+    if (!atomic_read(&pool->queued)) {
+        return NULL;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->cur_threads; i++) {
+        ThreadPoolWorker *v = pool->workers[i];
+        int queued = atomic_read(&v->queued);
+
+        if (v != w && queued > max_queued) {
+            victim = v;
+            max_queued = queued;
+        }
+    }
+    if (victim) {
+        qemu_mutex_lock(&victim->lock);
+        req = worker_dequeue(victim);
+        qemu_mutex_unlock(&victim->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    if (req) {
+        trace_thread_pool_steal(pool, req, victim, w);
+    }
+    return req;
+}
+
+/* Wait until a request is queued on @w.  Return false if the worker should
+ * exit instead, because it has been idle for a while and there are more
+ * than min_threads workers, or because the pool has shrunk below it.
+ */
+static bool worker_wait(ThreadPoolWorker *w)
+{
+    ThreadPool *pool = w->pool;
+    bool keep = true;
+
+    if (atomic_read(&pool->cur_threads) > atomic_read(&pool->max_threads)) {
+        qemu_mutex_lock(&pool->lock);
+        qemu_mutex_lock(&w->lock);
+        if (QTAILQ_EMPTY(&w->request_list) &&
+            pool->cur_threads > pool->max_threads) {
+            worker_remove(pool, w);
+            qemu_cond_signal(&pool->worker_stopped);
+            keep = false;
+        }
+        qemu_mutex_unlock(&w->lock);
+        qemu_mutex_unlock(&pool->lock);
+        if (!keep) {
+            return false;
+        }
+    }
+
+    qemu_mutex_lock(&w->lock);
+    if (!QTAILQ_EMPTY(&w->request_list) || atomic_read(&pool->stopping)) {
+        qemu_mutex_unlock(&w->lock);
+        return true;
+    }
+    w->idle = true;
+    atomic_inc(&pool->idle_threads);
+    qemu_mutex_unlock(&w->lock);
+
+    while (qemu_sem_timedwait(&w->sem, 10000) < 0) {
+        qemu_mutex_lock(&pool->lock);
+        qemu_mutex_lock(&w->lock);
+        if (!w->idle) {
+            /* Raced with a submission, which has posted the semaphore */
+            qemu_mutex_unlock(&w->lock);
+            qemu_mutex_unlock(&pool->lock);
+            qemu_sem_wait(&w->sem);
+            break;
+        }
+        if (pool->stopping || pool->cur_threads > pool->min_threads) {
+            w->idle = false;
+            atomic_dec(&pool->idle_threads);
+            worker_remove(pool, w);
+            qemu_cond_signal(&pool->worker_stopped);
+            keep = false;
+        }
+        qemu_mutex_unlock(&w->lock);
+        qemu_mutex_unlock(&pool->lock);
+        if (!keep) {
+            return false;
+        }
+    }
+
+    qemu_mutex_lock(&w->lock);
+    keep = !w->exit;
+    qemu_mutex_unlock(&w->lock);
+    return keep;
+}
+
+/* Hand a finished request over to the AioContext.  Only the request that
+ * starts a new batch needs to schedule the completion BH; the others will
+ * be picked up by the same BH invocation.
+ */
+static void thread_pool_complete_req(ThreadPool *pool, ThreadPoolElement *req)
+{
+    ThreadPoolElement *old;
+
+    do {
+        old = atomic_read(&pool->done_list.slh_first);
+        req->done.sle_next = old;
+    } while (atomic_cmpxchg(&pool->done_list.slh_first, old, req) != old);
+
+    if (!old) {
+        qemu_bh_schedule(pool->completion_bh);
+    }
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *w = opaque;
+    ThreadPool *pool = w->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    for (;;) {
         ThreadPoolElement *req;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
+        if (atomic_read(&pool->stopping)) {
             qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
+            worker_remove(pool, w);
+            qemu_cond_signal(&pool->worker_stopped);
+            qemu_mutex_unlock(&pool->lock);
             break;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        qemu_mutex_lock(&w->lock);
+        req = worker_dequeue(w);
+        qemu_mutex_unlock(&w->lock);
+
+        if (!req) {
+            req = worker_steal(w);
+        }
+        if (!req) {
+            if (!worker_wait(w)) {
+                break;
+            }
+            continue;
+        }
 
         ret = req->func(req->arg);
 
@@ -109,30 +319,35 @@ static void *worker_thread(void *opaque)
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
-
-        qemu_bh_schedule(pool->completion_bh);
+        thread_pool_complete_req(pool, req);
     }
 
-    pool->cur_threads--;
-    qemu_cond_signal(&pool->worker_stopped);
-    qemu_mutex_unlock(&pool->lock);
+    if (w->exit) {
+        /* Last access to the pool, thread_pool_free may be waiting */
+        qemu_mutex_lock(&pool->lock);
+        pool->retired_threads--;
+        qemu_cond_signal(&pool->worker_stopped);
+        qemu_mutex_unlock(&pool->lock);
+    }
+    worker_free(w);
     return NULL;
 }
 
 static void do_spawn_thread(ThreadPool *pool)
 {
+    ThreadPoolWorker *w;
     QemuThread t;
 
     /* Runs with lock taken.  */
-    if (!pool->new_threads) {
+    w = QSIMPLEQ_FIRST(&pool->new_workers);
+    if (!w) {
         return;
     }
 
-    pool->new_threads--;
+    QSIMPLEQ_REMOVE_HEAD(&pool->new_workers, new_next);
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread, w, QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -144,10 +359,22 @@ static void spawn_thread_bh_fn(void *opaque)
     qemu_mutex_unlock(&pool->lock);
 }
 
-static void spawn_thread(ThreadPool *pool)
+/* Runs with lock taken.  The new worker can receive requests right away,
+ * it will find them when its thread starts.
+ */
+static ThreadPoolWorker *spawn_thread(ThreadPool *pool)
 {
-    pool->cur_threads++;
-    pool->new_threads++;
+    ThreadPoolWorker *w = g_new0(ThreadPoolWorker, 1);
+
+    w->pool = pool;
+    qemu_mutex_init(&w->lock);
+    qemu_sem_init(&w->sem, 0);
+    QTAILQ_INIT(&w->request_list);
+
+    assert(pool->cur_threads < pool->workers_size);
+    pool->workers[pool->cur_threads++] = w;
+    QSIMPLEQ_INSERT_TAIL(&pool->new_workers, w, new_next);
+
     /* If there are threads being created, they will spawn new workers, so
      * we don't spend time creating many threads in a loop holding a mutex or
      * starving the current vcpu.
@@ -158,18 +385,63 @@ static void spawn_thread(ThreadPool *pool)
     if (!pool->pending_threads) {
         qemu_bh_schedule(pool->new_thread_bh);
     }
+    return w;
+}
+
+/* Choose the worker that will run a new request.  Runs with lock taken.  */
+static ThreadPoolWorker *thread_pool_pick_worker(ThreadPool *pool)
+{
+    ThreadPoolWorker *w;
+    int i;
+
+    /* Prefer an idle worker, starting from the round-robin cursor */
+    if (atomic_read(&pool->idle_threads)) {
+        for (i = 0; i < pool->cur_threads; i++) {
+            int idx = (pool->next_worker + i) % pool->cur_threads;
+
+            w = pool->workers[idx];
+            if (atomic_read(&w->idle)) {
+                pool->next_worker = (idx + 1) % pool->cur_threads;
+                return w;
+            }
+        }
+    }
+
+    if (pool->cur_threads < pool->max_threads) {
+        return spawn_thread(pool);
+    }
+
+    /* Everybody is busy.  Whoever finishes first will steal the request
+     * if its own queue is empty.
+     */
+    w = pool->workers[pool->next_worker];
+    pool->next_worker = (pool->next_worker + 1) % pool->cur_threads;
+    return w;
 }
 
 static void thread_pool_completion_bh(void *opaque)
 {
     ThreadPool *pool = opaque;
-    ThreadPoolElement *elem, *next;
+    QSLIST_HEAD(, ThreadPoolElement) batch;
+    QSIMPLEQ_HEAD(, ThreadPoolElement) in_order =
+        QSIMPLEQ_HEAD_INITIALIZER(in_order);
+    ThreadPoolElement *elem;
+    int n = 0;
+
+    /* Take the whole batch and put it back in completion order */
+    QSLIST_MOVE_ATOMIC(&batch, &pool->done_list);
+    while ((elem = QSLIST_FIRST(&batch)) != NULL) {
+        QSLIST_REMOVE_HEAD(&batch, done);
+        QSIMPLEQ_INSERT_HEAD(&in_order, elem, completed);
+        n++;
+    }
+    if (n) {
+        trace_thread_pool_complete_batch(pool, n);
+    }
+    QSIMPLEQ_CONCAT(&pool->completed, &in_order);
 
-restart:
-    QLIST_FOREACH_SAFE(elem, &pool->head, all, next) {
-        if (elem->state != THREAD_DONE) {
-            continue;
-        }
+    while ((elem = QSIMPLEQ_FIRST(&pool->completed)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->completed, completed);
 
         trace_thread_pool_complete(pool, elem, elem->common.opaque,
                                    elem->ret);
@@ -182,14 +454,13 @@ restart:
             /* Schedule ourselves in case elem->common.cb() calls aio_poll() to
              * wait for another request that completed at the same time.
              */
-            qemu_bh_schedule(pool->completion_bh);
+            if (!QSIMPLEQ_EMPTY(&pool->completed)) {
+                qemu_bh_schedule(pool->completion_bh);
+            }
 
             elem->common.cb(elem->common.opaque, elem->ret);
-            qemu_aio_unref(elem);
-            goto restart;
-        } else {
-            qemu_aio_unref(elem);
         }
+        qemu_aio_unref(elem);
     }
 }
 
@@ -197,24 +468,31 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *w;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
+    /* Workers only go away with an empty queue, and only while holding
+     * pool->lock, so elem->worker is valid as long as elem is queued.
+     */
     qemu_mutex_lock(&pool->lock);
-    if (elem->state == THREAD_QUEUED &&
-        /* No thread has yet started working on elem. we can try to "steal"
-         * the item from the worker if we can get a signal from the
-         * semaphore.  Because this is non-blocking, we can do it with
-         * the lock taken and ensure that elem will remain THREAD_QUEUED.
-         */
-        qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
-        qemu_bh_schedule(pool->completion_bh);
+    if (atomic_read(&elem->state) == THREAD_QUEUED) {
+        w = elem->worker;
+        qemu_mutex_lock(&w->lock);
+        if (elem->state == THREAD_QUEUED) {
+            /* No thread has yet started working on elem, so we can take
+             * it off the queue.
+             */
+            QTAILQ_REMOVE(&w->request_list, elem, reqs);
+            atomic_set(&w->queued, w->queued - 1);
+            atomic_dec(&pool->queued);
 
-        elem->state = THREAD_DONE;
-        elem->ret = -ECANCELED;
+            elem->state = THREAD_DONE;
+            elem->ret = -ECANCELED;
+            thread_pool_complete_req(pool, elem);
+        }
+        qemu_mutex_unlock(&w->lock);
     }
-
     qemu_mutex_unlock(&pool->lock);
 }
 
@@ -236,6 +514,7 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *w;
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
@@ -248,12 +527,20 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
     trace_thread_pool_submit(pool, req, arg);
 
     qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    w = thread_pool_pick_worker(pool);
+    req->worker = w;
+
+    qemu_mutex_lock(&w->lock);
+    QTAILQ_INSERT_TAIL(&w->request_list, req, reqs);
+    atomic_set(&w->queued, w->queued + 1);
+    atomic_inc(&pool->queued);
+    if (w->idle) {
+        atomic_set(&w->idle, false);
+        atomic_dec(&pool->idle_threads);
+        qemu_sem_post(&w->sem);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
+    qemu_mutex_unlock(&w->lock);
     qemu_mutex_unlock(&pool->lock);
-    qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
@@ -285,6 +572,48 @@ void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_set_minmax_threads(ThreadPool *pool,
+                                    int min_threads, int max_threads)
+{
+    ThreadPoolWorker *w;
+    int i;
+
+    assert(min_threads >= 0 && min_threads <= max_threads && max_threads > 0);
+
+    qemu_mutex_lock(&pool->lock);
+    pool->min_threads = min_threads;
+    atomic_set(&pool->max_threads, max_threads);
+
+    if (pool->workers_size < max_threads) {
+        pool->workers = g_renew(ThreadPoolWorker *, pool->workers,
+                                max_threads);
+        pool->workers_size = max_threads;
+    }
+
+    /* Let idle workers above the new maximum go; busy ones will exit as
+     * soon as they run out of work.
+     */
+    for (i = pool->cur_threads - 1;
+         i >= 0 && pool->cur_threads > max_threads; i--) {
+        w = pool->workers[i];
+        qemu_mutex_lock(&w->lock);
+        if (w->idle) {
+            w->idle = false;
+            w->exit = true;
+            atomic_dec(&pool->idle_threads);
+            worker_remove(pool, w);
+            pool->retired_threads++;
+            qemu_sem_post(&w->sem);
+        }
+        qemu_mutex_unlock(&w->lock);
+    }
+
+    while (pool->cur_threads < pool->min_threads) {
+        spawn_thread(pool);
+    }
+    qemu_mutex_unlock(&pool->lock);
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
     if (!ctx) {
@@ -296,12 +625,14 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     pool->completion_bh = aio_bh_new(ctx, thread_pool_completion_bh, pool);
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
-    qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
+    QSIMPLEQ_INIT(&pool->completed);
+    QSIMPLEQ_INIT(&pool->new_workers);
+
+    thread_pool_set_minmax_threads(pool, ctx->thread_pool_min,
+                                   ctx->thread_pool_max);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +644,9 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    ThreadPoolWorker *w;
+    int i;
+
     if (!pool) {
         return;
     }
@@ -323,21 +657,35 @@ void thread_pool_free(ThreadPool *pool)
 
     /* Stop new threads from spawning */
     qemu_bh_delete(pool->new_thread_bh);
-    pool->cur_threads -= pool->new_threads;
-    pool->new_threads = 0;
+    while ((w = QSIMPLEQ_FIRST(&pool->new_workers)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&pool->new_workers, new_next);
+        worker_remove(pool, w);
+        worker_free(w);
+    }
 
-    /* Wait for worker threads to terminate */
-    pool->stopping = true;
-    while (pool->cur_threads > 0) {
-        qemu_sem_post(&pool->sem);
+    /* Wait for worker threads to terminate, including the ones that
+     * thread_pool_set_minmax_threads() has already taken out of the pool.
+     */
+    atomic_set(&pool->stopping, true);
+    while (pool->cur_threads > 0 || pool->retired_threads > 0) {
+        for (i = 0; i < pool->cur_threads; i++) {
+            w = pool->workers[i];
+            qemu_mutex_lock(&w->lock);
+            if (w->idle) {
+                w->idle = false;
+                atomic_dec(&pool->idle_threads);
+                qemu_sem_post(&w->sem);
+            }
+            qemu_mutex_unlock(&w->lock);
+        }
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
     }
 
     qemu_mutex_unlock(&pool->lock);
 
     qemu_bh_delete(pool->completion_bh);
-    qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
+    g_free(pool->workers);
     g_free(pool);
 }